@@ -0,0 +1,87 @@
+/*
+    Office presence aggregator fusing reports of presence sensors
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "indextable.h"
+
+const unsigned int INITIAL_CAPACITY = 1024;
+
+// defined for uses that take its address, e.g. as a vector fill value
+const uint32_t IndexTable::NOT_FOUND;
+
+IndexTable::IndexTable() :
+    m_mask(0), m_size(0)
+{
+    clear();
+}
+
+uint32_t IndexTable::find(uint64_t key) const
+{
+    for (uint64_t i = mix(key) & m_mask; ; i = (i + 1) & m_mask)
+    {
+        const Slot& slot = m_slots[i];
+        if (slot.index == NOT_FOUND) return NOT_FOUND;
+        if (slot.key == key) return slot.index;
+    }
+}
+
+void IndexTable::insert(uint64_t key, uint32_t index)
+{
+    // keep at most 3/4 of the slots used so that probe sequences stay short
+    if ((m_size + 1) * 4 > m_slots.size() * 3) grow();
+
+    for (uint64_t i = mix(key) & m_mask; ; i = (i + 1) & m_mask)
+    {
+        Slot& slot = m_slots[i];
+        if (slot.index == NOT_FOUND)
+        {
+            slot.key = key;
+            slot.index = index;
+            m_size++;
+            return;
+        }
+        if (slot.key == key)
+        {
+            slot.index = index;
+            return;
+        }
+    }
+}
+
+void IndexTable::clear()
+{
+    Slot empty = {0, NOT_FOUND};
+    m_slots.assign(INITIAL_CAPACITY, empty);
+    m_mask = INITIAL_CAPACITY - 1;
+    m_size = 0;
+}
+
+unsigned int IndexTable::size() const
+{
+    return m_size;
+}
+
+// mac addresses share their vendor prefix, spread the bits before masking
+uint64_t IndexTable::mix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void IndexTable::grow()
+{
+    std::vector<Slot> old;
+    old.swap(m_slots);
+
+    Slot empty = {0, NOT_FOUND};
+    m_slots.assign(old.size() * 2, empty);
+    m_mask = m_slots.size() - 1;
+    m_size = 0;
+    for (unsigned int i = 0; i < old.size(); i++)
+    {
+        if (old[i].index != NOT_FOUND) insert(old[i].key, old[i].index);
+    }
+}
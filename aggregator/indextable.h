@@ -0,0 +1,46 @@
+/*
+    Office presence aggregator fusing reports of presence sensors
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef INDEXTABLE_H
+#define INDEXTABLE_H
+
+#include <vector>
+#include <stdint.h>
+
+// open addressing hash table from 64 bit keys to 32 bit indexes. slots are
+// 12 bytes in one flat array, so lookups touch a single cache line in the
+// common case and there is no allocation per entry
+class IndexTable
+{
+public:
+    static const uint32_t NOT_FOUND = 0xffffffff;
+
+    IndexTable();
+
+    // returns index stored for key or NOT_FOUND
+    uint32_t find(uint64_t key) const;
+
+    // stores index for key, replacing a previous one
+    void insert(uint64_t key, uint32_t index);
+
+    void clear();
+    unsigned int size() const;
+
+private:
+    struct Slot
+    {
+        uint64_t key;
+        uint32_t index;
+    } __attribute__((packed));
+
+    static uint64_t mix(uint64_t key);
+    void grow();
+
+    std::vector<Slot> m_slots;
+    uint64_t m_mask;
+    unsigned int m_size;
+};
+
+#endif // INDEXTABLE_H
@@ -0,0 +1,20 @@
+/*
+    Office presence aggregator fusing reports of presence sensors
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include <string>
+#include "presenceaggregator.h"
+
+int main(int argc, char **argv)
+{
+    std::string configFileName("config.ini");
+    if (argc > 1)
+    {
+        configFileName = argv[1];
+    }
+    PresenceAggregator aggregator;
+    if (!aggregator.initAll(configFileName)) return 1;
+    aggregator.run();
+    return 0;
+}
@@ -0,0 +1,784 @@
+/*
+    Office presence aggregator fusing reports of presence sensors
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "presenceaggregator.h"
+#include "macaddress.h"
+
+#include <sstream>
+#include <algorithm>
+#include <ctype.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+const std::string DEFAULT_BROKER_ADDRESS = "localhost";
+const uint16_t DEFAULT_BROKER_PORT = 1883;
+const std::string DEFAULT_DATA_FETCH_URL = "localhost:8181/api/connection";
+const int16_t DEFAULT_CONNECT_ATTEMPT_INTERVAL = 5;
+const int DEFAULT_DB_RETRY_INTERVAL = 30;
+const std::string DEFAULT_AGGREGATOR_ID = "presence-aggregator";
+const std::string DEFAULT_PERSON_FIELD = "user";
+const int DEFAULT_PRESENCE_WINDOW = 300;
+const int DEFAULT_ABSENT_REPORTS = 3;
+const int DEFAULT_FLUSH_INTERVAL = 250;
+const std::string DEFAULT_OUTPUT_TOPIC = "presence/bluetooth";
+const std::string DEFAULT_METRICS_ADDRESS = "127.0.0.1";
+const uint16_t DEFAULT_METRICS_PORT = 0;
+const std::string DEFAULT_LOG_LEVEL = "info";
+
+// how long connecting to the brokers may take, in ms
+const int BROKER_CONNECT_TIMEOUT = 5000;
+
+// how long to wait for messages when there are none, in ms
+const int RECEIVE_TIMEOUT = 100;
+
+// messages read from the broker before they are handled
+const unsigned int MAX_BATCH = 10000;
+
+// sighting keys leave 16 bits for the sensor
+const unsigned int MAX_SENSORS = 0xffff;
+
+// states of the device database fetch
+enum TaskState
+{
+    TASK_IDLE = 0,
+    TASK_RUNNING,
+    TASK_DONE
+};
+
+static volatile bool quit = false;
+
+AggregatorConfig::AggregatorConfig() :
+    brokerAddress(DEFAULT_BROKER_ADDRESS),
+    brokerPort(DEFAULT_BROKER_PORT),
+    dataFetchUrl(DEFAULT_DATA_FETCH_URL),
+    connectAttemptInterval(DEFAULT_CONNECT_ATTEMPT_INTERVAL),
+    dbRetryInterval(DEFAULT_DB_RETRY_INTERVAL),
+    aggregatorID(DEFAULT_AGGREGATOR_ID),
+    personField(DEFAULT_PERSON_FIELD),
+    presenceWindow(DEFAULT_PRESENCE_WINDOW),
+    absentReports(DEFAULT_ABSENT_REPORTS),
+    flushInterval(DEFAULT_FLUSH_INTERVAL),
+    outputTopic(DEFAULT_OUTPUT_TOPIC),
+    metricsAddress(DEFAULT_METRICS_ADDRESS),
+    metricsPort(DEFAULT_METRICS_PORT),
+    logLevel(LOG_INFO)
+{
+    parseBrokerList(DEFAULT_BROKER_ADDRESS, DEFAULT_BROKER_PORT, brokers);
+}
+
+// handler for Ctrl+C, quits program
+void siginthandler(int param)
+{
+    (void)param; //prevent warning
+
+    quit = true;
+}
+
+PresenceAggregator::PresenceAggregator() :
+    m_mosquitto(0),
+    m_dataGetter(0),
+    m_pendingTransitions(0),
+    m_lastFlush(0),
+    m_updateDBNeeded(true),
+    m_nextDBUpdate(0),
+    m_fetchState(TASK_IDLE),
+    m_fetchThreadStarted(false),
+    m_fetchSucceeded(false)
+{
+    Logger::init(LOG_INFO);
+    registerMetrics();
+    signal(SIGINT, siginthandler);
+}
+
+PresenceAggregator::~PresenceAggregator()
+{
+    m_metricsServer.shutdown();
+
+    // the fetching thread uses the data getter, stop it first
+    if (m_fetchThreadStarted)
+    {
+        m_dataGetter->cancel();
+        pthread_join(m_fetchThread, NULL);
+    }
+
+    if (m_dataGetter)
+    {
+        delete m_dataGetter;
+        m_dataGetter = 0;
+    }
+    if (m_mosquitto)
+    {
+        delete m_mosquitto;
+        m_mosquitto = 0;
+    }
+
+    Logger::shutdown();
+}
+
+bool PresenceAggregator::initAll(std::string configFileName)
+{
+    print("Reading config file...");
+    if (!readConfig(configFileName, m_config))
+    {
+        print("Cannot parse config file. Using default values");
+    }
+    Logger::setLevel(m_config.logLevel);
+
+    if (m_config.metricsPort != 0)
+    {
+        if (m_metricsServer.init(&m_metrics, m_config.metricsAddress, m_config.metricsPort))
+        {
+            std::stringstream ss;
+            ss << "Serving metrics at http://" << m_config.metricsAddress << ":" << m_config.metricsPort << "/metrics";
+            print(ss.str());
+        }
+        else
+        {
+            printError(m_metricsServer.getLastErrorString());
+        }
+    }
+
+    print("Initializing Curl...");
+    m_dataGetter = new DataGetter();
+    if (!m_dataGetter->init())
+    {
+        printError(m_dataGetter->getLastErrorString());
+        return false;
+    }
+
+    print("Initializing Mosquitto... ");
+    m_mosquitto = new MosquittoHandler;
+    if (!m_mosquitto->init(m_config.aggregatorID))
+    {
+        printError(m_mosquitto->getLastErrorString());
+        return false;
+    }
+
+    // subscriptions are made whenever the connection is
+    print("Connecting to broker... ");
+    subscribeTopics();
+    if (!m_mosquitto->connectToAny(m_config.brokers, BROKER_CONNECT_TIMEOUT))
+    {
+        printError(m_mosquitto->getLastErrorString());
+        if (!connectMosquitto(false)) return false;
+    }
+    print("Connected to broker " + m_mosquitto->connectedBroker());
+
+    return true;
+}
+
+void PresenceAggregator::run()
+{
+    print("Running, CTRL+C to quit...");
+
+    uint32_t lastExpiry = 0;
+
+    while (!quit)
+    {
+        // people are reported by their device addresses until the database is
+        // there. it's fetched in the background so that reports keep flowing
+        checkDeviceDatabaseFetch();
+        if (m_updateDBNeeded && time(NULL) >= m_nextDBUpdate) startDeviceDatabaseFetch();
+
+        // don't wait past the next flush
+        int timeout = RECEIVE_TIMEOUT;
+        if (m_pendingTransitions > 0)
+        {
+            int64_t untilFlush = (int64_t)m_config.flushInterval * 1000 - (int64_t)(monotonicMicroseconds() - m_lastFlush);
+            timeout = std::max<int64_t>(0, std::min<int64_t>(timeout, untilFlush / 1000));
+        }
+        receiveMessages(timeout);
+
+        uint64_t start = monotonicMicroseconds();
+        uint32_t now = time(NULL);
+        for (unsigned int i = 0; i < m_messages.size(); i++)
+        {
+            const mqttMessage& message = m_messages[i];
+            if (message.topic == "command/fetch_device_database")
+            {
+                m_updateDBNeeded = true;
+                m_nextDBUpdate = 0;
+            }
+            else
+            {
+                handleReport(message, now);
+            }
+        }
+        if (!m_messages.empty())
+        {
+            m_batches->add();
+            m_batchDuration->record(monotonicMicroseconds() - start);
+        }
+
+        if (now != lastExpiry)
+        {
+            expireSightings(now);
+            lastExpiry = now;
+
+            m_devicesGauge->set(m_devices.size());
+            m_sightingsGauge->set(m_sightings.size());
+        }
+
+        if (m_pendingTransitions > 0 && monotonicMicroseconds() - m_lastFlush >= (uint64_t)m_config.flushInterval * 1000)
+        {
+            flushTransitions();
+        }
+
+        if (!m_mosquitto->isConnected())
+        {
+            printError("Mosquitto disconnected");
+            connectMosquitto(true);
+        }
+    }
+
+    flushTransitions();
+    m_mosquitto->loop();
+}
+
+// reads all messages the broker has for us, waiting at most timeout ms for the first ones
+void PresenceAggregator::receiveMessages(int timeout)
+{
+    m_mosquitto->loop(timeout);
+
+    // each loop handles at most one incoming packet, keep going while they arrive
+    unsigned int count = m_mosquitto->arrivedCount();
+    while (count > 0 && count < MAX_BATCH)
+    {
+        m_mosquitto->loop();
+        unsigned int newCount = m_mosquitto->arrivedCount();
+        if (newCount == count) break;
+        count = newCount;
+    }
+    m_mosquitto->takeArrivedMessages(m_messages);
+}
+
+// handles sensor/<id>/bluetooth/available|unavailable
+void PresenceAggregator::handleReport(const mqttMessage& message, uint32_t now)
+{
+    const std::string& topic = message.topic;
+    size_t idEnd = topic.find('/', 7);
+    if (topic.compare(0, 7, "sensor/") != 0 || idEnd == std::string::npos ||
+        topic.compare(idEnd, 11, "/bluetooth/") != 0)
+    {
+        m_ignoredReports->add();
+        return;
+    }
+    bool available = topic.compare(idEnd + 11, std::string::npos, "available") == 0;
+    if (!available && topic.compare(idEnd + 11, std::string::npos, "unavailable") != 0)
+    {
+        m_ignoredReports->add();
+        return;
+    }
+
+    uint64_t address;
+    if (!parseMacAddress(message.content, address))
+    {
+        m_ignoredReports->add();
+        return;
+    }
+    m_reports->add();
+
+    uint32_t device = deviceFor(address);
+    uint16_t sensor = sensorFor(topic.substr(7, idEnd - 7));
+
+    uint64_t key = ((uint64_t)device << 16) | sensor;
+    uint32_t index = m_sightingIndex.find(key);
+    if (index == IndexTable::NOT_FOUND)
+    {
+        // unavailable reports of devices nobody has seen don't need tracking
+        if (!available) return;
+
+        Sighting sighting = {device, sensor, 0, 0, now};
+        index = m_sightings.size();
+        m_sightings.push_back(sighting);
+        m_sightingIndex.insert(key, index);
+    }
+
+    Sighting& sighting = m_sightings[index];
+    if (available)
+    {
+        sighting.lastAvailable = now;
+        sighting.misses = 0;
+        if (!sighting.present) setPresent(sighting, true);
+    }
+    else if (sighting.present)
+    {
+        // single failed probes are common, a device is gone after several of them
+        if (sighting.misses < 0xff) sighting.misses++;
+        if (m_config.absentReports > 0 && sighting.misses >= m_config.absentReports) setPresent(sighting, false);
+    }
+}
+
+// returns index of device with given address, adding it if needed
+uint32_t PresenceAggregator::deviceFor(uint64_t address)
+{
+    uint32_t index = m_deviceIndex.find(address);
+    if (index != IndexTable::NOT_FOUND) return index;
+
+    // devices missing from the database are people of their own
+    Device device = {address, personFor(formatMacAddress(address))};
+    index = m_devices.size();
+    m_devices.push_back(device);
+    m_deviceIndex.insert(address, index);
+    return index;
+}
+
+// returns index of sensor with given id, adding it if needed
+uint16_t PresenceAggregator::sensorFor(const std::string& sensorID)
+{
+    std::map<std::string, uint16_t>::const_iterator it = m_sensorIndex.find(sensorID);
+    if (it != m_sensorIndex.end()) return it->second;
+
+    // sensors beyond the limit share the last index
+    if (m_sensors.size() >= MAX_SENSORS) return MAX_SENSORS - 1;
+
+    // config file keys are lower case
+    std::string key = sensorID;
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    std::map<std::string, std::string>::const_iterator zone = m_config.zones.find(key);
+    Sensor sensor;
+    sensor.id = sensorID;
+    sensor.zone = zoneFor(zone != m_config.zones.end() ? zone->second : sensorID);
+
+    uint16_t index = m_sensors.size();
+    m_sensors.push_back(sensor);
+    m_sensorIndex[sensorID] = index;
+    print("New sensor " + sensorID + " in zone " + m_zones.at(sensor.zone));
+    return index;
+}
+
+// returns index of zone with given name, adding it if needed
+uint16_t PresenceAggregator::zoneFor(const std::string& name)
+{
+    std::map<std::string, uint16_t>::const_iterator it = m_zoneIndex.find(name);
+    if (it != m_zoneIndex.end()) return it->second;
+
+    uint16_t index = m_zones.size();
+    m_zones.push_back(name);
+    m_zoneIndex[name] = index;
+    return index;
+}
+
+// returns index of person with given name, adding it if needed
+uint32_t PresenceAggregator::personFor(const std::string& name)
+{
+    std::map<std::string, uint32_t>::const_iterator it = m_personIndex.find(name);
+    if (it != m_personIndex.end()) return it->second;
+
+    Person person;
+    person.name = name;
+    person.presentSightings = 0;
+
+    uint32_t index = m_persons.size();
+    m_persons.push_back(person);
+    m_personIndex[name] = index;
+    return index;
+}
+
+// keeps the devices listed in the database and those present somewhere,
+// the people of those devices and the present sightings. absent sightings
+// are made again by the next available report
+void PresenceAggregator::pruneTables(const std::vector<bool>& listed)
+{
+    std::vector<bool> keep(listed);
+    keep.resize(m_devices.size(), false);
+    for (unsigned int i = 0; i < m_sightings.size(); i++)
+    {
+        if (m_sightings[i].present) keep[m_sightings[i].device] = true;
+    }
+
+    std::vector<uint32_t> deviceMap(m_devices.size(), IndexTable::NOT_FOUND);
+    std::vector<uint32_t> personMap(m_persons.size(), IndexTable::NOT_FOUND);
+    std::vector<Device> devices;
+    std::vector<Person> persons;
+    m_deviceIndex.clear();
+    m_personIndex.clear();
+    for (unsigned int i = 0; i < m_devices.size(); i++)
+    {
+        if (!keep[i]) continue;
+
+        Device device = m_devices[i];
+        if (personMap[device.person] == IndexTable::NOT_FOUND)
+        {
+            personMap[device.person] = persons.size();
+            m_personIndex[m_persons[device.person].name] = persons.size();
+            persons.push_back(m_persons[device.person]);
+        }
+        device.person = personMap[device.person];
+
+        deviceMap[i] = devices.size();
+        m_deviceIndex.insert(device.address, devices.size());
+        devices.push_back(device);
+    }
+
+    std::vector<Sighting> sightings;
+    m_sightingIndex.clear();
+    for (unsigned int i = 0; i < m_sightings.size(); i++)
+    {
+        if (!m_sightings[i].present) continue;
+
+        Sighting sighting = m_sightings[i];
+        sighting.device = deviceMap[sighting.device];
+        m_sightingIndex.insert(((uint64_t)sighting.device << 16) | sighting.sensor, sightings.size());
+        sightings.push_back(sighting);
+    }
+
+    // only people with present sightings have zone counts, and their devices are kept
+    std::map<uint64_t, uint32_t> personZones;
+    for (std::map<uint64_t, uint32_t>::const_iterator it = m_personZones.begin(); it != m_personZones.end(); ++it)
+    {
+        uint32_t person = personMap[it->first >> 16];
+        if (person == IndexTable::NOT_FOUND) continue;
+        personZones[((uint64_t)person << 16) | (it->first & 0xffff)] = it->second;
+    }
+
+    m_devices.swap(devices);
+    m_persons.swap(persons);
+    m_sightings.swap(sightings);
+    m_personZones.swap(personZones);
+}
+
+// marks sighting present or absent and updates presence of its person
+void PresenceAggregator::setPresent(Sighting& sighting, bool present)
+{
+    sighting.present = present;
+    changePresence(m_devices[sighting.device].person, m_sensors[sighting.sensor].zone, present);
+}
+
+// adds change of one sighting to presence counts of a person, records
+// transitions when the person arrives to or leaves a zone or the whole area
+void PresenceAggregator::changePresence(uint32_t person, uint16_t zone, bool present)
+{
+    uint32_t& zoneCount = m_personZones[((uint64_t)person << 16) | zone];
+    uint32_t& count = m_persons[person].presentSightings;
+
+    if (present)
+    {
+        if (count++ == 0) addTransition(person, -1, true);
+        if (zoneCount++ == 0) addTransition(person, zone, true);
+        m_presentGauge->set(m_presentGauge->value() + 1);
+    }
+    else
+    {
+        if (--zoneCount == 0)
+        {
+            addTransition(person, zone, false);
+            m_personZones.erase(((uint64_t)person << 16) | zone);
+        }
+        if (--count == 0) addTransition(person, -1, false);
+        m_presentGauge->set(m_presentGauge->value() - 1);
+    }
+}
+
+// drops sightings which haven't been reported available within the presence window
+void PresenceAggregator::expireSightings(uint32_t now)
+{
+    for (unsigned int i = 0; i < m_sightings.size(); i++)
+    {
+        Sighting& sighting = m_sightings[i];
+        if (sighting.present && now - sighting.lastAvailable > (uint32_t)m_config.presenceWindow)
+        {
+            setPresent(sighting, false);
+        }
+    }
+}
+
+// adds a transition to the next batch. zone -1 means the whole area
+void PresenceAggregator::addTransition(uint32_t person, int zone, bool present)
+{
+    if (m_pendingTransitions == 0)
+    {
+        m_transitions.clear();
+        m_transitions.beginObject();
+        m_transitions.key("time");
+        m_transitions.value((long long)time(NULL));
+        m_transitions.key("transitions");
+        m_transitions.beginArray();
+    }
+
+    m_transitions.beginObject();
+    m_transitions.key("person");
+    m_transitions.value(m_persons[person].name);
+    if (zone >= 0)
+    {
+        m_transitions.key("zone");
+        m_transitions.value(m_zones[zone]);
+    }
+    m_transitions.key("present");
+    m_transitions.value(present);
+    m_transitions.endObject();
+
+    m_pendingTransitions++;
+    m_transitionsCounter->add();
+}
+
+// publishes transitions collected since the previous flush in one message
+void PresenceAggregator::flushTransitions()
+{
+    m_lastFlush = monotonicMicroseconds();
+    if (m_pendingTransitions == 0) return;
+
+    m_transitions.endArray();
+    m_transitions.endObject();
+
+    if (!m_mosquitto->publish(std::string(m_config.outputTopic + "/transitions").c_str(), m_transitions.c_str()))
+    {
+        printError(m_mosquitto->getLastErrorString());
+    }
+    m_mosquitto->loopWrite();
+
+    std::stringstream ss;
+    ss << "Published " << m_pendingTransitions << " presence transitions";
+    Logger::write(LOG_DEBUG, ss.str());
+    m_pendingTransitions = 0;
+}
+
+void PresenceAggregator::startDeviceDatabaseFetch()
+{
+    // a fetch already in progress will deliver the newest data anyway
+    if (m_fetchState != TASK_IDLE) return;
+
+    print("Fetching device database...");
+
+    m_updateDBNeeded = false;
+    m_fetchUrl = m_config.dataFetchUrl;
+    m_fetchedData.clear();
+    m_fetchState = TASK_RUNNING;
+
+    m_fetchThreadStarted = pthread_create(&m_fetchThread, NULL, PresenceAggregator::fetchThreadWrapper, this) == 0;
+    if (!m_fetchThreadStarted) fetchDeviceDatabase();
+}
+
+// gets device info json from server. called in a background thread
+void PresenceAggregator::fetchDeviceDatabase()
+{
+    m_fetchSucceeded = m_dataGetter->get(m_fetchUrl, m_fetchedData);
+    if (!m_fetchSucceeded) m_fetchError = m_dataGetter->getLastErrorString();
+    __sync_lock_test_and_set(&m_fetchState, TASK_DONE);
+}
+
+void* PresenceAggregator::fetchThreadWrapper(void* obj)
+{
+    PresenceAggregator* aggregator = (PresenceAggregator*) obj;
+    aggregator->fetchDeviceDatabase();
+    return 0;
+}
+
+// takes the fetched database into use once the fetch has completed,
+// schedules a retry if it failed
+void PresenceAggregator::checkDeviceDatabaseFetch()
+{
+    if (__sync_fetch_and_add(&m_fetchState, 0) != TASK_DONE) return;
+
+    if (m_fetchThreadStarted)
+    {
+        pthread_join(m_fetchThread, NULL);
+        m_fetchThreadStarted = false;
+    }
+    m_fetchState = TASK_IDLE;
+
+    bool ok = m_fetchSucceeded;
+    if (ok)
+    {
+        ok = updateDeviceDatabase(m_fetchedData);
+    }
+    else
+    {
+        printError(m_fetchError);
+    }
+
+    if (!ok)
+    {
+        m_updateDBNeeded = true;
+        m_nextDBUpdate = time(NULL) + m_config.dbRetryInterval;
+    }
+}
+
+// maps devices of the fetched device info json to people
+bool PresenceAggregator::updateDeviceDatabase(const std::string& data)
+{
+    Json::Value root;
+    Json::Reader reader;
+    if (!reader.parse(data, root))
+    {
+        printError("Failed to parse device data\n" + reader.getFormatedErrorMessages());
+        return false;
+    }
+
+    // database may also come in the versioned form pushed to the sensors
+    if (root.isObject()) root = root["devices"];
+    applyDeviceDatabase(root);
+    return true;
+}
+
+// maps devices of the database to people. devices which change owner carry
+// their current presence over to the new person
+void PresenceAggregator::applyDeviceDatabase(const Json::Value& list)
+{
+    if (!list.isArray()) return;
+
+    // devices found in the database, the others are dropped unless present
+    std::vector<bool> listed(m_devices.size(), false);
+    unsigned int devices = 0;
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        // jsoncpp throws on get() of a non-object and asString() of a non-string
+        if (!list[i].isObject() || !list[i]["identifier"].isString()) continue;
+        if (list[i].get("type", "") != "bluetooth") continue;
+
+        uint64_t address;
+        std::string identifier = list[i]["identifier"].asString();
+        if (!parseMacAddress(identifier, address)) continue;
+        devices++;
+
+        // person may be given by a numeric id as well, it's then used as written
+        const Json::Value& field = list[i][m_config.personField];
+        std::string name;
+        if (field.isString())
+        {
+            name = field.asString();
+        }
+        else if (!field.isNull())
+        {
+            Json::FastWriter writer;
+            name = writer.write(field);
+            name.erase(name.find_last_not_of("\n") + 1);
+        }
+        if (name.empty()) name = formatMacAddress(address);
+
+        uint32_t device = deviceFor(address);
+        if (device >= listed.size()) listed.resize(device + 1, false);
+        listed[device] = true;
+
+        uint32_t person = personFor(name);
+        uint32_t oldPerson = m_devices[device].person;
+        if (person == oldPerson) continue;
+
+        for (unsigned int s = 0; s < m_sightings.size(); s++)
+        {
+            if (m_sightings[s].device != device || !m_sightings[s].present) continue;
+            changePresence(oldPerson, m_sensors[m_sightings[s].sensor].zone, false);
+            changePresence(person, m_sensors[m_sightings[s].sensor].zone, true);
+        }
+        m_devices[device].person = person;
+    }
+    pruneTables(listed);
+
+    std::stringstream ss;
+    ss << devices << " devices of " << m_persons.size() << " people in the database";
+    print(ss.str());
+}
+
+// tries to connect mosquitto until connected or quitted
+bool PresenceAggregator::connectMosquitto(bool reconnect)
+{
+    int attempts = 0;
+    while (!quit)
+    {
+        if (reconnect || attempts > 0)
+        {
+            std::stringstream ss;
+            ss << (reconnect ? "Reconnecting " : "Connecting ") << "Mosquitto attempt #" << attempts + 1 << "...";
+            print(ss.str());
+            if (m_mosquitto->connectToAny(m_config.brokers, BROKER_CONNECT_TIMEOUT))
+            {
+                print("Mosquitto connected to " + m_mosquitto->connectedBroker());
+                return true;
+            }
+        }
+        attempts++;
+
+        // wait for given interval before next attempt, check once a second if quit is requested
+        for (int timer = 0; timer < m_config.connectAttemptInterval && !quit; timer++) sleep(1);
+    }
+    return false;
+}
+
+void PresenceAggregator::subscribeTopics()
+{
+    m_mosquitto->subscribe("sensor/+/bluetooth/available");
+    m_mosquitto->subscribe("sensor/+/bluetooth/unavailable");
+    m_mosquitto->subscribe("command/fetch_device_database");
+}
+
+// reads config file, missing values are set to defaults
+bool PresenceAggregator::readConfig(std::string configFileName, AggregatorConfig& config)
+{
+    config = AggregatorConfig();
+
+    dictionary* ini;
+    ini = iniparser_load(configFileName.c_str());
+    if (!ini) return false;
+
+    config.brokerAddress = iniparser_getstring(ini, ":broker_address",
+                                          (char*)DEFAULT_BROKER_ADDRESS.c_str());
+    config.brokerPort = iniparser_getint(ini, ":broker_port",
+                                    DEFAULT_BROKER_PORT);
+    parseBrokerList(config.brokerAddress, config.brokerPort, config.brokers);
+    config.dataFetchUrl = iniparser_getstring(ini, ":data_fetch_url",
+                                          (char*)DEFAULT_DATA_FETCH_URL.c_str());
+    config.connectAttemptInterval = iniparser_getint(ini, ":connect_attempt_interval",
+                                    DEFAULT_CONNECT_ATTEMPT_INTERVAL);
+    config.dbRetryInterval = iniparser_getint(ini, ":db_retry_interval",
+                                    DEFAULT_DB_RETRY_INTERVAL);
+    config.aggregatorID = iniparser_getstring(ini, ":aggregator_id",
+                                          (char*)DEFAULT_AGGREGATOR_ID.c_str());
+    config.personField = iniparser_getstring(ini, ":person_field",
+                                          (char*)DEFAULT_PERSON_FIELD.c_str());
+    config.presenceWindow = iniparser_getint(ini, ":presence_window",
+                                    DEFAULT_PRESENCE_WINDOW);
+    config.absentReports = iniparser_getint(ini, ":absent_reports",
+                                    DEFAULT_ABSENT_REPORTS);
+    config.flushInterval = iniparser_getint(ini, ":flush_interval",
+                                    DEFAULT_FLUSH_INTERVAL);
+    config.outputTopic = iniparser_getstring(ini, ":output_topic",
+                                          (char*)DEFAULT_OUTPUT_TOPIC.c_str());
+    config.metricsAddress = iniparser_getstring(ini, ":metrics_address",
+                                          (char*)DEFAULT_METRICS_ADDRESS.c_str());
+    config.metricsPort = iniparser_getint(ini, ":metrics_port",
+                                    DEFAULT_METRICS_PORT);
+    config.logLevel = Logger::levelFromString(iniparser_getstring(ini, ":log_level",
+                                          (char*)DEFAULT_LOG_LEVEL.c_str()), LOG_INFO);
+
+    // [zones] section maps sensor ids to zone names
+    int keys = iniparser_getsecnkeys(ini, (char*)"zones");
+    char** names = iniparser_getseckeys(ini, (char*)"zones");
+    for (int i = 0; names && i < keys; i++)
+    {
+        // keys are returned as zones:<sensor id in lower case>
+        std::string key = names[i];
+        config.zones[key.substr(6)] = iniparser_getstring(ini, names[i], (char*)"");
+    }
+    if (names) free(names);
+
+    iniparser_freedict(ini);
+    return true;
+}
+
+void PresenceAggregator::registerMetrics()
+{
+    m_reports = m_metrics.counter("presence_aggregator_reports_total", "Sensor reports handled");
+    m_ignoredReports = m_metrics.counter("presence_aggregator_ignored_reports_total",
+                                         "Messages that weren't valid sensor reports");
+    m_transitionsCounter = m_metrics.counter("presence_aggregator_transitions_total",
+                                             "Presence transitions published");
+    m_batches = m_metrics.counter("presence_aggregator_batches_total", "Batches of messages handled");
+    m_batchDuration = m_metrics.histogram("presence_aggregator_batch_duration_seconds",
+                                          "Time taken to handle a batch of messages");
+    m_devicesGauge = m_metrics.gauge("presence_aggregator_devices", "Devices known");
+    m_sightingsGauge = m_metrics.gauge("presence_aggregator_sightings", "Device and sensor pairs tracked");
+    m_presentGauge = m_metrics.gauge("presence_aggregator_present_sightings", "Sightings currently present");
+}
+
+void PresenceAggregator::print(std::string str)
+{
+    Logger::write(LOG_INFO, str);
+}
+
+void PresenceAggregator::printError(std::string str)
+{
+    Logger::write(LOG_ERROR, str);
+}
@@ -0,0 +1,203 @@
+/*
+    Office presence aggregator fusing reports of presence sensors
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef PRESENCEAGGREGATOR_H
+#define PRESENCEAGGREGATOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "json/json.h"
+#include "iniparser.h"
+
+#include "mosquittohandler.h"
+#include "datagetter.h"
+#include "jsonwriter.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include "indextable.h"
+
+// settings read from the config file
+struct AggregatorConfig
+{
+    AggregatorConfig();
+
+    // broker_address may list several brokers, the one answering first is used
+    std::string brokerAddress;
+    uint16_t brokerPort;
+    std::vector<BrokerAddress> brokers;
+    std::string dataFetchUrl;
+    int16_t connectAttemptInterval;
+    int dbRetryInterval;
+    std::string aggregatorID;
+    std::string personField;
+    int presenceWindow;
+    int absentReports;
+    int flushInterval;
+    std::string outputTopic;
+    std::string metricsAddress;
+    uint16_t metricsPort;
+    LogLevel logLevel;
+
+    // zone of each sensor, sensors not listed are zones of their own
+    std::map<std::string, std::string> zones;
+};
+
+// combines available/unavailable reports of all bluetooth sensors into
+// presence of people, overall and per zone, and publishes the changes in
+// batches
+class PresenceAggregator
+{
+public:
+    PresenceAggregator();
+    ~PresenceAggregator();
+
+    bool initAll(std::string configFileName);
+    void run();
+
+private:
+    // a device seen by one sensor
+    struct Sighting
+    {
+        uint32_t device;
+        uint16_t sensor;
+        uint8_t present;
+
+        // unavailable reports since the last available one
+        uint8_t misses;
+        uint32_t lastAvailable;
+    };
+
+    struct Device
+    {
+        uint64_t address;
+        uint32_t person;
+    };
+
+    struct Sensor
+    {
+        std::string id;
+        uint16_t zone;
+    };
+
+    struct Person
+    {
+        std::string name;
+
+        // present sightings of the person's devices
+        uint32_t presentSightings;
+    };
+
+    // reads config file, missing values are set to defaults
+    bool readConfig(std::string configFileName, AggregatorConfig& config);
+
+    // gets device info json from server in a background thread
+    void startDeviceDatabaseFetch();
+    void fetchDeviceDatabase();
+    static void* fetchThreadWrapper(void* obj);
+
+    // takes the fetched database into use once the fetch has completed
+    void checkDeviceDatabaseFetch();
+
+    // maps devices of the database to people
+    bool updateDeviceDatabase(const std::string& data);
+    void applyDeviceDatabase(const Json::Value& list);
+
+    // reads all messages the broker has for us, waiting at most timeout ms for the first ones
+    void receiveMessages(int timeout);
+
+    // handles sensor/<id>/bluetooth/available|unavailable
+    void handleReport(const mqttMessage& message, uint32_t now);
+
+    uint32_t deviceFor(uint64_t address);
+    uint16_t sensorFor(const std::string& sensorID);
+    uint16_t zoneFor(const std::string& name);
+    uint32_t personFor(const std::string& name);
+
+    // drops devices and people the database no longer has, indexes are renumbered
+    void pruneTables(const std::vector<bool>& listed);
+
+    // marks sighting present or absent and updates presence of its person
+    void setPresent(Sighting& sighting, bool present);
+
+    // adds change of one sighting to presence counts of a person, records transitions
+    void changePresence(uint32_t person, uint16_t zone, bool present);
+
+    // drops sightings which haven't been reported available within the presence window
+    void expireSightings(uint32_t now);
+
+    void addTransition(uint32_t person, int zone, bool present);
+
+    // publishes transitions collected since the previous flush in one message
+    void flushTransitions();
+
+    // tries to connect mosquitto until connected or quitted
+    bool connectMosquitto(bool reconnect);
+    void subscribeTopics();
+
+    void registerMetrics();
+
+    void print(std::string str);
+    void printError(std::string str);
+
+    MosquittoHandler* m_mosquitto;
+    DataGetter* m_dataGetter;
+    AggregatorConfig m_config;
+
+    std::vector<Device> m_devices;
+    IndexTable m_deviceIndex;
+
+    // key is device << 16 | sensor
+    std::vector<Sighting> m_sightings;
+    IndexTable m_sightingIndex;
+
+    std::vector<Sensor> m_sensors;
+    std::map<std::string, uint16_t> m_sensorIndex;
+    std::vector<std::string> m_zones;
+    std::map<std::string, uint16_t> m_zoneIndex;
+    std::vector<Person> m_persons;
+    std::map<std::string, uint32_t> m_personIndex;
+
+    // present sightings per person and zone, key is person << 16 | zone
+    std::map<uint64_t, uint32_t> m_personZones;
+
+    // batch of incoming messages, reused between rounds
+    std::vector<mqttMessage> m_messages;
+
+    // transitions waiting for the next flush
+    JsonWriter m_transitions;
+    unsigned int m_pendingTransitions;
+    uint64_t m_lastFlush;
+
+    bool m_updateDBNeeded;
+    time_t m_nextDBUpdate;
+
+    // device database fetch, state is shared with the fetching thread
+    pthread_t m_fetchThread;
+    volatile int m_fetchState;
+    bool m_fetchThreadStarted;
+    std::string m_fetchUrl;
+    std::string m_fetchedData;
+    std::string m_fetchError;
+    bool m_fetchSucceeded;
+
+    MetricsRegistry m_metrics;
+    MetricsServer m_metricsServer;
+    Counter* m_reports;
+    Counter* m_ignoredReports;
+    Counter* m_transitionsCounter;
+    Counter* m_batches;
+    Histogram* m_batchDuration;
+    Gauge* m_devicesGauge;
+    Gauge* m_sightingsGauge;
+    Gauge* m_presentGauge;
+};
+
+#endif // PRESENCEAGGREGATOR_H
@@ -4,120 +4,662 @@
 */
 
 #include "bluetoothpoller.h"
+#include "radiosimulator.h"
+#include "inputlog.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <algorithm>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
 
-BluetoothPoller::BluetoothPoller() : m_socket(0)
+// how long to wait for an echo response or a connection, in ms. an absent
+// device keeps the page going for 5.12 s
+const int ECHO_TIMEOUT = 6000;
+const int CONNECTION_TIMEOUT = 25000;
+const int DISCONNECT_TIMEOUT = 10000;
+
+// the adapter always completes a name request, this is only a safety net
+const int NAME_REQUEST_TIMEOUT = 25000;
+
+// inquiry of 8 * 1.28 s, and the margin for its completion event
+const uint8_t INQUIRY_LENGTH = 8;
+const int INQUIRY_TIMEOUT = INQUIRY_LENGTH * 1280 + 5000;
+
+// how often a failed adapter is tried to be reopened, in sec
+const int ADAPTER_REOPEN_INTERVAL = 1;
+
+// general inquiry access code 0x9e8b33, least significant byte first
+const uint8_t GIAC[3] = {0x33, 0x8b, 0x9e};
+
+// bytes of payload sent with an echo request
+const int ECHO_SIZE = 20;
+
+// blocking waits check this often if the probe has been cancelled, in ms
+const int CANCEL_CHECK_INTERVAL = 100;
+
+static const char* PROBE_STRATEGY_NAMES[PROBE_STRATEGY_COUNT] = {"name", "echo", "connection"};
+
+const char* probeStrategyName(ProbeStrategy strategy)
+{
+    if (strategy < 0 || strategy >= PROBE_STRATEGY_COUNT) return "unknown";
+    return PROBE_STRATEGY_NAMES[strategy];
+}
+
+bool parseProbeStrategy(const std::string& name, ProbeStrategy& strategy)
 {
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++)
+    {
+        if (name == PROBE_STRATEGY_NAMES[i])
+        {
+            strategy = (ProbeStrategy)i;
+            return true;
+        }
+    }
+    return false;
+}
 
+BluetoothPoller::BluetoothPoller() : m_devId(-1), m_socket(-1), m_echoIdent(1), m_adapterHealthy(true), m_lastDevId(-1),
+    m_nextReopen(0), m_pendingOpcode(0), m_commandFailed(false), m_commandStarted(false),
+    m_nameDone(false), m_nameFound(false), m_inquiryDone(false), m_foundCount(0), m_cancelSocket(-1), m_operation(OPERATION_NONE),
+    m_cancelled(false), m_simulator(0), m_replay(0)
+{
+    m_name[0] = 0;
+    pthread_mutex_init(&m_cancelMutex, NULL);
 }
 
 BluetoothPoller::~BluetoothPoller()
 {
     shutdown();
+    pthread_mutex_destroy(&m_cancelMutex);
 }
 
 bool BluetoothPoller::init(std::string& address)
 {
+    // only the events of the commands sent here are let through
+    const uint8_t events[] = {EVT_CMD_STATUS, EVT_REMOTE_NAME_REQ_COMPLETE, EVT_INQUIRY_RESULT,
+                              EVT_INQUIRY_RESULT_WITH_RSSI, EVT_EXTENDED_INQUIRY_RESULT, EVT_INQUIRY_COMPLETE};
+    for (unsigned int i = 0; i < sizeof(events); i++) m_events.setHandler(events[i], BluetoothPoller::eventWrapper, this);
+
+    if (!openAdapter()) return false;
+
+    char addr[19] = {0};
+    ba2str((bdaddr_t*)m_adapter, addr);
+    address = addr;
+
+    // without adapter events a failed adapter is still noticed from the failing calls
+    m_deviceEvents.setHandler(EVT_STACK_INTERNAL, BluetoothPoller::deviceEventWrapper, this);
+    m_deviceEvents.open(HCI_DEV_NONE);
+
+    m_lastErrorString = "";
+    return true;
+}
+
+bool BluetoothPoller::initSimulated(std::string& address, double presence, double latencyScale)
+{
+    m_simulator = new RadioSimulator(presence, latencyScale);
+    address = m_simulator->adapterAddress();
+
+    m_lastErrorString = "";
+    return true;
+}
+
+bool BluetoothPoller::initReplay(std::string& address, InputReplay* replay)
+{
+    m_replay = replay;
+    address = m_replay->adapterAddress();
+
+    m_lastErrorString = "";
+    return true;
+}
+
+void BluetoothPoller::shutdown()
+{
+    m_deviceEvents.close();
+    closeAdapter();
+    if (m_simulator)
+    {
+        delete m_simulator;
+        m_simulator = 0;
+    }
+}
+
+int BluetoothPoller::deviceId() const
+{
+    return m_devId;
+}
+
+bool BluetoothPoller::checkAdapter()
+{
+    if (m_simulator || m_replay) return true;
+
+    m_deviceEvents.dispatch(0);
+    if (m_adapterHealthy) return true;
+
+    time_t now = time(NULL);
+    if (now < m_nextReopen || m_cancelled) return false;
+    m_nextReopen = now + ADAPTER_REOPEN_INTERVAL;
+
+    m_adapterHealthy = openAdapter();
+    return m_adapterHealthy;
+}
+
+bool BluetoothPoller::isAdapterHealthy() const
+{
+    return m_adapterHealthy;
+}
+
+bool BluetoothPoller::openAdapter()
+{
+    closeAdapter();
+
+    // an adapter that has been reset comes back down, bring it up like hciconfig does
+    if (m_lastDevId >= 0)
+    {
+        int ctl = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+        if (ctl >= 0)
+        {
+            ioctl(ctl, HCIDEVUP, m_lastDevId);
+            close(ctl);
+        }
+    }
+
     // open bt socket
     int dev_id = hci_get_route(NULL);
     m_socket = hci_open_dev( dev_id );
-    if (dev_id < 0 || m_socket < 0)
+    int cancelSocket = hci_open_dev( dev_id );
+    pthread_mutex_lock(&m_cancelMutex);
+    m_cancelSocket = cancelSocket;
+    pthread_mutex_unlock(&m_cancelMutex);
+    if (dev_id < 0 || m_socket < 0 || m_cancelSocket < 0 || !m_events.open(dev_id))
     {
+        closeAdapter();
         m_lastErrorString = "Cannot open bluetooth socket";
         return false;
     }
+    m_devId = dev_id;
+    m_lastDevId = dev_id;
 
     // get device address
     hci_dev_info di;
     hci_devinfo(dev_id, &di);
-    char addr[19] = {0};
-    ba2str(&di.bdaddr, addr);
-    address = addr;
+    memcpy(m_adapter, &di.bdaddr, sizeof(m_adapter));
 
     m_lastErrorString = "";
     return true;
 }
 
-void BluetoothPoller::shutdown()
+void BluetoothPoller::closeAdapter()
+{
+    m_events.close();
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+    pthread_mutex_lock(&m_cancelMutex);
+    if (m_cancelSocket >= 0)
+    {
+        close(m_cancelSocket);
+        m_cancelSocket = -1;
+    }
+    pthread_mutex_unlock(&m_cancelMutex);
+    m_devId = -1;
+}
+
+// a device out of range times out or answers with an error status, only
+// the socket calls themselves fail like this when the adapter is gone
+void BluetoothPoller::checkError()
+{
+    if (errno != ENETDOWN && errno != ENODEV && errno != EBADFD && errno != ENXIO && errno != EPIPE) return;
+    adapterFailed();
+}
+
+// the adapter is given a moment to settle after a reset before it's reopened
+void BluetoothPoller::adapterFailed()
 {
-    close(m_socket);
+    if (!m_adapterHealthy) return;
+    m_adapterHealthy = false;
+    m_nextReopen = time(NULL) + ADAPTER_REOPEN_INTERVAL;
 }
 
-bool BluetoothPoller::scanDevice(std::string BTAddress)
+// the adapter in use going down or away fails it, any adapter coming up
+// makes reopening try right away
+void BluetoothPoller::handleDeviceEvent(const uint8_t* data, uint8_t size)
 {
-    char name[248] = {0};
+    if (size < 2 + sizeof(evt_si_device)) return;
+
+    const evt_stack_internal* internal = (const evt_stack_internal*)data;
+    if (btohs(internal->type) != EVT_SI_DEVICE) return;
+
+    const evt_si_device* device = (const evt_si_device*)internal->data;
+    uint16_t event = btohs(device->event);
+    int devId = btohs(device->dev_id);
+    if ((event == HCI_DEV_DOWN || event == HCI_DEV_UNREG) && devId == m_devId)
+    {
+        adapterFailed();
+    }
+    else if ((event == HCI_DEV_UP || event == HCI_DEV_REG) && !m_adapterHealthy)
+    {
+        m_nextReopen = 0;
+    }
+}
+
+void BluetoothPoller::deviceEventWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size)
+{
+    BluetoothPoller* poller = (BluetoothPoller*) obj;
+    poller->handleDeviceEvent(data, size);
+}
+
+bool BluetoothPoller::scanDevice(std::string BTAddress, ProbeStrategy strategy)
+{
+    if (m_cancelled) return false;
+    if (m_replay) return m_replay->scanDevice(BTAddress);
+    if (m_simulator) return m_simulator->scanDevice(BTAddress, strategy);
+    if (!m_adapterHealthy) return false;
 
     bdaddr_t ba;
     str2ba(BTAddress.c_str(), &ba);
+    setTarget((const uint8_t*)&ba);
+
+    switch (strategy)
+    {
+    case PROBE_L2CAP_ECHO:
+        return probeEcho();
+    case PROBE_CONNECTION:
+        return probeConnection();
+    default:
+        return probeNameRequest();
+    }
+}
 
-    int res = hci_read_remote_name(m_socket, &ba, sizeof(name), name, 0);
+// asks the name of the device, the name itself isn't needed
+bool BluetoothPoller::probeNameRequest()
+{
+    return requestName();
+}
 
-    if (res == -1)
+// sends an l2cap echo request and waits for the response, like l2ping
+bool BluetoothPoller::probeEcho()
+{
+    int sock = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_L2CAP);
+    if (sock < 0)
     {
+        checkError();
         return false;
     }
-    else
+
+    sockaddr_l2 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.l2_family = AF_BLUETOOTH;
+    memcpy(&addr.l2_bdaddr, m_adapter, sizeof(addr.l2_bdaddr));
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0)
     {
-        return true;
+        checkError();
+        close(sock);
+        return false;
     }
+
+    // connecting pages the device, done without blocking so that it can be cancelled
+    memset(&addr, 0, sizeof(addr));
+    addr.l2_family = AF_BLUETOOTH;
+    memcpy(&addr.l2_bdaddr, m_target, sizeof(addr.l2_bdaddr));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        checkError();
+        close(sock);
+        return false;
+    }
+
+    timeval start;
+    gettimeofday(&start, NULL);
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    if (!waitSocket(sock, POLLOUT, ECHO_TIMEOUT) ||
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorSize) < 0 || error != 0)
+    {
+        close(sock);
+        return false;
+    }
+
+    uint8_t ident = m_echoIdent;
+    m_echoIdent = m_echoIdent == 254 ? 1 : m_echoIdent + 1;
+
+    uint8_t request[L2CAP_CMD_HDR_SIZE + ECHO_SIZE];
+    l2cap_cmd_hdr* header = (l2cap_cmd_hdr*)request;
+    header->code = L2CAP_ECHO_REQ;
+    header->ident = ident;
+    header->len = htobs(ECHO_SIZE);
+    memset(request + L2CAP_CMD_HDR_SIZE, 'A', ECHO_SIZE);
+    if (send(sock, request, sizeof(request), 0) != (ssize_t)sizeof(request))
+    {
+        close(sock);
+        return false;
+    }
+
+    // other signaling traffic may arrive before the response
+    bool answered = false;
+    uint8_t response[L2CAP_CMD_HDR_SIZE + 256];
+    while (!answered)
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+        int left = ECHO_TIMEOUT - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+        if (left <= 0 || !waitSocket(sock, POLLIN, left)) break;
+
+        ssize_t size = recv(sock, response, sizeof(response), 0);
+        if (size < 0 && errno != EAGAIN) break;
+        if (size < L2CAP_CMD_HDR_SIZE) continue;
+
+        header = (l2cap_cmd_hdr*)response;
+        answered = header->code == L2CAP_ECHO_RSP && header->ident == ident;
+    }
+
+    close(sock);
+    return answered;
 }
 
-bool BluetoothPoller::discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices)
+// connects the device and disconnects right after the connection is up
+bool BluetoothPoller::probeConnection()
 {
-    int num_rsp = 0;
-    int dev_id = 0;
-    char addr[19] = {0};
-    char name[248] = {0};
+    uint16_t handle = 0;
+    uint16_t packetTypes = HCI_DM1 | HCI_DM3 | HCI_DM5 | HCI_DH1 | HCI_DH3 | HCI_DH5;
+
+    setOperation(OPERATION_CONNECTION);
+    int res = -1;
+    if (!m_cancelled)
+    {
+        res = hci_create_connection(m_socket, (bdaddr_t*)m_target, htobs(packetTypes), 0, 0x01,
+                                    &handle, CONNECTION_TIMEOUT);
+    }
+    setOperation(OPERATION_NONE);
+    if (res < 0)
+    {
+        checkError();
+        return false;
+    }
 
-    int len  = 8;
-    int max_rsp = 255;
-    int flags = IREQ_CACHE_FLUSH;
+    hci_disconnect(m_socket, handle, HCI_OE_USER_ENDED_CONNECTION, DISCONNECT_TIMEOUT);
+    return true;
+}
 
-    inquiry_info *ii = NULL;
-    ii = (inquiry_info*)malloc(max_rsp * sizeof(inquiry_info));
+// polls in short steps so that a cancel is noticed
+bool BluetoothPoller::waitSocket(int sock, short events, int timeout)
+{
+    pollfd fd;
+    fd.fd = sock;
+    fd.events = events;
+    while (timeout > 0 && !m_cancelled)
+    {
+        int step = std::min(timeout, CANCEL_CHECK_INTERVAL);
+        fd.revents = 0;
+        int res = poll(&fd, 1, step);
+        if (res > 0) return (fd.revents & events) != 0;
+        if (res < 0 && errno != EINTR) return false;
+        timeout -= step;
+    }
+    return false;
+}
 
-    num_rsp = hci_inquiry(dev_id, len, max_rsp, NULL, &ii, flags);
-    if( num_rsp < 0 )
+bool BluetoothPoller::discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices)
+{
+    if (m_cancelled)
     {
-        m_lastErrorString = "hci_inquiry error";
+        m_lastErrorString = "Cancelled";
+        return false;
+    }
+    if (m_replay)
+    {
+        bool ok = m_replay->discoverDevices(discoveredDevices);
+        m_lastErrorString = m_replay->getLastErrorString();
+        return ok;
+    }
+    if (m_simulator)
+    {
+        m_simulator->discoverDevices(discoveredDevices);
+        m_lastErrorString = "";
+        return true;
+    }
+    if (!m_adapterHealthy)
+    {
+        m_lastErrorString = "Bluetooth adapter failed";
         return false;
     }
 
-    discoveredDevices.clear();
+    // results are collected from the events as they come, so an office full
+    // of devices answering doesn't cost a system call each
+    inquiry_cp cp;
+    memcpy(cp.lap, GIAC, sizeof(cp.lap));
+    cp.length = INQUIRY_LENGTH;
+    cp.num_rsp = 0;
+    m_foundCount = 0;
+    m_inquiryDone = false;
 
-    for (int i = 0; i < num_rsp; i++) {
-        ba2str(&(ii+i)->bdaddr, addr);
-        std::string str(addr);
+    setOperation(OPERATION_INQUIRY);
+    bool ok = runCommand(OCF_INQUIRY, INQUIRY_CP_SIZE, &cp, m_inquiryDone, INQUIRY_TIMEOUT);
+    setOperation(OPERATION_NONE);
+    if (!ok)
+    {
+        m_lastErrorString = m_adapterHealthy ? "Inquiry failed" : "Bluetooth adapter failed";
+        return false;
+    }
 
-        if (hci_read_remote_name(m_socket, &(ii+i)->bdaddr, sizeof(name), name, 0) < 0)
-        {
-            strcpy(name, "[unknown]");
-        }
+    discoveredDevices.clear();
+    for (unsigned int i = 0; i < m_foundCount; i++)
+    {
+        char addr[19] = {0};
+        ba2str((bdaddr_t*)m_found[i], addr);
 
+        setTarget(m_found[i]);
         DiscoveredDevice newDevice;
         newDevice.btAddress = addr;
-        newDevice.name = name;
+        newDevice.name = requestName() ? m_name : "[unknown]";
         discoveredDevices.push_back(newDevice);
     }
 
-    free(ii);
-
     m_lastErrorString = "";
     return true;
 }
 
+// stops the probe or discovery in progress. the blocking call returns with an
+// error once the adapter reports the command finished
+void BluetoothPoller::cancel()
+{
+    m_cancelled = true;
+    __sync_synchronize();
+
+    if (m_replay) m_replay->cancel();
+    if (m_simulator) m_simulator->cancel();
+
+    // the main thread may be reopening the adapter meanwhile
+    pthread_mutex_lock(&m_cancelMutex);
+    if (m_cancelSocket >= 0 && m_operation == OPERATION_NAME_REQUEST)
+    {
+        remote_name_req_cancel_cp cp;
+        memcpy(&cp.bdaddr, m_target, sizeof(cp.bdaddr));
+        hci_send_cmd(m_cancelSocket, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL,
+                     REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp);
+    }
+    else if (m_cancelSocket >= 0 && m_operation == OPERATION_CONNECTION)
+    {
+        create_conn_cancel_cp cp;
+        memcpy(&cp.bdaddr, m_target, sizeof(cp.bdaddr));
+        hci_send_cmd(m_cancelSocket, OGF_LINK_CTL, OCF_CREATE_CONN_CANCEL,
+                     CREATE_CONN_CANCEL_CP_SIZE, &cp);
+    }
+    else if (m_cancelSocket >= 0 && m_operation == OPERATION_INQUIRY)
+    {
+        hci_send_cmd(m_cancelSocket, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, NULL);
+    }
+    pthread_mutex_unlock(&m_cancelMutex);
+}
+
+void BluetoothPoller::setOperation(int operation)
+{
+    pthread_mutex_lock(&m_cancelMutex);
+    m_operation = operation;
+    pthread_mutex_unlock(&m_cancelMutex);
+}
+
+void BluetoothPoller::setTarget(const uint8_t* address)
+{
+    pthread_mutex_lock(&m_cancelMutex);
+    memcpy(m_target, address, sizeof(m_target));
+    pthread_mutex_unlock(&m_cancelMutex);
+}
+
+void BluetoothPoller::takeEventStats(uint64_t& events, uint64_t& reads)
+{
+    m_events.takeStats(events, reads);
+}
+
 std::string BluetoothPoller::getLastErrorString()
 {
     return m_lastErrorString;
 }
 
+// asks name of the device in m_target. the adapter answers with a command
+// status and, unless that failed, a name request complete event
+bool BluetoothPoller::requestName()
+{
+    remote_name_req_cp cp;
+    memset(&cp, 0, sizeof(cp));
+    memcpy(&cp.bdaddr, m_target, sizeof(cp.bdaddr));
+    cp.pscan_rep_mode = 0x02;
+    m_nameDone = false;
+    m_nameFound = false;
+    m_name[0] = 0;
+
+    setOperation(OPERATION_NAME_REQUEST);
+    bool ok = runCommand(OCF_REMOTE_NAME_REQ, REMOTE_NAME_REQ_CP_SIZE, &cp, m_nameDone, NAME_REQUEST_TIMEOUT);
+    setOperation(OPERATION_NONE);
+
+    // a request given up on would keep the adapter busy
+    if (!m_nameDone && !m_commandFailed)
+    {
+        remote_name_req_cancel_cp cancelCp;
+        memcpy(&cancelCp.bdaddr, m_target, sizeof(cancelCp.bdaddr));
+        hci_send_cmd(m_socket, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL, REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cancelCp);
+    }
+
+    return ok && m_nameFound;
+}
+
+bool BluetoothPoller::runCommand(uint16_t ocf, uint8_t size, void* parameters, bool& done, int timeout)
+{
+    if (m_cancelled) return false;
+
+    // events left from an abandoned command would be taken as results of this
+    // one. they are read away here, and results only count once the adapter
+    // has reported this command started, in case more of them are on the way
+    m_pendingOpcode = 0;
+    m_commandStarted = false;
+    m_events.dispatch(0);
+
+    m_pendingOpcode = cmd_opcode_pack(OGF_LINK_CTL, ocf);
+    m_commandFailed = false;
+    if (hci_send_cmd(m_socket, OGF_LINK_CTL, ocf, size, parameters) < 0)
+    {
+        checkError();
+        m_pendingOpcode = 0;
+        return false;
+    }
+
+    timeval start;
+    gettimeofday(&start, NULL);
+    while (!done && !m_commandFailed && !m_cancelled)
+    {
+        timeval now;
+        gettimeofday(&now, NULL);
+        int left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+        if (left <= 0) break;
+
+        // the event socket only fails when the adapter does
+        if (!m_events.dispatch(std::min(left, CANCEL_CHECK_INTERVAL)))
+        {
+            adapterFailed();
+            break;
+        }
+    }
+    m_pendingOpcode = 0;
+    m_commandStarted = false;
+    return done && !m_commandFailed;
+}
+
+void BluetoothPoller::handleEvent(uint8_t event, const uint8_t* data, uint8_t size)
+{
+    if (event == EVT_CMD_STATUS && size >= EVT_CMD_STATUS_SIZE)
+    {
+        const evt_cmd_status* status = (const evt_cmd_status*)data;
+        if (m_pendingOpcode != 0 && btohs(status->opcode) == m_pendingOpcode)
+        {
+            if (status->status != 0) m_commandFailed = true;
+            else m_commandStarted = true;
+        }
+    }
+    else if (!m_commandStarted)
+    {
+        // results of an earlier command still coming in
+        return;
+    }
+    else if (event == EVT_REMOTE_NAME_REQ_COMPLETE && size >= 1 + 6 && m_operation == OPERATION_NAME_REQUEST)
+    {
+        const evt_remote_name_req_complete* complete = (const evt_remote_name_req_complete*)data;
+        if (memcmp(&complete->bdaddr, m_target, sizeof(m_target)) != 0) return;
+
+        m_nameDone = true;
+        m_nameFound = complete->status == 0;
+        unsigned int length = std::min<unsigned int>(size - 1 - 6, sizeof(m_name) - 1);
+        memcpy(m_name, complete->name, length);
+        m_name[length] = 0;
+    }
+    else if (m_operation != OPERATION_INQUIRY)
+    {
+        return;
+    }
+    else if (event == EVT_INQUIRY_COMPLETE)
+    {
+        m_inquiryDone = true;
+    }
+    else if (size >= 1)
+    {
+        // results start with their count, each result with the address
+        unsigned int resultSize = INQUIRY_INFO_SIZE;
+        if (event == EVT_INQUIRY_RESULT_WITH_RSSI) resultSize = INQUIRY_INFO_WITH_RSSI_SIZE;
+        if (event == EVT_EXTENDED_INQUIRY_RESULT) resultSize = EXTENDED_INQUIRY_INFO_SIZE;
+        for (unsigned int i = 0; i < data[0] && 1 + (i + 1) * resultSize <= size; i++)
+        {
+            addInquiryResult(data + 1 + i * resultSize);
+        }
+    }
+}
+
+void BluetoothPoller::eventWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size)
+{
+    BluetoothPoller* poller = (BluetoothPoller*) obj;
+    poller->handleEvent(event, data, size);
+}
+
+void BluetoothPoller::addInquiryResult(const uint8_t* address)
+{
+    for (unsigned int i = 0; i < m_foundCount; i++)
+    {
+        if (memcmp(m_found[i], address, 6) == 0) return;
+    }
+    if (m_foundCount < MAX_INQUIRY_RESULTS) memcpy(m_found[m_foundCount++], address, 6);
+}
+
 
 
 
@@ -8,6 +8,14 @@
 
 #include <vector>
 #include <iostream>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hcieventreader.h"
+
+class RadioSimulator;
+class InputReplay;
 
 struct DiscoveredDevice
 {
@@ -15,6 +23,22 @@ struct DiscoveredDevice
     std::string name;
 };
 
+// ways of finding out if a device is in range. they differ in how fast
+// and how reliably each device answers
+enum ProbeStrategy
+{
+    PROBE_NAME_REQUEST = 0,  // remote name request, answered by any device
+    PROBE_L2CAP_ECHO,        // l2cap echo request like l2ping
+    PROBE_CONNECTION,        // acl connection that is dropped right away
+    PROBE_STRATEGY_COUNT
+};
+
+// returns name of the strategy as used in the config file
+const char* probeStrategyName(ProbeStrategy strategy);
+
+// returns false if name isn't a strategy
+bool parseProbeStrategy(const std::string& name, ProbeStrategy& strategy);
+
 class BluetoothPoller
 {
 public:
@@ -22,15 +46,124 @@ public:
     ~BluetoothPoller();
 
     bool init(std::string& address);
+
+    // uses a simulated radio instead of the bluetooth adapter
+    bool initSimulated(std::string& address, double presence, double latencyScale);
+
+    // returns results of a recorded input log, replay is owned by the caller
+    bool initReplay(std::string& address, InputReplay* replay);
+
     void shutdown();
 
-    bool scanDevice(std::string btAddress);
+    // returns id of the adapter in use, -1 when simulated, replayed or lost
+    int deviceId() const;
+
+    // handles adapter added, removed, up and down events, and reopens the
+    // adapter after a failure. returns false while the adapter is unusable
+    bool checkAdapter();
+
+    // false from an adapter failure until checkAdapter has reopened it. a
+    // probe failing meanwhile says nothing about the device
+    bool isAdapterHealthy() const;
+
+    bool scanDevice(std::string btAddress, ProbeStrategy strategy = PROBE_NAME_REQUEST);
     bool discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices);
 
+    // stops the probe or discovery in progress and makes further ones fail
+    // at once. called from another thread when quitting
+    void cancel();
+
+    // returns hci events handled and read calls made since the previous call
+    void takeEventStats(uint64_t& events, uint64_t& reads);
+
     std::string getLastErrorString();
 
 private:
+    enum Operation
+    {
+        OPERATION_NONE = 0,
+        OPERATION_NAME_REQUEST,
+        OPERATION_CONNECTION,
+        OPERATION_INQUIRY
+    };
+
+    // operation and target are read by cancel from another thread
+    void setOperation(int operation);
+    void setTarget(const uint8_t* address);
+
+    // opens sockets of the default adapter, brings it up first if it's down
+    bool openAdapter();
+    void closeAdapter();
+
+    // marks the adapter failed if errno of a failed call says it's gone
+    // rather than the device not answering
+    void checkError();
+    void adapterFailed();
+
+    void handleDeviceEvent(const uint8_t* data, uint8_t size);
+    static void deviceEventWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size);
+
+    // probes the device in m_target
+    bool probeNameRequest();
+    bool probeEcho();
+    bool probeConnection();
+
+    // waits until socket is ready for events, false on timeout or cancel
+    bool waitSocket(int sock, short events, int timeout);
+
+    // asks name of the device in m_target, copies it to m_name
+    bool requestName();
+
+    // sends command and handles events until done is set, false if the
+    // command failed, timed out or was cancelled
+    bool runCommand(uint16_t ocf, uint8_t size, void* parameters, bool& done, int timeout);
+
+    // collects results of the operation in progress from adapter events
+    void handleEvent(uint8_t event, const uint8_t* data, uint8_t size);
+    static void eventWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size);
+
+    // adds device found by the inquiry, duplicates are skipped
+    void addInquiryResult(const uint8_t* address);
+
+    static const unsigned int MAX_INQUIRY_RESULTS = 255;
+
+    int m_devId;
     int m_socket;
+    uint8_t m_adapter[6];
+    uint8_t m_echoIdent;
+
+    // adapters coming and going are seen from the stack internal events of
+    // a socket not bound to any adapter
+    HciEventReader m_deviceEvents;
+    bool m_adapterHealthy;
+    int m_lastDevId;
+    time_t m_nextReopen;
+
+    // name requests and inquiries are sent as commands, and their results
+    // read from the event socket into these
+    HciEventReader m_events;
+    uint16_t m_pendingOpcode;
+    bool m_commandFailed;
+    bool m_commandStarted;
+    bool m_nameDone;
+    bool m_nameFound;
+    char m_name[249];
+    bool m_inquiryDone;
+    uint8_t m_found[MAX_INQUIRY_RESULTS][6];
+    unsigned int m_foundCount;
+
+    // cancel commands are sent through a socket of their own, the main one is
+    // in use by the blocking call being cancelled. the mutex keeps the socket
+    // from being closed or reopened, and the operation from changing, while
+    // a cancel is sent
+    pthread_mutex_t m_cancelMutex;
+    int m_cancelSocket;
+    volatile int m_operation;
+    uint8_t m_target[6];
+    volatile bool m_cancelled;
+
+    RadioSimulator* m_simulator;
+    InputReplay* m_replay;
     std::string m_lastErrorString;
 };
 
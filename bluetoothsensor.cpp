@@ -6,45 +6,250 @@
 #include "bluetoothsensor.h"
 
 #include <sstream>
+#include <algorithm>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 
 const std::string DEFAULT_BROKER_ADDRESS = "localhost";
 const uint16_t DEFAULT_BROKER_PORT = 1883;
 const std::string DEFAULT_DATA_FETCH_URL = "localhost:8181/api/connection";
 const int16_t DEFAULT_CONNECT_ATTEMPT_INTERVAL = 5;
+const std::string DEFAULT_DEVICE_CACHE_FILE = "device_cache.bin";
+const int DEFAULT_DB_RETRY_INTERVAL = 30;
+const int DEFAULT_DB_REFRESH_JITTER = 30;
+const int DEFAULT_METRICS_INTERVAL = 60;
+const std::string DEFAULT_METRICS_ADDRESS = "127.0.0.1";
+const uint16_t DEFAULT_METRICS_PORT = 0;
+const std::string DEFAULT_LOG_LEVEL = "info";
+const int DEFAULT_LOG_DEVICE_INTERVAL = 60;
+const std::string DEFAULT_TRACE_FILE = "bt_sensor_trace.json";
+const double DEFAULT_SIMULATED_PRESENCE = 0.5;
+const double DEFAULT_SIMULATED_LATENCY_SCALE = 1.0;
+const double DEFAULT_REPLAY_SPEED = 1.0;
+const int DEFAULT_PARTITION_REPLICAS = 1;
+const int DEFAULT_HEARTBEAT_INTERVAL = 10;
+const std::string DEFAULT_PROBE_STRATEGIES = "name,echo,connection";
+const int DEFAULT_PROBE_EXPLORE_INTERVAL = 50;
+const double DEFAULT_PROBE_QUIET_SHARE = 0.25;
+const int DEFAULT_LINK_MONITOR_MAX = 0;
+const int DEFAULT_LINK_RSSI_INTERVAL = 10;
+const std::string DEFAULT_HISTORY_FILE = "bt_presence_history.bin";
+
+// about 3.7 MB, months of history for thousands of devices
+const int DEFAULT_HISTORY_INTERVALS = 524288;
+
+// intervals returned by a history query when it doesn't say
+const unsigned int DEFAULT_HISTORY_QUERY_INTERVALS = 10;
+
+// linked devices are reported available this often, in sec
+const int LINKED_REPORT_INTERVAL = 30;
+
+// a device that couldn't be linked is tried again after this many seconds
+const int LINK_RETRY_INTERVAL = 300;
+
+// sensors are dropped from the group after missing this many heartbeats
+const int MISSED_HEARTBEATS = 3;
+
+// how often learned device state is written to the device cache, in sec
+const int DEVICE_CACHE_SAVE_INTERVAL = 300;
+
+// how many results are kept while waiting for the broker connection
+const unsigned int MAX_PENDING_MESSAGES = 10000;
+
+// how long to sleep when there is nothing to scan, in usec
+const useconds_t IDLE_SLEEP = 100000;
+
+// how long connecting to the brokers may take, in ms
+const int BROKER_CONNECT_TIMEOUT = 5000;
+
+// how long queued messages are sent on quit before giving up, in ms
+const int SHUTDOWN_FLUSH_TIMEOUT = 1000;
+
+// same for the old connection when switching brokers, probing waits meanwhile
+const int SWITCH_FLUSH_TIMEOUT = 500;
+
+// states of the background threads used while starting up
+enum TaskState
+{
+    TASK_IDLE = 0,
+    TASK_RUNNING,
+    TASK_DONE
+};
+
+// returns milliseconds since given start time
+static long millisecondsSince(const timeval& start)
+{
+    timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+}
 
-static bool quit = false;
+// true if the json value can be read with asInt, which throws otherwise
+static bool isIntValue(const Json::Value& value)
+{
+    return value.isIntegral() && value.asDouble() >= INT_MIN && value.asDouble() <= INT_MAX;
+}
 
-// handler for Ctrl+C, quits program
-void siginthandler(int param)
+static volatile bool quit = false;
+static volatile sig_atomic_t traceDumpRequested = 0;
+
+SensorConfig::SensorConfig() :
+    brokerAddress(DEFAULT_BROKER_ADDRESS),
+    brokerPort(DEFAULT_BROKER_PORT),
+    dataFetchUrl(DEFAULT_DATA_FETCH_URL),
+    connectAttemptInterval(DEFAULT_CONNECT_ATTEMPT_INTERVAL),
+    deviceCacheFile(DEFAULT_DEVICE_CACHE_FILE),
+    dbRetryInterval(DEFAULT_DB_RETRY_INTERVAL),
+    dbRefreshJitter(DEFAULT_DB_REFRESH_JITTER),
+    metricsInterval(DEFAULT_METRICS_INTERVAL),
+    metricsAddress(DEFAULT_METRICS_ADDRESS),
+    metricsPort(DEFAULT_METRICS_PORT),
+    logLevel(LOG_INFO),
+    logDeviceInterval(DEFAULT_LOG_DEVICE_INTERVAL),
+    tracing(false),
+    traceFile(DEFAULT_TRACE_FILE),
+    simulatedRadio(false),
+    simulatedPresence(DEFAULT_SIMULATED_PRESENCE),
+    simulatedLatencyScale(DEFAULT_SIMULATED_LATENCY_SCALE),
+    replaySpeed(DEFAULT_REPLAY_SPEED),
+    partitionReplicas(DEFAULT_PARTITION_REPLICAS),
+    heartbeatInterval(DEFAULT_HEARTBEAT_INTERVAL),
+    probeExploreInterval(DEFAULT_PROBE_EXPLORE_INTERVAL),
+    probeQuietShare(DEFAULT_PROBE_QUIET_SHARE),
+    linkMonitorMax(DEFAULT_LINK_MONITOR_MAX),
+    linkRssiInterval(DEFAULT_LINK_RSSI_INTERVAL),
+    historyFile(DEFAULT_HISTORY_FILE),
+    historyIntervals(DEFAULT_HISTORY_INTERVALS)
 {
-    (void)param; //prevent warning
+    parseBrokerList(DEFAULT_BROKER_ADDRESS, DEFAULT_BROKER_PORT, brokers);
+    parseProbeStrategies(DEFAULT_PROBE_STRATEGIES, probeStrategies);
+}
 
-    std::cout << " *** QUITTING... *** " << std::endl;
-    quit = true;
+// reads comma separated strategy names, unknown names are skipped
+void parseProbeStrategies(const std::string& text, std::vector<ProbeStrategy>& strategies)
+{
+    strategies.clear();
+    std::stringstream ss(text);
+    std::string name;
+    while (std::getline(ss, name, ','))
+    {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        ProbeStrategy strategy;
+        if (parseProbeStrategy(name, strategy) &&
+            std::find(strategies.begin(), strategies.end(), strategy) == strategies.end())
+        {
+            strategies.push_back(strategy);
+        }
+    }
+}
+
+// true if broker connection has to be made again when switching to other config
+bool SensorConfig::brokerDiffers(const SensorConfig& other) const
+{
+    return brokerAddress != other.brokerAddress || brokerPort != other.brokerPort ||
+           sensorID != other.sensorID;
 }
 
 BluetoothSensor::BluetoothSensor() :
     m_bluetoothPoller(0),
     m_dataGetter(0),
     m_mosquitto(0),
+    m_replay(0),
     m_sensorID("<NO NAME>"),
-    m_brokerAddress(DEFAULT_BROKER_ADDRESS),
-    m_brokerPort(DEFAULT_BROKER_PORT),
-    m_dataFetchUrl(DEFAULT_DATA_FETCH_URL),
-    m_connectAttemptInterval(DEFAULT_CONNECT_ATTEMPT_INTERVAL),
-    m_updateDBNeeded(true)
+    m_dbVersion(-1),
+    m_updateDBNeeded(true),
+    m_nextDBUpdate(0),
+    m_lastCacheSave(0),
+    m_configRetryNeeded(false),
+    m_nextConfigRetry(0),
+    m_brokerState(TASK_IDLE),
+    m_brokerThreadStarted(false),
+    m_brokerReady(false),
+    m_switchState(TASK_IDLE),
+    m_switchThreadStarted(false),
+    m_switchSucceeded(false),
+    m_switchMosquitto(0),
+    m_fetchState(TASK_IDLE),
+    m_fetchThreadStarted(false),
+    m_fetchSucceeded(false),
+    m_signalFd(-1),
+    m_signalThreadStarted(false),
+    m_stopSignalThread(false),
+    m_firstResultMs(-1),
+    m_lastMetricsSent(0),
+    m_lastProcessMetrics(0),
+    m_cpuMicroseconds(0),
+    m_lastHeartbeat(0),
+    m_adapterUp(true)
 {
-    signal(SIGINT, siginthandler);
+    gettimeofday(&m_startTime, NULL);
+
+    // signals are blocked before any thread is started so that all of them
+    // inherit the mask and the signals can only be read from the signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // console output is written in the background from here on
+    Logger::init(LOG_INFO);
+
+    registerMetrics();
+
+    m_signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (m_signalFd >= 0)
+    {
+        m_signalThreadStarted = pthread_create(&m_signalThread, NULL, BluetoothSensor::signalThreadWrapper, this) == 0;
+    }
+    if (!m_signalThreadStarted)
+    {
+        printError("Cannot watch signals, quit with SIGKILL");
+    }
+    Tracer::setThreadName("main");
+
+    // database fetch retries are spread randomly so that sensors
+    // restarting at the same time don't all hit the server at once
+    srand(time(NULL) ^ getpid());
 }
 
 BluetoothSensor::~BluetoothSensor()
 {
+    // the signal thread uses the poller and the data getter, stop it first.
+    // the signal is blocked, so it just wakes up the thread through the signalfd
+    if (m_signalThreadStarted)
+    {
+        m_stopSignalThread = true;
+        pthread_kill(m_signalThread, SIGTERM);
+        pthread_join(m_signalThread, NULL);
+    }
+    if (m_signalFd >= 0) close(m_signalFd);
+
+    m_metricsServer.shutdown();
+
+    // background threads use the members below, wait for them to stop
+    if (m_brokerThreadStarted) pthread_join(m_brokerThread, NULL);
+    if (m_switchThreadStarted) pthread_join(m_switchThread, NULL);
+    if (m_fetchThreadStarted) pthread_join(m_fetchThread, NULL);
+
     if (m_bluetoothPoller)
     {
         delete m_bluetoothPoller;
         m_bluetoothPoller = 0;
     }
+    if (m_replay)
+    {
+        delete m_replay;
+        m_replay = 0;
+    }
     if (m_dataGetter)
     {
         delete m_dataGetter;
@@ -55,51 +260,99 @@ BluetoothSensor::~BluetoothSensor()
         delete m_mosquitto;
         m_mosquitto = 0;
     }
+    if (m_switchMosquitto)
+    {
+        delete m_switchMosquitto;
+        m_switchMosquitto = 0;
+    }
+
+    Logger::shutdown();
 }
 
 bool BluetoothSensor::initAll(std::string configFileName)
 {
-    bool manualSensorID = false;
-
     print("Reading config file...");
 
-    dictionary* ini ;
-    ini = iniparser_load(configFileName.c_str());
-    if (!ini) {
+    m_configFileName = configFileName;
+    if (!readConfig(m_configFileName, m_config))
+    {
         print("Cannot parse config file. Using default values");
     }
-    else
-    {
-        m_brokerAddress = iniparser_getstring(ini, ":broker_address",
-                                              (char*)DEFAULT_BROKER_ADDRESS.c_str());
-        m_brokerPort = iniparser_getint(ini, ":broker_port",
-                                        DEFAULT_BROKER_PORT);
-        m_dataFetchUrl = iniparser_getstring(ini, ":data_fetch_url",
-                                              (char*)DEFAULT_DATA_FETCH_URL.c_str());
-        m_connectAttemptInterval = iniparser_getint(ini, ":connect_attempt_interval",
-                                        DEFAULT_CONNECT_ATTEMPT_INTERVAL);
+    applyLogConfig();
+    Tracer::setEnabled(m_config.tracing);
 
-        if (iniparser_find_entry(ini, ":sensor_id"))
-        {
-            m_sensorID = iniparser_getstring(ini, ":sensor_id", 0);
-            manualSensorID = true;
-        }
+    if (!m_configWatcher.init(m_configFileName))
+    {
+        printError(m_configWatcher.getLastErrorString() + ", config changes need a restart");
     }
-    iniparser_freedict(ini);
+
+    startMetricsServer();
 
     if (!m_bluetoothPoller)
     {
         print("Initializing Bluetooth... ");
 
-        std::string btAddress;
         m_bluetoothPoller = new BluetoothPoller();
-        if (!m_bluetoothPoller->init(btAddress))
+        bool ok;
+        if (!m_config.replayFile.empty())
+        {
+            // recorded results replace the radio, the device cache would make the replay differ
+            print("Replaying " + m_config.replayFile);
+            m_replay = new InputReplay;
+            ok = m_replay->load(m_config.replayFile, m_config.replaySpeed);
+            if (!ok)
+            {
+                printError(m_replay->getLastErrorString());
+                return false;
+            }
+            m_bluetoothPoller->initReplay(m_btAddress, m_replay);
+            m_config.deviceCacheFile.clear();
+            m_config.historyFile.clear();
+        }
+        else if (m_config.simulatedRadio)
+        {
+            print("Using simulated radio");
+            ok = m_bluetoothPoller->initSimulated(m_btAddress, m_config.simulatedPresence, m_config.simulatedLatencyScale);
+        }
+        else
+        {
+            ok = m_bluetoothPoller->init(m_btAddress);
+        }
+        if (!ok)
         {
             printError(m_bluetoothPoller->getLastErrorString());
             return false;
         }
-        if (!manualSensorID) m_sensorID = "bt-sensor_" + btAddress;
     }
+    applyProbeConfig();
+
+    // links are made with the real adapter only
+    if (m_bluetoothPoller->deviceId() < 0)
+    {
+        if (m_config.linkMonitorMax > 0) print("Link monitoring needs a bluetooth adapter, not used");
+    }
+    else if (!m_linkMonitor.init(m_bluetoothPoller->deviceId(), std::max(m_config.linkMonitorMax, 0)))
+    {
+        printError(m_linkMonitor.getLastErrorString());
+    }
+    applyLinkConfig();
+    openHistory();
+
+    m_sensorID = sensorIDFor(m_config);
+    m_sensorGroup.setOwnID(m_sensorID);
+
+    if (!m_replay && !m_config.recordFile.empty())
+    {
+        if (m_recorder.open(m_config.recordFile, m_btAddress))
+        {
+            print("Recording inputs to " + m_config.recordFile);
+        }
+        else
+        {
+            printError(m_recorder.getLastErrorString());
+        }
+    }
+    applyGroupConfig();
 
     if (!m_dataGetter)
     {
@@ -113,37 +366,41 @@ bool BluetoothSensor::initAll(std::string configFileName)
         }
     }
 
-    if (!m_mosquitto)
+    // replays take their messages from the capture and publish nowhere
+    if (!m_mosquitto && !m_replay)
     {
         print("Initializing Mosquitto... ");
 
         m_mosquitto = new MosquittoHandler;
         std::string mosqID = m_sensorID;
 
-        if (!m_mosquitto->init(mosqID.c_str()) || !m_mosquitto->connectToBroker(m_brokerAddress.c_str(), m_brokerPort))
+        if (!m_mosquitto->init(mosqID.c_str()) ||
+            !m_mosquitto->setWill(sensorTopic(m_sensorID, "goodbye").c_str(), m_config.partitionGroup.c_str()))
         {
             printError(m_mosquitto->getLastErrorString());
             return false;
         }
-        m_mosquitto->subscribe("command/fetch_device_database");
-        m_mosquitto->subscribe(std::string("command/scan/bluetooth/" + m_sensorID).c_str());
-        m_mosquitto->subscribe("command/scan/bluetooth");
 
+        // broker connection is made in the background, results of scanning
+        // are kept until it's up
         print("Connecting to broker... ");
-        if (!m_mosquitto->waitForConnect())
-        {
-            // first connection attempt failed, go into retry loop
-            printError(m_mosquitto->getLastErrorString());
-            while (!connectMosquitto(false))
-            {
-                if (quit) return false;
-            }
-        }
+        m_brokerState = TASK_RUNNING;
+        m_brokerThreadStarted = pthread_create(&m_brokerThread, NULL, BluetoothSensor::brokerThreadWrapper, this) == 0;
+        if (!m_brokerThreadStarted) connectBroker();
     }
 
-    m_updateDBNeeded = !updateDeviceData();
-
-    sendHello();
+    if (loadDeviceCache())
+    {
+        // scanning can start with the cached devices, refresh them from the
+        // server after a random delay
+        m_updateDBNeeded = true;
+        m_nextDBUpdate = time(NULL) + (m_config.dbRefreshJitter > 0 ? rand() % (m_config.dbRefreshJitter + 1) : 0);
+    }
+    else
+    {
+        // scanning starts as soon as the fetch completes
+        startDeviceDataFetch();
+    }
 
     print("Sensor ID: " + m_sensorID);
 
@@ -159,241 +416,1083 @@ void BluetoothSensor::run()
 
     // index of the device currently scanned
     unsigned int deviceIndex = 0;
+    uint64_t cycleStart = monotonicMicroseconds();
+
+    // devices of the other sensors in the group are skipped, and devices
+    // that seldom change at this time of week are skipped on some passes
+    unsigned int probesInCycle = 0;
+    unsigned int deferralsInCycle = 0;
 
     while(!quit)
     {
-        // update device db if previous update didn't succeed
-        if (m_updateDBNeeded) m_updateDBNeeded = !updateDeviceData();
+        // take results of the background tasks into use
+        checkBrokerConnection();
+        checkBrokerSwitch();
+        checkDeviceDataFetch();
+
+        // update device db if previous update didn't succeed and retry time has come
+        if (m_updateDBNeeded && time(NULL) >= m_nextDBUpdate) startDeviceDataFetch();
 
         // make sure that current device index is valid.
         // this also guarantees that no scanning is made when there are no devices.
-        if (deviceIndex < m_devices.size())
+        // departures of linked devices are reported as soon as their link drops
+        bool adapterUp = checkAdapter();
+        if (adapterUp) checkLinks();
+
+        if (!adapterUp)
+        {
+            // devices keep their state until the adapter is back
+            usleep(IDLE_SLEEP);
+            cycleStart = monotonicMicroseconds();
+        }
+        else if (deviceIndex < m_devices.size())
+        {
+            const std::string& address = m_devices.at(deviceIndex);
+            if (!m_sensorGroup.owns(address))
+            {
+                // another sensor has taken over the device
+                m_linkMonitor.unlink(address);
+                m_probeScheduler.forget(address);
+            }
+            else if (m_linkMonitor.isLinked(address))
+            {
+                reportLinkedDevice(address);
+                m_probeScheduler.forget(address);
+            }
+            else if (!m_probeScheduler.due(address, m_deviceStates[address], time(NULL), monotonicMicroseconds()))
+            {
+                m_probesDeferred->add();
+                deferralsInCycle++;
+            }
+            else
+            {
+                checkDevice(deviceIndex);
+                m_probeScheduler.probed(address, monotonicMicroseconds());
+                probesInCycle++;
+            }
+        }
+        else
         {
-            checkDevice(deviceIndex);
+            // nothing to scan yet, don't spin
+            if (m_replay) m_replay->idle();
+            usleep(IDLE_SLEEP);
         }
 
         // move to next device, start from beginning when at the end
-        deviceIndex++;
-        if (deviceIndex >= m_devices.size()) deviceIndex = 0;
-
-        // check if there are arrived mqtt messages (commands)
-        do
+        if (adapterUp) deviceIndex++;
+        if (deviceIndex >= m_devices.size())
         {
-            processIncomingMessages(updateDB, scan);
-            if (updateDB)
+            if (probesInCycle > 0)
             {
-                m_updateDBNeeded = !updateDeviceData();
+                uint64_t now = monotonicMicroseconds();
+                m_scanCycleDuration->record(now - cycleStart);
+                m_probeScheduler.recordPass(now - cycleStart, probesInCycle, probesInCycle + deferralsInCycle);
+                cycleStart = now;
             }
-            if (scan)
+            else if (!m_devices.empty())
             {
-                discoverDevices();
+                // other sensors have all the devices, they are linked or none of them
+                // is due yet. sleep until the next deadline, don't spin
+                useconds_t sleepTime = IDLE_SLEEP;
+                if (deferralsInCycle > 0)
+                {
+                    uint64_t now = monotonicMicroseconds();
+                    uint64_t next = m_probeScheduler.nextProbe();
+                    if (next <= now) sleepTime = 0;
+                    else if (next - now < sleepTime) sleepTime = next - now;
+                }
+                if (m_replay) m_replay->idle();
+                if (sleepTime > 0) usleep(sleepTime);
+                cycleStart = monotonicMicroseconds();
             }
+            probesInCycle = 0;
+            deferralsInCycle = 0;
+            deviceIndex = 0;
         }
 
-        // check arrived messages again after database update or device discovery,
-        // so that a possible request for those is processed before continuing
-        while ((updateDB || scan) && !quit);
+        // results of this round go out before incoming traffic is handled
+        flushMessages();
 
-        // check that Mosquitto is still connected.
-        // if Mosquitto disconnects there can be messages from this iteration
-        // which aren't sent at all, but missing some outgoing messages
-        // shouldn't be too big of a problem.
-        if (!m_mosquitto->isConnected())
+        // commands are handled once the broker is connected, replayed ones right away
+        if (isBrokerReady() || m_replay)
         {
-            printError("Mosquitto disconnected");
-            if (connectMosquitto())
+            // check if there are arrived mqtt messages (commands)
+            do
             {
-                // update device db and send hello after mosquitto reconnect
-                m_updateDBNeeded = !updateDeviceData();
-                sendHello();
+                processIncomingMessages(updateDB, scan);
+                if (updateDB)
+                {
+                    startDeviceDataFetch();
+                }
+                if (scan)
+                {
+                    discoverDevices();
+                }
             }
+
+            // check arrived messages again after database update or device discovery,
+            // so that a possible request for those is processed before continuing
+            while ((updateDB || scan) && !quit);
+        }
+
+        if (isBrokerReady())
+        {
+            // check that Mosquitto is still connected.
+            // if Mosquitto disconnects there can be messages from this iteration
+            // which aren't sent at all, but missing some outgoing messages
+            // shouldn't be too big of a problem.
+            if (!m_mosquitto->isConnected())
+            {
+                printError("Mosquitto disconnected");
+                if (connectMosquitto())
+                {
+                    // mosquitto handler has made the subscriptions again.
+                    // update device db and send hello after mosquitto reconnect
+                    startDeviceDataFetch();
+                    sendHello();
+                }
+            }
+
+            // keep the group up to date
+            if (!m_config.partitionGroup.empty())
+            {
+                time_t now = time(NULL);
+                if (now - m_lastHeartbeat >= m_config.heartbeatInterval) sendHeartbeat();
+                if (m_sensorGroup.expire(now))
+                {
+                    print("Sensor heartbeats stopped");
+                    updatePartition();
+                }
+            }
+        }
+
+        // apply config file changes without interrupting scanning
+        if (m_configWatcher.hasChanged() || (m_configRetryNeeded && time(NULL) >= m_nextConfigRetry))
+        {
+            reloadConfig();
+        }
+
+        if (traceDumpRequested)
+        {
+            traceDumpRequested = 0;
+            writeTrace();
+        }
+
+        m_devicesGauge->set(m_devices.size());
+        unsigned int strategyDevices[PROBE_STRATEGY_COUNT];
+        m_probeSelector.countChoices(strategyDevices);
+        for (int i = 0; i < PROBE_STRATEGY_COUNT; i++) m_strategyDevices[i]->set(strategyDevices[i]);
+        m_droppedLogLinesGauge->set(Logger::dropped());
+        m_pendingMessagesGauge->set(m_pendingMessages.size());
+        m_historyIntervalsGauge->set(m_history.intervalCount());
+        uint64_t hciEvents, hciReads;
+        m_bluetoothPoller->takeEventStats(hciEvents, hciReads);
+        m_hciEvents->add(hciEvents);
+        m_hciReads->add(hciReads);
+        updateProcessMetrics();
+        if (isBrokerReady() && m_config.metricsInterval > 0 &&
+            time(NULL) - m_lastMetricsSent >= m_config.metricsInterval)
+        {
+            sendMetrics();
+        }
+
+        flushMessages();
+
+        // store learned device state every now and then
+        if (time(NULL) - m_lastCacheSave >= DEVICE_CACHE_SAVE_INTERVAL) saveDeviceCache();
+
+        if (m_replay && m_replay->finished())
+        {
+            std::stringstream ss;
+            ss << "Replay finished " << millisecondsSince(m_startTime) << " ms after start";
+            print(ss.str());
+            quit = true;
         }
     }
+
+    // let the group take over our devices right away instead of waiting for the heartbeats to stop
+    if (isBrokerReady() && !m_config.partitionGroup.empty())
+    {
+        publish(sensorTopic(m_sensorID, "goodbye"), m_config.partitionGroup);
+    }
+
+    saveDeviceCache();
+    m_history.close();
+
+    if (isBrokerReady()) flushMosquitto(SHUTDOWN_FLUSH_TIMEOUT);
 }
 
-// scans given device and sends availability status using mqtt
-bool BluetoothSensor::checkDevice(unsigned int deviceIndex)
+// waits for signals and acts on them until the sensor is destroyed
+void BluetoothSensor::handleSignals()
 {
-    if (deviceIndex >= m_devices.size())
+    signalfd_siginfo info;
+    while (!m_stopSignalThread)
     {
-        return false;
-    }
-    std::stringstream ss;
-    ss << "Checking device " << m_devices.at(deviceIndex) << "... ";
-    print(ss.str(), false);
+        ssize_t count = read(m_signalFd, &info, sizeof(info));
+        if (m_stopSignalThread) break;
+        if (count != (ssize_t)sizeof(info)) continue;
 
-    bool available = m_bluetoothPoller->scanDevice(m_devices.at(deviceIndex));
+        if (info.ssi_signo == SIGUSR2)
+        {
+            traceDumpRequested = 1;
+        }
+        else
+        {
+            requestQuit();
+        }
+    }
+}
 
-    if (quit) return false;
+void* BluetoothSensor::signalThreadWrapper(void* obj)
+{
+    BluetoothSensor* sensor = (BluetoothSensor*) obj;
+    Tracer::setThreadName("signals");
+    sensor->handleSignals();
+    return 0;
+}
 
-    std::string availableTopic = "sensor/" + m_sensorID + "/bluetooth/available";
-    std::string unavailableTopic = "sensor/" + m_sensorID + "/bluetooth/unavailable";
+// stops the main loop. a probe or fetch in progress would keep it from
+// noticing for seconds, so they are cancelled as well
+void BluetoothSensor::requestQuit()
+{
+    if (quit) return;
+    quit = true;
+    print("Quitting...");
 
-    std::string topic;
+    if (m_bluetoothPoller) m_bluetoothPoller->cancel();
+    m_linkMonitor.cancel();
+    if (m_dataGetter) m_dataGetter->cancel();
+    MosquittoHandler::cancelWaits();
+}
 
-    if (available)
+// sends what mosquitto still has queued and disconnects cleanly, so that
+// the last results and the goodbye aren't lost
+void BluetoothSensor::flushMosquitto(int timeout)
+{
+    timeval start;
+    gettimeofday(&start, NULL);
+    while (m_mosquitto->isConnected() && m_mosquitto->wantWrite() && millisecondsSince(start) < timeout)
     {
-        topic = availableTopic;
-        print("AVAILABLE");
+        if (!m_mosquitto->loop(10)) break;
     }
-    else
+    if (m_mosquitto->wantWrite())
     {
-        topic = unavailableTopic;
-        print("unavailable");
+        printError("Queued messages not sent before disconnecting");
     }
 
-    m_mosquitto->publish(topic.c_str(), m_devices.at(deviceIndex).c_str());
-    m_mosquitto->loop();
-    return available;
+    m_mosquitto->disconnect();
+    m_mosquitto->loop(0);
 }
 
-// gets device info json from server and updates local device database
-bool BluetoothSensor::updateDeviceData()
+// returns true when broker connection made at startup has completed
+bool BluetoothSensor::isBrokerReady()
 {
-    print("Fetching device database...");
+    return m_brokerReady;
+}
 
-    std::string data;
-    if (!m_dataGetter->get(m_dataFetchUrl.c_str(), data))
+// connects broker on startup, retries until connected or quitted.
+// called in a background thread so that scanning doesn't wait for it
+void BluetoothSensor::connectBroker()
+{
+    // subscriptions are made whenever the connection is
+    subscribeTopics(m_mosquitto, m_config);
+    if (!m_mosquitto->connectToAny(m_config.brokers, BROKER_CONNECT_TIMEOUT))
     {
-        printError(m_dataGetter->getLastErrorString());
-        return false;
+        // first connection attempt failed, go into retry loop
+        printError(m_mosquitto->getLastErrorString());
+        if (!connectMosquitto(false)) return;
     }
+    print("Connected to broker " + m_mosquitto->connectedBroker());
+    __sync_lock_test_and_set(&m_brokerState, TASK_DONE);
+}
 
-    Json::Value root;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse(data, root);
-    if (!parsingSuccessful)
-    {
-        printError("Failed to parse device data\n" + reader.getFormatedErrorMessages());
-        return false;
-    }
+void* BluetoothSensor::brokerThreadWrapper(void* obj)
+{
+    BluetoothSensor* sensor = (BluetoothSensor*) obj;
+    Tracer::setThreadName("broker connect");
+    sensor->connectBroker();
+    return 0;
+}
 
-    m_devices.clear();
+// starts connecting the broker of a changed config. the current connection
+// keeps delivering results until the new one is up, and is kept if the new
+// broker can't be reached
+void BluetoothSensor::startBrokerSwitch(const SensorConfig& config)
+{
+    std::string newSensorID = sensorIDFor(config);
+    print("Connecting to broker " + config.brokerAddress + " as " + newSensorID + "...");
 
-    // go through root elements and search for "bluetooth"
-    for (unsigned int i = 0; i < root.size(); i++ )
+    m_switchMosquitto = new MosquittoHandler;
+    if (!m_switchMosquitto->init(newSensorID) ||
+        !m_switchMosquitto->setWill(sensorTopic(newSensorID, "goodbye").c_str(), config.partitionGroup.c_str()))
     {
-        if (root[i].get("type", "") == "bluetooth")
-        {
-            // "identifier" field contains the bt address
-            std::string newDevice = root[i].get("identifier", "").asString();
-            m_devices.push_back(newDevice);
-        }
+        printError(m_switchMosquitto->getLastErrorString() + ", keeping current broker connection");
+        delete m_switchMosquitto;
+        m_switchMosquitto = 0;
+
+        m_configRetryNeeded = true;
+        m_nextConfigRetry = time(NULL) + std::max<int>(m_config.connectAttemptInterval, 1);
+        return;
     }
 
-    if (m_devices.size() > 0)
+    // subscriptions are made whenever the connection is
+    m_switchConfig = config;
+    subscribeTopics(m_switchMosquitto, m_switchConfig);
+
+    m_switchState = TASK_RUNNING;
+    m_switchThreadStarted = pthread_create(&m_switchThread, NULL, BluetoothSensor::switchThreadWrapper, this) == 0;
+    if (!m_switchThreadStarted) connectSwitchBroker();
+}
+
+// makes one attempt to connect the new broker. called in a background thread
+void BluetoothSensor::connectSwitchBroker()
+{
+    m_switchSucceeded = m_switchMosquitto->connectToAny(m_switchConfig.brokers, BROKER_CONNECT_TIMEOUT);
+    __sync_lock_test_and_set(&m_switchState, TASK_DONE);
+}
+
+void* BluetoothSensor::switchThreadWrapper(void* obj)
+{
+    BluetoothSensor* sensor = (BluetoothSensor*) obj;
+    Tracer::setThreadName("broker switch");
+    sensor->connectSwitchBroker();
+    return 0;
+}
+
+// replaces the broker connection with the new one once it's up, or drops
+// the new one and retries later if the broker couldn't be reached
+void BluetoothSensor::checkBrokerSwitch()
+{
+    if (!m_switchMosquitto || __sync_fetch_and_add(&m_switchState, 0) != TASK_DONE) return;
+
+    if (m_switchThreadStarted)
     {
-        print("Devices:");
-        for (unsigned int i = 0; i < m_devices.size(); i++)
-        {
-            print(m_devices.at(i));
-        }
+        pthread_join(m_switchThread, NULL);
+        m_switchThreadStarted = false;
     }
-    else
+    m_switchState = TASK_IDLE;
+
+    MosquittoHandler* newMosquitto = m_switchMosquitto;
+    m_switchMosquitto = 0;
+    if (!m_switchSucceeded)
     {
-        print("No devices");
+        printError(newMosquitto->getLastErrorString() + ", keeping current broker connection");
+        delete newMosquitto;
+
+        m_configRetryNeeded = true;
+        m_nextConfigRetry = time(NULL) + std::max<int>(m_config.connectAttemptInterval, 1);
+        return;
     }
+    print("Connected to broker " + newMosquitto->connectedBroker());
+
+    // the old connection sends what it still has queued and disconnects
+    // cleanly. dropping it would make the broker publish its goodbye will,
+    // possibly after the hello of the new connection with the same id
+    flushMessages();
+    flushMosquitto(SWITCH_FLUSH_TIMEOUT);
+    delete m_mosquitto;
+    m_mosquitto = newMosquitto;
+    m_sensorID = sensorIDFor(m_switchConfig);
+    print("Sensor ID: " + m_sensorID);
 
-    return true;
+    // the group and device database topic go with the subscriptions of the
+    // new connection. if they were changed meanwhile, the retried reload
+    // applies them again
+    m_config.brokerAddress = m_switchConfig.brokerAddress;
+    m_config.brokerPort = m_switchConfig.brokerPort;
+    m_config.brokers = m_switchConfig.brokers;
+    m_config.sensorID = m_switchConfig.sensorID;
+    m_config.deviceDBTopic = m_switchConfig.deviceDBTopic;
+    m_config.partitionGroup = m_switchConfig.partitionGroup;
+    m_config.partitionReplicas = m_switchConfig.partitionReplicas;
+    m_config.heartbeatInterval = m_switchConfig.heartbeatInterval;
+
+    // new connection has its own view of the group
+    m_sensorGroup.setOwnID(m_sensorID);
+    m_sensorGroup.clear();
+    applyGroupConfig();
+    sendHello();
 }
 
-// checks incoming messages if they contain request for database update or device discovery
-void BluetoothSensor::processIncomingMessages(bool& updateDB, bool& scan)
+// sends hello and results scanned while connecting once the startup broker connection is up
+void BluetoothSensor::checkBrokerConnection()
 {
-    // loop many times to receive multiple messages.
-    // can be done smarter with mosquitto 1.0 ->
-    for (unsigned int i = 0; i < 10; i++) m_mosquitto->loop();
+    if (m_brokerReady || __sync_fetch_and_add(&m_brokerState, 0) != TASK_DONE) return;
+
+    if (m_brokerThreadStarted)
+    {
+        pthread_join(m_brokerThread, NULL);
+        m_brokerThreadStarted = false;
+    }
+    m_brokerReady = true;
 
-    std::vector<mqttMessage> messages = m_mosquitto->getArrivedMessages();
+    std::stringstream ss;
+    ss << "Broker connected " << millisecondsSince(m_startTime) << " ms after start, sending "
+       << m_pendingMessages.size() << " buffered messages";
+    print(ss.str());
 
-    updateDB = false;
-    scan = false;
+    sendHello();
 
+    std::vector<mqttMessage> messages;
+    messages.swap(m_pendingMessages);
     for (unsigned int i = 0; i < messages.size(); i++)
     {
-        if (messages[i].topic == "command/fetch_device_database")
-        {
-            updateDB = true;
-        }
-        else if (messages[i].topic.substr(0, 22) == "command/scan/bluetooth")
+        publish(messages.at(i).topic, messages.at(i).content);
+    }
+}
+
+// publishes message, or keeps it until the broker is connected
+void BluetoothSensor::publish(const std::string& topic, const std::string& content)
+{
+    // results of a replay are not sent anywhere
+    if (m_replay) return;
+
+    if (!isBrokerReady())
+    {
+        // keep the newest results if the broker stays away for long
+        if (m_pendingMessages.size() >= MAX_PENDING_MESSAGES)
         {
-            scan = true;
+            m_pendingMessages.erase(m_pendingMessages.begin());
         }
+        mqttMessage message;
+        message.topic = topic;
+        message.content = content;
+        m_pendingMessages.push_back(message);
+        return;
     }
-}
 
+    // messages are only queued here, flushMessages writes them out together
+    TRACE_SCOPE("publish");
+    uint64_t start = monotonicMicroseconds();
+    bool ok = m_mosquitto->publish(topic.c_str(), content.c_str());
+    m_publishDuration->record(monotonicMicroseconds() - start);
+    ok ? m_published->add() : m_publishFailures->add();
+}
 
-// discovers bt devices in the range and sends bt addresses using mqtt
-bool BluetoothSensor::discoverDevices()
+// writes queued messages to the broker in one go
+void BluetoothSensor::flushMessages()
 {
-    print("Discovering devices...");
+    if (!isBrokerReady()) return;
 
-    std::vector<DiscoveredDevice> discoveredDevices;
-    if (!m_bluetoothPoller->discoverDevices(discoveredDevices))
+    TRACE_SCOPE("flushMessages");
+    uint64_t start = monotonicMicroseconds();
+    if (m_mosquitto->wantWrite())
     {
-        printError(m_bluetoothPoller->getLastErrorString());
-        std::string scanCompleteTopic = "sensor/" + m_sensorID + "/bluetooth/scan_complete";
-        m_mosquitto->publish(scanCompleteTopic.c_str(), "");
-        m_mosquitto->loop();
+        m_mosquitto->flush();
+        m_flushDuration->record(monotonicMicroseconds() - start);
+    }
+
+    uint64_t publishedBytes;
+    unsigned int flushes;
+    m_mosquitto->takeWriteStats(publishedBytes, flushes);
+    m_publishedBytes->add(publishedBytes);
+    m_flushes->add(flushes);
+}
 
+// scans given device and sends availability status using mqtt
+bool BluetoothSensor::checkDevice(unsigned int deviceIndex)
+{
+    if (deviceIndex >= m_devices.size())
+    {
         return false;
     }
+    TRACE_SCOPE("checkDevice");
+    const std::string& address = m_devices.at(deviceIndex);
 
-    if (discoveredDevices.size() > 0) print("Found:");
-
-    std::string newDeviceTopic = "sensor/" + m_sensorID + "/bluetooth/new_device";
-    for (unsigned int i = 0; i < discoveredDevices.size(); i++)
+    // the capture didn't probe the device at this point, it may have been
+    // linked or taken by another sensor. it keeps its state
+    if (m_replay && !m_replay->hasProbe(address))
     {
-        print(discoveredDevices.at(i).btAddress + " " + discoveredDevices.at(i).name);
+        m_replay->idle();
+        return false;
+    }
 
-        Json::Value root;
-        root["name"] = discoveredDevices.at(i).name;
-        root["mac"] = discoveredDevices.at(i).btAddress;
+    DeviceState& state = m_deviceStates[address];
 
-        Json::StyledWriter writer;
-        std::string JSONstring = writer.write(root);
-        m_mosquitto->publish(newDeviceTopic.c_str(), JSONstring.c_str());
-        m_mosquitto->loop();
+    // recorded probes are replayed one per check whatever the strategy
+    ProbeStrategy strategy = PROBE_NAME_REQUEST;
+    if (!m_replay) strategy = m_probeSelector.choose(address, state.available);
+
+    uint64_t probeStart = monotonicMicroseconds();
+    bool available;
+    {
+        TRACE_SCOPE("scanDevice");
+        available = m_bluetoothPoller->scanDevice(address, strategy);
     }
+    uint64_t probeDuration = monotonicMicroseconds() - probeStart;
 
-    std::string scanCompleteTopic = "sensor/" + m_sensorID + "/bluetooth/scan_complete";
-    m_mosquitto->publish(scanCompleteTopic.c_str(), "");
-    m_mosquitto->loop();
+    // a cancelled probe tells nothing about the device, nor does one that
+    // failed because the adapter did
+    if (quit || !m_bluetoothPoller->isAdapterHealthy()) return false;
 
-    return true;
-}
+    m_strategyProbes[strategy]->add();
+    if (available) m_strategyDuration[strategy]->record(probeDuration);
+    if (!m_replay) m_probeSelector.record(address, strategy, available, probeDuration);
 
-// tries to connect mosquitto when it didn't succeed normally or connection was lost
-bool BluetoothSensor::connectMosquitto(bool reconnect)
-{
-    // when reconnecting the first attempt occures right here at the start before waiting
-    if (reconnect)
+    // a device that was there a moment ago is asked its name before it's
+    // reported gone, other strategies may miss devices that are around
+    if (!available && state.available && strategy != PROBE_NAME_REQUEST && !m_replay)
     {
-        print("Reconnecting Mosquitto attempt #1...");
-        if (m_mosquitto->reconnect())
+        TRACE_SCOPE("confirmProbe");
+        uint64_t confirmStart = monotonicMicroseconds();
+        available = m_bluetoothPoller->scanDevice(address, PROBE_NAME_REQUEST);
+        uint64_t confirmDuration = monotonicMicroseconds() - confirmStart;
+        if (quit || !m_bluetoothPoller->isAdapterHealthy()) return false;
+
+        m_strategyProbes[PROBE_NAME_REQUEST]->add();
+        if (available)
         {
-            print("Mosquitto reconnected");
-            return true;
+            m_strategyDuration[PROBE_NAME_REQUEST]->record(confirmDuration);
+            m_probeSelector.record(address, PROBE_NAME_REQUEST, true, confirmDuration);
+            m_probeSelector.recordMiss(address, strategy);
+            m_probeMisses->add();
+            Logger::writef(LOG_DEBUG, "Probe strategy %s missed device %s", probeStrategyName(strategy), address.c_str());
         }
-        if (quit) return false;
+        probeDuration += confirmDuration;
     }
 
-    // repeat until connection established or quitted
-    int attempts = 1;
-    do
+    m_probeDuration->record(probeDuration);
+    m_recorder.recordProbe(address, available, probeDuration);
+    m_probes->add();
+    if (available) m_probesAvailable->add();
+
+    reportDevice(address, available, "");
+
+    // a device found present is followed through a link from now on, if there's room
+    if (available && !m_replay && m_linkMonitor.hasRoom() && time(NULL) >= m_nextLinkAttempt[address])
+    {
+        TRACE_SCOPE("linkDevice");
+        if (m_linkMonitor.link(address))
+        {
+            Logger::writef(LOG_DEBUG, "Linked to device %s", address.c_str());
+            m_linkedDevicesGauge->set(m_linkMonitor.size());
+        }
+        else
+        {
+            Logger::writef(LOG_DEBUG, "%s", m_linkMonitor.getLastErrorString().c_str());
+            m_nextLinkAttempt[address] = time(NULL) + LINK_RETRY_INTERVAL;
+        }
+    }
+    return available;
+}
+
+// updates state of the device and sends its availability status using mqtt
+void BluetoothSensor::reportDevice(const std::string& address, bool available, const char* note)
+{
+    DeviceState& state = m_deviceStates[address];
+    bool changed = state.lastChecked == 0 || state.available != available;
+    bool transition = state.lastChecked != 0 && state.available != available;
+    state.lastChecked = time(NULL);
+    state.available = available;
+    if (available) state.lastSeen = state.lastChecked;
+    if (transition) ProbeScheduler::recordTransition(state, state.lastChecked);
+
+    int8_t rssi;
+    m_history.update(address, available, state.lastChecked, m_linkMonitor.rssi(address, rssi) ? rssi : RSSI_UNKNOWN);
+
+    // changes are always logged, repeating results at most once per log_device_interval
+    LogLevel level = LOG_DEBUG;
+    if (Logger::enabled(LOG_INFO) && m_deviceLogLimiter.allow(address, changed)) level = LOG_INFO;
+    Logger::writef(level, "Checking device %s... %s%s", address.c_str(), available ? "AVAILABLE" : "unavailable", note);
+
+    std::string availableTopic = "sensor/" + m_sensorID + "/bluetooth/available";
+    std::string unavailableTopic = "sensor/" + m_sensorID + "/bluetooth/unavailable";
+
+    std::string topic;
+
+    if (available)
+    {
+        topic = availableTopic;
+    }
+    else
+    {
+        topic = unavailableTopic;
+    }
+
+    if (m_firstResultMs < 0)
+    {
+        m_firstResultMs = millisecondsSince(m_startTime);
+        m_firstResultGauge->set(m_firstResultMs);
+        std::stringstream ss;
+        ss << "First presence result " << m_firstResultMs << " ms after start";
+        print(ss.str());
+    }
+
+    publish(topic, address);
+}
+
+// keeps reporting a linked device available without probing it, the link
+// drops if the device goes away
+void BluetoothSensor::reportLinkedDevice(const std::string& address)
+{
+    if (time(NULL) - m_deviceStates[address].lastChecked < LINKED_REPORT_INTERVAL) return;
+    reportDevice(address, true, " (linked)");
+}
+
+// reports devices whose links have timed out as gone. devices whose links
+// ended otherwise are simply probed again
+void BluetoothSensor::checkLinks()
+{
+    std::vector<std::string> departed;
+    std::vector<std::string> lost;
+    m_linkMonitor.checkLinks(departed, lost);
+    if (departed.empty() && lost.empty()) return;
+
+    for (unsigned int i = 0; i < departed.size(); i++)
+    {
+        m_linkDepartures->add();
+        reportDevice(departed.at(i), false, " (link timed out)");
+    }
+    for (unsigned int i = 0; i < lost.size(); i++)
+    {
+        m_linksLost->add();
+        Logger::writef(LOG_DEBUG, "Link to device %s closed", lost.at(i).c_str());
+    }
+    m_linkedDevicesGauge->set(m_linkMonitor.size());
+}
+
+bool BluetoothSensor::checkAdapter()
+{
+    bool up = m_bluetoothPoller->checkAdapter();
+    if (up == m_adapterUp) return up;
+    m_adapterUp = up;
+    m_adapterUpGauge->set(up ? 1 : 0);
+
+    // links go down with the adapter, and they are made again as the devices are found
+    if (!up)
+    {
+        printError("Bluetooth adapter failed, probing is paused until it's reopened");
+        m_linkMonitor.shutdown();
+    }
+    else
+    {
+        print("Bluetooth adapter reopened");
+        m_adapterRecoveries->add();
+        if (!m_linkMonitor.init(m_bluetoothPoller->deviceId(), std::max(m_config.linkMonitorMax, 0)))
+        {
+            printError(m_linkMonitor.getLastErrorString());
+        }
+    }
+    applyLinkConfig();
+
+    publish(sensorTopic(m_sensorID, "adapter"), up ? "up" : "down");
+    return up;
+}
+
+// starts fetching device info json from server in the background
+void BluetoothSensor::startDeviceDataFetch()
+{
+    // a fetch already in progress will deliver the newest data anyway
+    if (m_fetchState != TASK_IDLE) return;
+
+    print("Fetching device database...");
+
+    m_updateDBNeeded = false;
+    m_fetchUrl = m_config.dataFetchUrl;
+    m_fetchedData.clear();
+    m_fetchState = TASK_RUNNING;
+
+    // replayed fetches are instant and must happen in order
+    if (m_replay)
+    {
+        fetchDeviceData();
+        return;
+    }
+    m_fetchThreadStarted = pthread_create(&m_fetchThread, NULL, BluetoothSensor::fetchThreadWrapper, this) == 0;
+    if (!m_fetchThreadStarted) fetchDeviceData();
+}
+
+// gets device info json from server. called in a background thread
+void BluetoothSensor::fetchDeviceData()
+{
+    TRACE_SCOPE("fetchDeviceData");
+    uint64_t start = monotonicMicroseconds();
+    if (m_replay)
+    {
+        if (!m_replay->takeFetch(m_fetchSucceeded, m_fetchedData))
+        {
+            m_fetchSucceeded = false;
+            m_fetchedData = "No more recorded database fetches";
+        }
+        if (!m_fetchSucceeded) m_fetchError = m_fetchedData;
+    }
+    else
+    {
+        m_fetchSucceeded = m_dataGetter->get(m_fetchUrl, m_fetchedData);
+        if (!m_fetchSucceeded) m_fetchError = m_dataGetter->getLastErrorString();
+    }
+    m_dbFetchDuration->record(monotonicMicroseconds() - start);
+    if (!m_fetchSucceeded) m_dbFetchFailures->add();
+    __sync_lock_test_and_set(&m_fetchState, TASK_DONE);
+}
+
+void* BluetoothSensor::fetchThreadWrapper(void* obj)
+{
+    BluetoothSensor* sensor = (BluetoothSensor*) obj;
+    Tracer::setThreadName("db fetch");
+    sensor->fetchDeviceData();
+    return 0;
+}
+
+// updates local device database when background fetch has completed,
+// schedules a retry if the fetch failed
+void BluetoothSensor::checkDeviceDataFetch()
+{
+    if (__sync_fetch_and_add(&m_fetchState, 0) != TASK_DONE) return;
+
+    if (m_fetchThreadStarted)
+    {
+        pthread_join(m_fetchThread, NULL);
+        m_fetchThreadStarted = false;
+    }
+    m_fetchState = TASK_IDLE;
+
+    m_recorder.recordFetch(m_fetchSucceeded, m_fetchSucceeded ? m_fetchedData : m_fetchError);
+
+    bool ok = m_fetchSucceeded;
+    if (ok)
+    {
+        ok = updateDeviceData(m_fetchedData);
+    }
+    else
+    {
+        printError(m_fetchError);
+    }
+
+    if (!ok)
+    {
+        int jitter = m_config.dbRefreshJitter > 0 ? rand() % (m_config.dbRefreshJitter + 1) : 0;
+        m_updateDBNeeded = true;
+        m_nextDBUpdate = time(NULL) + m_config.dbRetryInterval + jitter;
+    }
+}
+
+// updates local device database from device info json
+bool BluetoothSensor::updateDeviceData(const std::string& data)
+{
+    TRACE_SCOPE("updateDeviceData");
+    Json::Value root;
+    Json::Reader reader;
+    bool parsingSuccessful = reader.parse(data, root);
+    if (!parsingSuccessful)
+    {
+        printError("Failed to parse device data\n" + reader.getFormatedErrorMessages());
+        return false;
+    }
+
+    // server may also send the database in the same versioned form that is
+    // pushed with mqtt, otherwise the version of the database is unknown
+    m_dbVersion = -1;
+    if (root.isObject())
+    {
+        if (root.isMember("version") && !isIntValue(root["version"]))
+        {
+            printError("Invalid device data version");
+            return false;
+        }
+        m_dbVersion = root.get("version", -1).asInt();
+        root = root["devices"];
+    }
+
+    std::vector<std::string> devices;
+    parseDevices(root, devices);
+    setDevices(devices);
+
+    return true;
+}
+
+// picks bt addresses from device info json array
+void BluetoothSensor::parseDevices(const Json::Value& list, std::vector<std::string>& devices)
+{
+    if (!list.isArray()) return;
+
+    // go through root elements and search for "bluetooth". elements that
+    // aren't objects or have no string identifier are skipped, jsoncpp
+    // would throw on reading them
+    for (unsigned int i = 0; i < list.size(); i++ )
+    {
+        if (!list[i].isObject() || !list[i]["identifier"].isString()) continue;
+        if (list[i].get("type", "") == "bluetooth")
+        {
+            // "identifier" field contains the bt address
+            std::string newDevice = list[i]["identifier"].asString();
+            devices.push_back(newDevice);
+        }
+    }
+}
+
+// replaces local device database with given devices
+void BluetoothSensor::setDevices(const std::vector<std::string>& devices)
+{
+    m_devices = devices;
+    m_linkMonitor.retain(m_devices);
+    m_linkedDevicesGauge->set(m_linkMonitor.size());
+    m_probeScheduler.retain(m_devices);
+
+    if (m_devices.size() > 0)
+    {
+        print("Devices:");
+        for (unsigned int i = 0; i < m_devices.size(); i++)
+        {
+            print(m_devices.at(i));
+        }
+    }
+    else
+    {
+        print("No devices");
+    }
+
+    updatePartition();
+    saveDeviceCache();
+}
+
+// applies device database pushed with mqtt. full database is received from
+// the retained database topic and changes to it from the delta topic
+void BluetoothSensor::applyDeviceDatabaseMessage(const mqttMessage& message)
+{
+    Json::Value root;
+    Json::Reader reader;
+    if (!reader.parse(message.content, root) || !root.isObject())
+    {
+        printError("Failed to parse pushed device data\n" + reader.getFormatedErrorMessages());
+        return;
+    }
+    if ((root.isMember("version") && !isIntValue(root["version"])) ||
+        (root.isMember("base") && !isIntValue(root["base"])))
+    {
+        printError("Invalid version in pushed device data");
+        return;
+    }
+
+    int version = root.get("version", -1).asInt();
+
+    if (message.topic == m_config.deviceDBTopic)
+    {
+        print("Received device database from broker");
+
+        std::vector<std::string> devices;
+        parseDevices(root["devices"], devices);
+        setDevices(devices);
+        m_dbVersion = version;
+        m_updateDBNeeded = false;
+        return;
+    }
+
+    // delta message, must be based on the version we have. after an http fetch
+    // the version is unknown, but adding and removing devices is idempotent so
+    // a delta newer than the fetched data can still be applied
+    int base = root.get("base", -1).asInt();
+    if (m_dbVersion >= 0 && version <= m_dbVersion) return;
+    if (m_dbVersion >= 0 && base != m_dbVersion)
+    {
+        std::stringstream ss;
+        ss << "Device database version gap (have " << m_dbVersion << ", delta based on "
+           << base << "), fetching full database";
+        printError(ss.str());
+
+        // fetch soon but not all sensors at once
+        m_updateDBNeeded = true;
+        m_nextDBUpdate = time(NULL) + (m_config.dbRefreshJitter > 0 ? rand() % (m_config.dbRefreshJitter + 1) : 0);
+        return;
+    }
+
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    parseDevices(root["add"], added);
+    parseDevices(root["remove"], removed);
+
+    std::vector<std::string> devices;
+    for (unsigned int i = 0; i < m_devices.size(); i++)
+    {
+        if (std::find(removed.begin(), removed.end(), m_devices.at(i)) == removed.end())
+        {
+            devices.push_back(m_devices.at(i));
+        }
+    }
+    for (unsigned int i = 0; i < added.size(); i++)
+    {
+        if (std::find(devices.begin(), devices.end(), added.at(i)) == devices.end())
+        {
+            devices.push_back(added.at(i));
+        }
+    }
+
+    std::stringstream ss;
+    ss << "Received device database delta " << base << " -> " << version;
+    print(ss.str());
+
+    setDevices(devices);
+    m_dbVersion = version;
+}
+
+// reads device database and learned device state from the cache file
+bool BluetoothSensor::loadDeviceCache()
+{
+    if (m_config.deviceCacheFile.empty()) return false;
+
+    print("Reading device cache...");
+
+    if (!m_deviceCache.load(m_config.deviceCacheFile, m_devices, m_deviceStates))
+    {
+        printError(m_deviceCache.getLastErrorString());
+        return false;
+    }
+
+    std::stringstream ss;
+    ss << m_devices.size() << " devices read from cache";
+    print(ss.str());
+    return true;
+}
+
+// writes device database and learned device state to the cache file
+void BluetoothSensor::saveDeviceCache()
+{
+    m_lastCacheSave = time(NULL);
+    m_history.sync();
+
+    // nothing worth caching before the first successful database fetch
+    if (m_config.deviceCacheFile.empty() || m_devices.empty()) return;
+
+    if (!m_deviceCache.save(m_config.deviceCacheFile, m_devices, m_deviceStates))
+    {
+        printError(m_deviceCache.getLastErrorString());
+    }
+}
+
+// checks incoming messages if they contain request for database update or device discovery
+void BluetoothSensor::processIncomingMessages(bool& updateDB, bool& scan)
+{
+    std::vector<mqttMessage> messages;
+    if (m_replay)
     {
-        if (m_connectAttemptInterval > 0)
+        // there's no broker connection when replaying
+        m_replay->takeMessages(messages);
+    }
+    else
+    {
+        // loop many times to receive multiple messages.
+        // can be done smarter with mosquitto 1.0 ->
+        {
+            TRACE_SCOPE("loop");
+            for (unsigned int i = 0; i < 10; i++) m_mosquitto->loop();
+        }
+        messages = m_mosquitto->getArrivedMessages();
+    }
+    m_received->add(messages.size());
+
+    updateDB = false;
+    scan = false;
+
+    for (unsigned int i = 0; i < messages.size(); i++)
+    {
+        m_recorder.recordMessage(messages[i]);
+
+        if (messages[i].topic == "command/fetch_device_database")
+        {
+            updateDB = true;
+        }
+        else if (messages[i].topic.substr(0, 22) == "command/scan/bluetooth")
+        {
+            scan = true;
+        }
+        else if (messages[i].topic.substr(0, 23) == "command/trace/bluetooth")
+        {
+            handleTraceCommand(messages[i].content);
+        }
+        else if (messages[i].topic.substr(0, 25) == "command/history/bluetooth")
+        {
+            handleHistoryCommand(messages[i].content);
+        }
+        else if (!m_config.deviceDBTopic.empty() &&
+                 (messages[i].topic == m_config.deviceDBTopic || messages[i].topic == m_config.deviceDBTopic + "/delta"))
+        {
+            applyDeviceDatabaseMessage(messages[i]);
+        }
+        else if (messages[i].topic.substr(0, 7) == "sensor/")
+        {
+            handleGroupMessage(messages[i]);
+        }
+    }
+}
+
+
+// discovers bt devices in the range and sends bt addresses using mqtt
+bool BluetoothSensor::discoverDevices()
+{
+    TRACE_SCOPE("discoverDevices");
+    print("Discovering devices...");
+
+    std::vector<DiscoveredDevice> discoveredDevices;
+    uint64_t start = monotonicMicroseconds();
+    bool ok = m_bluetoothPoller->discoverDevices(discoveredDevices);
+    uint64_t duration = monotonicMicroseconds() - start;
+    m_discoveryDuration->record(duration);
+    m_recorder.recordInquiry(ok, discoveredDevices, duration);
+    if (!ok)
+    {
+        printError(m_bluetoothPoller->getLastErrorString());
+        std::string scanCompleteTopic = "sensor/" + m_sensorID + "/bluetooth/scan_complete";
+        publish(scanCompleteTopic, "");
+
+        return false;
+    }
+
+    m_discoveredDevices->add(discoveredDevices.size());
+    if (discoveredDevices.size() > 0) print("Found:");
+
+    std::string newDeviceTopic = "sensor/" + m_sensorID + "/bluetooth/new_device";
+    for (unsigned int i = 0; i < discoveredDevices.size(); i++)
+    {
+        print(discoveredDevices.at(i).btAddress + " " + discoveredDevices.at(i).name);
+
+        m_jsonWriter.clear();
+        m_jsonWriter.beginObject();
+        m_jsonWriter.key("name");
+        m_jsonWriter.value(discoveredDevices.at(i).name);
+        m_jsonWriter.key("mac");
+        m_jsonWriter.value(discoveredDevices.at(i).btAddress);
+        m_jsonWriter.endObject();
+        publish(newDeviceTopic, m_jsonWriter.str());
+    }
+
+    std::string scanCompleteTopic = "sensor/" + m_sensorID + "/bluetooth/scan_complete";
+    publish(scanCompleteTopic, "");
+
+    return true;
+}
+
+// tries to connect mosquitto when it didn't succeed normally or connection was lost
+bool BluetoothSensor::connectMosquitto(bool reconnect)
+{
+    TRACE_SCOPE("connectMosquitto");
+    // when reconnecting the first attempt occures right here at the start before waiting
+    if (reconnect)
+    {
+        print("Reconnecting Mosquitto attempt #1...");
+        if (m_mosquitto->connectToAny(m_config.brokers, BROKER_CONNECT_TIMEOUT))
+        {
+            print("Mosquitto reconnected to " + m_mosquitto->connectedBroker());
+            return true;
+        }
+        if (quit) return false;
+    }
+
+    // repeat until connection established or quitted
+    int attempts = 1;
+    do
+    {
+        if (m_config.connectAttemptInterval > 0)
         {
             std::stringstream ss;
-            ss <<  "Waiting connect attempt interval (" << m_connectAttemptInterval << " sec)...";
+            ss <<  "Waiting connect attempt interval (" << m_config.connectAttemptInterval << " sec)...";
             print(ss.str());
 
-            // wait for given interval before next attempt, check once a second
-            // if quit is requested
-            for (int timer = 0; timer < m_connectAttemptInterval; timer++)
+            // wait for given interval before next attempt, check ten times a
+            // second if quit is requested
+            for (int timer = 0; timer < m_config.connectAttemptInterval * 10; timer++)
             {
                 if (quit) return false;
-                sleep(1);
+                usleep(100000);
             }
         }
 
@@ -403,31 +1502,612 @@ bool BluetoothSensor::connectMosquitto(bool reconnect)
         ss << "Mosquitto attempt #" << attempts << "...";
         print(ss.str());
 
-        if (m_mosquitto->reconnect()) break;
+        if (m_mosquitto->connectToAny(m_config.brokers, BROKER_CONNECT_TIMEOUT)) break;
         if (quit) return false;
     } while (1);
 
-    reconnect ? print("Mosquitto reconnected") : print("Mosquitto connected");
+    print((reconnect ? "Mosquitto reconnected to " : "Mosquitto connected to ") + m_mosquitto->connectedBroker());
+    return true;
+}
+
+// reads config file, missing values are set to defaults
+bool BluetoothSensor::readConfig(std::string configFileName, SensorConfig& config)
+{
+    config = SensorConfig();
+
+    dictionary* ini ;
+    ini = iniparser_load(configFileName.c_str());
+    if (!ini) return false;
+
+    config.brokerAddress = iniparser_getstring(ini, ":broker_address",
+                                          (char*)DEFAULT_BROKER_ADDRESS.c_str());
+    config.brokerPort = iniparser_getint(ini, ":broker_port",
+                                    DEFAULT_BROKER_PORT);
+    parseBrokerList(config.brokerAddress, config.brokerPort, config.brokers);
+    config.dataFetchUrl = iniparser_getstring(ini, ":data_fetch_url",
+                                          (char*)DEFAULT_DATA_FETCH_URL.c_str());
+    config.connectAttemptInterval = iniparser_getint(ini, ":connect_attempt_interval",
+                                    DEFAULT_CONNECT_ATTEMPT_INTERVAL);
+    config.deviceCacheFile = iniparser_getstring(ini, ":device_cache_file",
+                                          (char*)DEFAULT_DEVICE_CACHE_FILE.c_str());
+    config.dbRetryInterval = iniparser_getint(ini, ":db_retry_interval",
+                                    DEFAULT_DB_RETRY_INTERVAL);
+    config.dbRefreshJitter = iniparser_getint(ini, ":db_refresh_jitter",
+                                    DEFAULT_DB_REFRESH_JITTER);
+    config.deviceDBTopic = iniparser_getstring(ini, ":device_db_topic", (char*)"");
+    config.metricsInterval = iniparser_getint(ini, ":metrics_interval",
+                                    DEFAULT_METRICS_INTERVAL);
+    config.metricsAddress = iniparser_getstring(ini, ":metrics_address",
+                                          (char*)DEFAULT_METRICS_ADDRESS.c_str());
+    config.metricsPort = iniparser_getint(ini, ":metrics_port",
+                                    DEFAULT_METRICS_PORT);
+    config.logLevel = Logger::levelFromString(iniparser_getstring(ini, ":log_level",
+                                          (char*)DEFAULT_LOG_LEVEL.c_str()), LOG_INFO);
+    config.logDeviceInterval = iniparser_getint(ini, ":log_device_interval",
+                                    DEFAULT_LOG_DEVICE_INTERVAL);
+    config.tracing = iniparser_getboolean(ini, ":tracing", 0);
+    config.traceFile = iniparser_getstring(ini, ":trace_file",
+                                          (char*)DEFAULT_TRACE_FILE.c_str());
+    config.simulatedRadio = iniparser_getboolean(ini, ":simulated_radio", 0);
+    config.simulatedPresence = iniparser_getdouble(ini, ":simulated_presence",
+                                    DEFAULT_SIMULATED_PRESENCE);
+    config.simulatedLatencyScale = iniparser_getdouble(ini, ":simulated_latency_scale",
+                                    DEFAULT_SIMULATED_LATENCY_SCALE);
+    config.recordFile = iniparser_getstring(ini, ":record_file", (char*)"");
+    config.replayFile = iniparser_getstring(ini, ":replay_file", (char*)"");
+    config.replaySpeed = iniparser_getdouble(ini, ":replay_speed", DEFAULT_REPLAY_SPEED);
+    config.partitionGroup = iniparser_getstring(ini, ":partition_group", (char*)"");
+    config.partitionReplicas = iniparser_getint(ini, ":partition_replicas",
+                                    DEFAULT_PARTITION_REPLICAS);
+    config.heartbeatInterval = iniparser_getint(ini, ":heartbeat_interval",
+                                    DEFAULT_HEARTBEAT_INTERVAL);
+    parseProbeStrategies(iniparser_getstring(ini, ":probe_strategies",
+                                    (char*)DEFAULT_PROBE_STRATEGIES.c_str()), config.probeStrategies);
+    config.probeExploreInterval = iniparser_getint(ini, ":probe_explore_interval",
+                                    DEFAULT_PROBE_EXPLORE_INTERVAL);
+    config.probeQuietShare = iniparser_getdouble(ini, ":probe_quiet_share",
+                                    DEFAULT_PROBE_QUIET_SHARE);
+    config.linkMonitorMax = iniparser_getint(ini, ":link_monitor_max",
+                                    DEFAULT_LINK_MONITOR_MAX);
+    config.linkRssiInterval = iniparser_getint(ini, ":link_rssi_interval",
+                                    DEFAULT_LINK_RSSI_INTERVAL);
+    config.historyFile = iniparser_getstring(ini, ":history_file",
+                                          (char*)DEFAULT_HISTORY_FILE.c_str());
+    config.historyIntervals = iniparser_getint(ini, ":history_intervals",
+                                    DEFAULT_HISTORY_INTERVALS);
+
+    if (iniparser_find_entry(ini, ":sensor_id"))
+    {
+        config.sensorID = iniparser_getstring(ini, ":sensor_id", 0);
+    }
+
+    iniparser_freedict(ini);
     return true;
 }
 
+// returns sensor id used with given config
+std::string BluetoothSensor::sensorIDFor(const SensorConfig& config)
+{
+    if (!config.sensorID.empty()) return config.sensorID;
+    return "bt-sensor_" + m_btAddress;
+}
+
+// rereads config file and applies changed values. only the parts affected by
+// the changes are reinitialized, scanning continues meanwhile
+void BluetoothSensor::reloadConfig()
+{
+    TRACE_SCOPE("reloadConfig");
+    m_configRetryNeeded = false;
+
+    if (!m_replay && !isBrokerReady())
+    {
+        // the startup connection is still being made in the background with the
+        // current settings and subscriptions, nothing is changed under it
+        m_configRetryNeeded = true;
+        m_nextConfigRetry = time(NULL) + 1;
+        return;
+    }
+
+    SensorConfig newConfig;
+    if (!readConfig(m_configFileName, newConfig))
+    {
+        // file may be in the middle of being written, the next write triggers a new reload
+        printError("Cannot parse changed config file, keeping current config");
+        return;
+    }
+
+    print("Config file changed, applying changes...");
+
+    if (m_replay)
+    {
+        // there's no broker connection to change, and the group and device
+        // database topic stay those of the capture
+        newConfig.brokerAddress = m_config.brokerAddress;
+        newConfig.brokerPort = m_config.brokerPort;
+        newConfig.brokers = m_config.brokers;
+        newConfig.sensorID = m_config.sensorID;
+        newConfig.deviceDBTopic = m_config.deviceDBTopic;
+        newConfig.partitionGroup = m_config.partitionGroup;
+        newConfig.partitionReplicas = m_config.partitionReplicas;
+        newConfig.heartbeatInterval = m_config.heartbeatInterval;
+    }
+
+    if (m_switchMosquitto)
+    {
+        // a broker change is still being connected, look at the changes again once it's done
+        m_configRetryNeeded = true;
+        m_nextConfigRetry = time(NULL) + 1;
+    }
+    else if (newConfig.brokerDiffers(m_config))
+    {
+        startBrokerSwitch(newConfig);
+    }
+
+    if (newConfig.partitionGroup != m_config.partitionGroup ||
+        newConfig.partitionReplicas != m_config.partitionReplicas ||
+        newConfig.heartbeatInterval != m_config.heartbeatInterval)
+    {
+        if (m_config.partitionGroup.empty() != newConfig.partitionGroup.empty())
+        {
+            const char* topics[] = {"sensor/+/bluetooth/hello", "sensor/+/bluetooth/heartbeat", "sensor/+/bluetooth/goodbye"};
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                newConfig.partitionGroup.empty() ? m_mosquitto->unsubscribe(topics[i]) : m_mosquitto->subscribe(topics[i]);
+            }
+        }
+        if (newConfig.partitionGroup != m_config.partitionGroup)
+        {
+            // members of the old group aren't members of the new one, ask the new ones to tell about themselves
+            if (!m_config.partitionGroup.empty()) publish(sensorTopic(m_sensorID, "goodbye"), m_config.partitionGroup);
+            m_sensorGroup.clear();
+            m_config.partitionGroup = newConfig.partitionGroup;
+            sendHello();
+        }
+        m_config.partitionReplicas = newConfig.partitionReplicas;
+        m_config.heartbeatInterval = newConfig.heartbeatInterval;
+        applyGroupConfig();
+    }
+
+    if (newConfig.deviceDBTopic != m_config.deviceDBTopic)
+    {
+        if (!m_config.deviceDBTopic.empty())
+        {
+            m_mosquitto->unsubscribe(m_config.deviceDBTopic.c_str());
+            m_mosquitto->unsubscribe(std::string(m_config.deviceDBTopic + "/delta").c_str());
+        }
+        if (!newConfig.deviceDBTopic.empty())
+        {
+            m_mosquitto->subscribe(newConfig.deviceDBTopic.c_str());
+            m_mosquitto->subscribe(std::string(newConfig.deviceDBTopic + "/delta").c_str());
+        }
+        m_config.deviceDBTopic = newConfig.deviceDBTopic;
+        m_dbVersion = -1;
+    }
+
+    if (newConfig.dataFetchUrl != m_config.dataFetchUrl)
+    {
+        // all sensors see the change at the same time, spread the fetches
+        m_config.dataFetchUrl = newConfig.dataFetchUrl;
+        m_updateDBNeeded = true;
+        m_nextDBUpdate = time(NULL) + (newConfig.dbRefreshJitter > 0 ? rand() % (newConfig.dbRefreshJitter + 1) : 0);
+    }
+
+    if (newConfig.metricsAddress != m_config.metricsAddress || newConfig.metricsPort != m_config.metricsPort)
+    {
+        m_config.metricsAddress = newConfig.metricsAddress;
+        m_config.metricsPort = newConfig.metricsPort;
+        startMetricsServer();
+    }
+
+    if (newConfig.tracing != m_config.tracing)
+    {
+        m_config.tracing = newConfig.tracing;
+        Tracer::setEnabled(m_config.tracing);
+    }
+    m_config.traceFile = newConfig.traceFile;
+
+    m_config.logLevel = newConfig.logLevel;
+    m_config.logDeviceInterval = newConfig.logDeviceInterval;
+    applyLogConfig();
+
+    m_config.probeStrategies = newConfig.probeStrategies;
+    m_config.probeExploreInterval = newConfig.probeExploreInterval;
+    m_config.probeQuietShare = newConfig.probeQuietShare;
+    applyProbeConfig();
+
+    m_config.linkMonitorMax = newConfig.linkMonitorMax;
+    m_config.linkRssiInterval = newConfig.linkRssiInterval;
+    applyLinkConfig();
+
+    if (!m_replay && (newConfig.historyFile != m_config.historyFile ||
+                      newConfig.historyIntervals != m_config.historyIntervals))
+    {
+        m_config.historyFile = newConfig.historyFile;
+        m_config.historyIntervals = newConfig.historyIntervals;
+        openHistory();
+    }
+
+    // rest of the values are simply read when needed
+    m_config.metricsInterval = newConfig.metricsInterval;
+    m_config.connectAttemptInterval = newConfig.connectAttemptInterval;
+    if (!m_replay) m_config.deviceCacheFile = newConfig.deviceCacheFile;
+    m_config.dbRetryInterval = newConfig.dbRetryInterval;
+    m_config.dbRefreshJitter = newConfig.dbRefreshJitter;
+}
+
+// subscribes command and device database topics
+void BluetoothSensor::subscribeTopics(MosquittoHandler* mosquitto, const SensorConfig& config)
+{
+    mosquitto->subscribe("command/fetch_device_database");
+    mosquitto->subscribe(std::string("command/scan/bluetooth/" + sensorIDFor(config)).c_str());
+    mosquitto->subscribe("command/scan/bluetooth");
+    mosquitto->subscribe(std::string("command/trace/bluetooth/" + sensorIDFor(config)).c_str());
+    mosquitto->subscribe("command/trace/bluetooth");
+    mosquitto->subscribe(std::string("command/history/bluetooth/" + sensorIDFor(config)).c_str());
+    mosquitto->subscribe("command/history/bluetooth");
+    if (!config.deviceDBTopic.empty())
+    {
+        mosquitto->subscribe(config.deviceDBTopic.c_str());
+        mosquitto->subscribe(std::string(config.deviceDBTopic + "/delta").c_str());
+    }
+    if (!config.partitionGroup.empty())
+    {
+        mosquitto->subscribe("sensor/+/bluetooth/hello");
+        mosquitto->subscribe("sensor/+/bluetooth/heartbeat");
+        mosquitto->subscribe("sensor/+/bluetooth/goodbye");
+    }
+}
+
+// creates metrics for the measured code paths
+void BluetoothSensor::registerMetrics()
+{
+    m_probeDuration = m_metrics.histogram("bt_sensor_probe_duration_seconds",
+                                          "Time taken by a single device probe");
+    m_scanCycleDuration = m_metrics.histogram("bt_sensor_scan_cycle_duration_seconds",
+                                              "Time taken to probe all devices once");
+    m_publishDuration = m_metrics.histogram("bt_sensor_publish_duration_seconds",
+                                            "Time taken to queue a message for publishing");
+    m_flushDuration = m_metrics.histogram("bt_sensor_flush_duration_seconds",
+                                          "Time taken to write queued messages to the broker");
+    m_publishedBytes = m_metrics.counter("bt_sensor_published_bytes_total",
+                                         "Bytes of publish packets sent to the broker");
+    m_flushes = m_metrics.counter("bt_sensor_flushes_total",
+                                  "Writes of queued messages to the broker");
+    m_dbFetchDuration = m_metrics.histogram("bt_sensor_db_fetch_duration_seconds",
+                                            "Time taken to fetch the device database");
+    m_discoveryDuration = m_metrics.histogram("bt_sensor_discovery_duration_seconds",
+                                              "Time taken by device discovery");
+    m_probes = m_metrics.counter("bt_sensor_probes_total", "Device probes made");
+    m_residentMemoryGauge = m_metrics.gauge("bt_sensor_resident_memory_bytes", "Resident memory of the process");
+    m_cpuTime = m_metrics.counter("bt_sensor_cpu_microseconds_total", "User and system cpu time used by the process");
+    m_arrivedMessagesGauge = m_metrics.gauge("bt_sensor_arrived_messages",
+                                             "Received messages waiting to be handled");
+    m_probesAvailable = m_metrics.counter("bt_sensor_probes_available_total",
+                                          "Device probes that found the device");
+    m_published = m_metrics.counter("bt_sensor_published_total", "Messages published");
+    m_publishFailures = m_metrics.counter("bt_sensor_publish_failures_total",
+                                          "Messages that couldn't be published");
+    m_received = m_metrics.counter("bt_sensor_received_total", "Messages received");
+    m_dbFetchFailures = m_metrics.counter("bt_sensor_db_fetch_failures_total",
+                                          "Failed device database fetches");
+    m_discoveredDevices = m_metrics.counter("bt_sensor_discovered_devices_total",
+                                            "Devices found by device discovery");
+    m_hciEvents = m_metrics.counter("bt_sensor_hci_events_total", "Adapter events handled");
+    m_hciReads = m_metrics.counter("bt_sensor_hci_reads_total", "Reads made to get the adapter events");
+    m_devicesGauge = m_metrics.gauge("bt_sensor_devices", "Devices in the device database");
+    m_adapterUpGauge = m_metrics.gauge("bt_sensor_adapter_up", "1 when the bluetooth adapter works");
+    m_adapterUpGauge->set(1);
+    m_adapterRecoveries = m_metrics.counter("bt_sensor_adapter_recoveries_total",
+                                            "Times the bluetooth adapter has been reopened after a failure");
+    m_pendingMessagesGauge = m_metrics.gauge("bt_sensor_pending_messages",
+                                             "Messages waiting for the broker connection");
+    m_droppedLogLinesGauge = m_metrics.gauge("bt_sensor_dropped_log_lines",
+                                             "Log lines dropped because the log buffer was full");
+    m_firstResultGauge = m_metrics.gauge("bt_sensor_first_result_milliseconds",
+                                         "Time from start to the first presence result");
+    m_groupSizeGauge = m_metrics.gauge("bt_sensor_group_size", "Live sensors in the sensor group");
+    m_ownedDevicesGauge = m_metrics.gauge("bt_sensor_owned_devices", "Devices probed by this sensor");
+
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++)
+    {
+        std::string name = probeStrategyName((ProbeStrategy)i);
+        m_strategyProbes[i] = m_metrics.counter("bt_sensor_probes_" + name + "_total",
+                                                "Device probes made with strategy " + name);
+        m_strategyDuration[i] = m_metrics.histogram("bt_sensor_probe_" + name + "_answer_seconds",
+                                                    "Time taken by a device to answer strategy " + name);
+        m_strategyDevices[i] = m_metrics.gauge("bt_sensor_devices_using_" + name,
+                                               "Devices currently probed with strategy " + name);
+    }
+    m_probeMisses = m_metrics.counter("bt_sensor_probe_misses_total",
+                                      "Probes that missed a device a name request found right after");
+    m_probesDeferred = m_metrics.counter("bt_sensor_probes_deferred_total",
+                                         "Probes put off because the device seldom changes at this time of week");
+    m_linkDepartures = m_metrics.counter("bt_sensor_link_departures_total",
+                                         "Linked devices reported gone when their link timed out");
+    m_linksLost = m_metrics.counter("bt_sensor_links_lost_total",
+                                    "Links that ended for other reasons than a timeout");
+    m_linkedDevicesGauge = m_metrics.gauge("bt_sensor_linked_devices", "Devices followed through a link");
+    m_historyIntervalsGauge = m_metrics.gauge("bt_sensor_history_intervals",
+                                              "Presence intervals kept in the history file");
+    m_historyQueries = m_metrics.counter("bt_sensor_history_queries_total", "History commands answered");
+    m_historyQueryDuration = m_metrics.histogram("bt_sensor_history_query_duration_seconds",
+                                                 "Time taken to look up the answer of a history command");
+}
+
+// takes probe strategy settings of the current config into use
+void BluetoothSensor::applyProbeConfig()
+{
+    m_probeSelector.setStrategies(m_config.probeStrategies);
+    m_probeSelector.setExploreInterval(std::max(m_config.probeExploreInterval, 0));
+
+    // replayed probes come in the recorded order, whatever the time of week
+    m_probeScheduler.setQuietShare(m_replay ? 1 : m_config.probeQuietShare);
+}
+
+// takes link monitoring settings of the current config into use
+void BluetoothSensor::applyLinkConfig()
+{
+    m_linkMonitor.setMaxLinks(std::max(m_config.linkMonitorMax, 0));
+    m_linkMonitor.setRssiInterval(m_config.linkRssiInterval);
+    m_linkedDevicesGauge->set(m_linkMonitor.size());
+}
+
+// takes logging settings of the current config into use
+void BluetoothSensor::applyLogConfig()
+{
+    Logger::setLevel(m_config.logLevel);
+    m_deviceLogLimiter.setInterval(m_config.logDeviceInterval);
+}
+
+// starts serving metrics over http if a port is configured
+void BluetoothSensor::startMetricsServer()
+{
+    m_metricsServer.shutdown();
+    if (m_config.metricsPort == 0) return;
+
+    if (!m_metricsServer.init(&m_metrics, m_config.metricsAddress, m_config.metricsPort))
+    {
+        printError(m_metricsServer.getLastErrorString());
+        return;
+    }
+    std::stringstream ss;
+    ss << "Serving metrics at http://" << m_config.metricsAddress << ":" << m_config.metricsPort << "/metrics";
+    print(ss.str());
+}
+
+void BluetoothSensor::updateProcessMetrics()
+{
+    time_t now = time(NULL);
+    if (now == m_lastProcessMetrics) return;
+    m_lastProcessMetrics = now;
+
+    if (m_mosquitto) m_arrivedMessagesGauge->set(m_mosquitto->arrivedCount());
+
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        uint64_t cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+                       usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+        if (cpu > m_cpuMicroseconds) m_cpuTime->add(cpu - m_cpuMicroseconds);
+        m_cpuMicroseconds = cpu;
+    }
+
+    // second field of statm is resident size in pages
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) return;
+    unsigned long size, resident;
+    if (fscanf(statm, "%lu %lu", &size, &resident) == 2) m_residentMemoryGauge->set((int64_t)resident * sysconf(_SC_PAGESIZE));
+    fclose(statm);
+}
+
+// sends metrics using mqtt
+void BluetoothSensor::sendMetrics()
+{
+    m_lastMetricsSent = time(NULL);
+
+    m_jsonWriter.clear();
+    m_metrics.writeJson(m_jsonWriter);
+    publish("sensor/" + m_sensorID + "/bluetooth/metrics", m_jsonWriter.str());
+}
+
+// handles trace command: "on" and "off" switch tracing, anything else writes the trace file
+void BluetoothSensor::handleTraceCommand(const std::string& command)
+{
+    if (command == "on" || command == "off")
+    {
+        print("Tracing " + command);
+        Tracer::setEnabled(command == "on");
+        return;
+    }
+    writeTrace();
+}
+
+// opens the presence history file of the current config, the old one is closed
+void BluetoothSensor::openHistory()
+{
+    m_history.close();
+    if (!m_config.historyFile.empty() && m_config.historyIntervals > 0)
+    {
+        if (m_history.open(m_config.historyFile, m_config.historyIntervals))
+        {
+            std::stringstream ss;
+            ss << m_history.intervalCount() << " presence intervals of " << m_history.deviceCount() << " devices in history";
+            print(ss.str());
+        }
+        else
+        {
+            printError(m_history.getLastErrorString());
+        }
+    }
+    m_historyIntervalsGauge->set(m_history.intervalCount());
+}
+
+// answers a query of a device's presence history. the reply goes to reply_to,
+// or to sensor/<id>/bluetooth/history when not given
+void BluetoothSensor::handleHistoryCommand(const std::string& command)
+{
+    Json::Value root;
+    Json::Reader reader;
+    // jsoncpp throws on reading a value of the wrong type
+    if (!reader.parse(command, root) || !root.isObject() || !root["device"].isString() ||
+        (root.isMember("reply_to") && !root["reply_to"].isString()) ||
+        (root.isMember("intervals") && !isIntValue(root["intervals"])))
+    {
+        printError("Invalid history command");
+        return;
+    }
+    std::string device = root["device"].asString();
+    std::string replyTopic = root.get("reply_to", sensorTopic(m_sensorID, "history")).asString();
+    int limit = root.get("intervals", DEFAULT_HISTORY_QUERY_INTERVALS).asInt();
+
+    uint64_t start = monotonicMicroseconds();
+    time_t lastSeen = 0;
+    bool present = false;
+    bool seen = m_history.lastSeen(device, lastSeen, present);
+    std::vector<PresenceInterval> intervals;
+    m_history.intervals(device, std::max(limit, 0), intervals);
+    m_historyQueryDuration->record(monotonicMicroseconds() - start);
+    m_historyQueries->add();
+
+    m_jsonWriter.clear();
+    m_jsonWriter.beginObject();
+    if (root.isMember("id"))
+    {
+        // id is echoed as it was, whatever its type
+        Json::FastWriter writer;
+        std::string id = writer.write(root["id"]);
+        m_jsonWriter.key("id");
+        m_jsonWriter.rawValue(id.substr(0, id.find_last_not_of("\n") + 1));
+    }
+    m_jsonWriter.key("device");
+    m_jsonWriter.value(device);
+    m_jsonWriter.key("last_seen");
+    seen ? m_jsonWriter.value((long long)lastSeen) : m_jsonWriter.nullValue();
+    m_jsonWriter.key("present");
+    m_jsonWriter.value(present);
+
+    // newest first, [start, end, rssi] with rssi null when not measured
+    m_jsonWriter.key("intervals");
+    m_jsonWriter.beginArray();
+    for (unsigned int i = 0; i < intervals.size(); i++)
+    {
+        m_jsonWriter.beginArray();
+        m_jsonWriter.value((long long)intervals.at(i).start);
+        m_jsonWriter.value((long long)intervals.at(i).end);
+        intervals.at(i).rssi == RSSI_UNKNOWN ? m_jsonWriter.nullValue() : m_jsonWriter.value(intervals.at(i).rssi);
+        m_jsonWriter.endArray();
+    }
+    m_jsonWriter.endArray();
+    m_jsonWriter.endObject();
+    publish(replyTopic, m_jsonWriter.str());
+}
+
+// writes recorded trace spans to the trace file
+void BluetoothSensor::writeTrace()
+{
+    std::string error;
+    if (!Tracer::writeChromeTrace(m_config.traceFile, error))
+    {
+        printError(error);
+        return;
+    }
+    print("Trace written to " + m_config.traceFile);
+}
+
 // sends hello message using mqtt
 void BluetoothSensor::sendHello()
 {
-    std::string helloTopic = "sensor/" + m_sensorID + "/bluetooth/hello";
-    m_mosquitto->publish(helloTopic.c_str(), "");
-    m_mosquitto->loop();
+    publish(sensorTopic(m_sensorID, "hello"), "");
+
+    // other sensors answer hello with a heartbeat, send ours too so that they learn about us
+    if (!m_config.partitionGroup.empty()) sendHeartbeat();
+}
+
+// tells the other sensors of the group that this one is alive
+void BluetoothSensor::sendHeartbeat()
+{
+    m_lastHeartbeat = time(NULL);
+    publish(sensorTopic(m_sensorID, "heartbeat"), m_config.partitionGroup);
+}
+
+// updates sensor group from hello, heartbeat and goodbye messages of other sensors
+void BluetoothSensor::handleGroupMessage(const mqttMessage& message)
+{
+    if (m_config.partitionGroup.empty()) return;
+
+    // topic is sensor/<id>/bluetooth/<name>
+    const std::string& topic = message.topic;
+    size_t idEnd = topic.find('/', 7);
+    if (idEnd == std::string::npos || topic.compare(idEnd, 11, "/bluetooth/") != 0) return;
+    std::string sensorID = topic.substr(7, idEnd - 7);
+    std::string name = topic.substr(idEnd + 11);
+    if (sensorID == m_sensorID) return;
+
+    if (name == "hello")
+    {
+        // a sensor has (re)started, tell it about us right away
+        sendHeartbeat();
+    }
+    else if (name == "heartbeat" && message.content == m_config.partitionGroup)
+    {
+        if (m_sensorGroup.heartbeat(sensorID, time(NULL)))
+        {
+            print("Sensor " + sensorID + " joined the group");
+            updatePartition();
+        }
+    }
+    else if (name == "heartbeat" || name == "goodbye")
+    {
+        // moved to another group or left
+        if (m_sensorGroup.leave(sensorID))
+        {
+            print("Sensor " + sensorID + " left the group");
+            updatePartition();
+        }
+    }
+}
+
+// logs the devices this sensor probes after the group has changed
+void BluetoothSensor::updatePartition()
+{
+    unsigned int owned = 0;
+    for (unsigned int i = 0; i < m_devices.size(); i++)
+    {
+        if (m_sensorGroup.owns(m_devices.at(i))) owned++;
+    }
+    m_groupSizeGauge->set(m_sensorGroup.size());
+    m_ownedDevicesGauge->set(owned);
+
+    if (m_config.partitionGroup.empty()) return;
+
+    std::stringstream ss;
+    ss << "Sensor group has " << m_sensorGroup.size() << " sensors, probing "
+       << owned << " of " << m_devices.size() << " devices";
+    print(ss.str());
+}
+
+// takes group settings of the current config into use
+void BluetoothSensor::applyGroupConfig()
+{
+    m_sensorGroup.setReplicas(m_config.partitionGroup.empty() ? 0 : std::max(m_config.partitionReplicas, 1));
+    m_sensorGroup.setTimeout(MISSED_HEARTBEATS * std::max(m_config.heartbeatInterval, 1));
+    updatePartition();
+}
+
+// returns topic of a sensor's own messages, e.g. sensor/<id>/bluetooth/hello
+std::string BluetoothSensor::sensorTopic(const std::string& sensorID, const std::string& name)
+{
+    return "sensor/" + sensorID + "/bluetooth/" + name;
 }
 
-void BluetoothSensor::print(std::string str, bool endl)
+void BluetoothSensor::print(std::string str)
 {
-    std::cout << str;
-    endl ? std::cout << std::endl : std::cout << std::flush;
+    Logger::write(LOG_INFO, str);
 }
 
 void BluetoothSensor::printError(std::string str)
 {
-    std::cerr << "ERROR: " << str << std::endl;
+    Logger::write(LOG_ERROR, str);
 }
 
 
@@ -7,6 +7,8 @@
 #define BLUETOOTHSENSOR_H
 
 #include <iostream>
+#include <pthread.h>
+#include <sys/time.h>
 #include <curl/curl.h>
 
 #include "json/json.h"
@@ -14,8 +16,81 @@
 
 #include "mosquittohandler.h"
 #include "datagetter.h"
+#include "jsonwriter.h"
+#include "configwatcher.h"
+#include "metrics.h"
+#include "logger.h"
+#include "tracer.h"
 
 #include "bluetoothpoller.h"
+#include "devicecache.h"
+#include "sensorgroup.h"
+#include "inputlog.h"
+#include "probeselector.h"
+#include "probescheduler.h"
+#include "linkmonitor.h"
+#include "presencehistory.h"
+
+// settings read from the config file
+struct SensorConfig
+{
+    SensorConfig();
+
+    // true if broker connection has to be made again when switching to other config
+    bool brokerDiffers(const SensorConfig& other) const;
+
+    // broker_address may list several brokers, the one answering first is used
+    std::string brokerAddress;
+    uint16_t brokerPort;
+    std::vector<BrokerAddress> brokers;
+    std::string dataFetchUrl;
+    int16_t connectAttemptInterval;
+    std::string deviceCacheFile;
+    int dbRetryInterval;
+    int dbRefreshJitter;
+    std::string deviceDBTopic;
+    int metricsInterval;
+    std::string metricsAddress;
+    uint16_t metricsPort;
+    LogLevel logLevel;
+    int logDeviceInterval;
+    bool tracing;
+    std::string traceFile;
+    bool simulatedRadio;
+    double simulatedPresence;
+    double simulatedLatencyScale;
+
+    // inputs are written to record_file, or read from replay_file instead of the radio and broker
+    std::string recordFile;
+    std::string replayFile;
+    double replaySpeed;
+
+    // sensors in the same group divide the devices between them, empty disables
+    std::string partitionGroup;
+    int partitionReplicas;
+    int heartbeatInterval;
+
+    // strategies each device may be probed with, and how often other ones are tried
+    std::vector<ProbeStrategy> probeStrategies;
+    int probeExploreInterval;
+
+    // share of passes a device is probed on outside its usual arrival and departure hours
+    double probeQuietShare;
+
+    // links kept to present devices, 0 disables, and how often they are checked
+    int linkMonitorMax;
+    int linkRssiInterval;
+
+    // presence intervals are kept in history_file, empty disables
+    std::string historyFile;
+    int historyIntervals;
+
+    // empty when the id is generated from the bluetooth address
+    std::string sensorID;
+};
+
+// reads comma separated strategy names, unknown names are skipped
+void parseProbeStrategies(const std::string& text, std::vector<ProbeStrategy>& strategies);
 
 class BluetoothSensor
 {
@@ -28,12 +103,53 @@ public:
 
 private:
 
-    // gets device info json from server and updates the local device database
-    bool updateDeviceData();
+    // starts fetching device info json from server in the background
+    void startDeviceDataFetch();
+
+    // gets device info json from server. called in a background thread
+    void fetchDeviceData();
+    static void* fetchThreadWrapper(void* obj);
+
+    // updates local device database when background fetch has completed
+    void checkDeviceDataFetch();
+
+    // updates local device database from device info json
+    bool updateDeviceData(const std::string& data);
+
+    // picks bt addresses from device info json array
+    void parseDevices(const Json::Value& list, std::vector<std::string>& devices);
+
+    // replaces local device database with given devices
+    void setDevices(const std::vector<std::string>& devices);
+
+    // applies device database or database delta pushed with mqtt
+    void applyDeviceDatabaseMessage(const mqttMessage& message);
+
+    // reads device database and learned device state from the cache file
+    bool loadDeviceCache();
+
+    // writes device database and learned device state to the cache file
+    void saveDeviceCache();
 
     // scans given device and sends availability status using mqtt
     bool checkDevice(unsigned int deviceIndex);
 
+    // updates state of the device and sends its availability status using mqtt
+    void reportDevice(const std::string& address, bool available, const char* note);
+
+    // keeps reporting a linked device available without probing it
+    void reportLinkedDevice(const std::string& address);
+
+    // reports devices whose links have timed out as gone
+    void checkLinks();
+
+    // follows the adapter going away and coming back, returns false while
+    // it's gone and probe results wouldn't mean anything
+    bool checkAdapter();
+
+    // takes link monitoring settings of the current config into use
+    void applyLinkConfig();
+
     // checks incoming messages if they contain request for database update or device discovery
     void processIncomingMessages(bool& updateDB, bool& scan);
 
@@ -46,23 +162,238 @@ private:
     // sends hello message using mqtt
     void sendHello();
 
-    void print(std::string str, bool endl = true);
+    // tells the other sensors of the group that this one is alive
+    void sendHeartbeat();
+
+    // updates sensor group from hello, heartbeat and goodbye messages of other sensors
+    void handleGroupMessage(const mqttMessage& message);
+
+    // logs the devices this sensor probes after the group has changed
+    void updatePartition();
+
+    // takes group settings of the current config into use
+    void applyGroupConfig();
+
+    // connects broker on startup. called in a background thread
+    void connectBroker();
+    static void* brokerThreadWrapper(void* obj);
+
+    // sends hello and buffered results once the startup broker connection is up
+    void checkBrokerConnection();
+    bool isBrokerReady();
+
+    // connects the broker of a changed config in the background, the current
+    // connection is used until the new one is up
+    void startBrokerSwitch(const SensorConfig& config);
+    void connectSwitchBroker();
+    static void* switchThreadWrapper(void* obj);
+
+    // takes the new broker connection into use once it's up
+    void checkBrokerSwitch();
+
+    // publishes message, or keeps it until the broker is connected
+    void publish(const std::string& topic, const std::string& content);
+
+    // writes queued messages to the broker in one go
+    void flushMessages();
+
+    // creates metrics for the measured code paths
+    void registerMetrics();
+
+    // starts serving metrics over http if a port is configured
+    void startMetricsServer();
+
+    // sends metrics using mqtt
+    void sendMetrics();
+
+    // updates memory and cpu use of the process, at most once a second
+    void updateProcessMetrics();
+
+    // reads config file, missing values are set to defaults
+    bool readConfig(std::string configFileName, SensorConfig& config);
+
+    // rereads config file and applies changed values without interrupting scanning
+    void reloadConfig();
+
+    // returns sensor id used with given config
+    std::string sensorIDFor(const SensorConfig& config);
+
+    // returns topic of a sensor's own messages, e.g. sensor/<id>/bluetooth/hello
+    std::string sensorTopic(const std::string& sensorID, const std::string& name);
+
+    // subscribes command and device database topics
+    void subscribeTopics(MosquittoHandler* mosquitto, const SensorConfig& config);
+
+    // handles trace command: "on" and "off" switch tracing, anything else writes the trace file
+    void handleTraceCommand(const std::string& command);
+
+    // writes recorded trace spans to the trace file
+    void writeTrace();
+
+    // takes logging settings of the current config into use
+    void applyLogConfig();
+
+    // opens the presence history file of the current config
+    void openHistory();
+
+    // answers a query of a device's presence history:
+    // {"id": ..., "device": "<bt address>", "intervals": <max count>, "reply_to": "<topic>"}
+    void handleHistoryCommand(const std::string& command);
+
+    // takes probe strategy settings of the current config into use
+    void applyProbeConfig();
+
+    // waits for signals and acts on them. called in a background thread
+    void handleSignals();
+    static void* signalThreadWrapper(void* obj);
+
+    // stops the main loop and cancels everything it may be waiting for
+    void requestQuit();
+
+    // sends what mosquitto still has queued and disconnects, waits at most timeout ms
+    void flushMosquitto(int timeout);
+
+    void print(std::string str);
     void printError(std::string str);
 
     BluetoothPoller* m_bluetoothPoller;
     DataGetter* m_dataGetter;
     MosquittoHandler* m_mosquitto;
 
+    // capture of inputs being written, and one being replayed
+    InputRecorder m_recorder;
+    InputReplay* m_replay;
+
+    // reused for all outgoing json messages
+    JsonWriter m_jsonWriter;
+
     std::string m_sensorID;
+    std::string m_btAddress;
 
     std::vector<std::string> m_devices;
+    DeviceStateMap m_deviceStates;
+    DeviceCache m_deviceCache;
 
-    std::string m_brokerAddress;
-    uint16_t m_brokerPort;
-    std::string m_dataFetchUrl;
-    int16_t m_connectAttemptInterval;
+    std::string m_configFileName;
+    SensorConfig m_config;
+    ConfigWatcher m_configWatcher;
 
+    // version of the current device database, -1 when unknown
+    int m_dbVersion;
     bool m_updateDBNeeded;
+    time_t m_nextDBUpdate;
+    time_t m_lastCacheSave;
+
+    // broker change from config file is retried until it succeeds
+    bool m_configRetryNeeded;
+    time_t m_nextConfigRetry;
+
+    // startup broker connection, state is shared with the connecting thread
+    pthread_t m_brokerThread;
+    volatile int m_brokerState;
+    bool m_brokerThreadStarted;
+    bool m_brokerReady;
+    std::vector<mqttMessage> m_pendingMessages;
+
+    // broker change from config file. the new connection and its config
+    // belong to the connecting thread until it's done
+    pthread_t m_switchThread;
+    volatile int m_switchState;
+    bool m_switchThreadStarted;
+    bool m_switchSucceeded;
+    MosquittoHandler* m_switchMosquitto;
+    SensorConfig m_switchConfig;
+
+    // device database fetch, state is shared with the fetching thread
+    pthread_t m_fetchThread;
+    volatile int m_fetchState;
+    bool m_fetchThreadStarted;
+    std::string m_fetchUrl;
+    std::string m_fetchedData;
+    std::string m_fetchError;
+    bool m_fetchSucceeded;
+
+    // signals are read from a signalfd in a thread of their own instead of
+    // being handled in whatever code happens to run when they arrive
+    int m_signalFd;
+    pthread_t m_signalThread;
+    bool m_signalThreadStarted;
+    volatile bool m_stopSignalThread;
+
+    // for measuring how long it takes from start to the first presence result
+    timeval m_startTime;
+    long m_firstResultMs;
+
+    MetricsRegistry m_metrics;
+    MetricsServer m_metricsServer;
+    time_t m_lastMetricsSent;
+
+    // resources used by the process, slow growth shows up in long runs
+    Gauge* m_residentMemoryGauge;
+    Counter* m_cpuTime;
+    Gauge* m_arrivedMessagesGauge;
+    time_t m_lastProcessMetrics;
+    uint64_t m_cpuMicroseconds;
+
+    Histogram* m_probeDuration;
+    Histogram* m_scanCycleDuration;
+    Histogram* m_publishDuration;
+    Histogram* m_flushDuration;
+    Histogram* m_dbFetchDuration;
+    Histogram* m_discoveryDuration;
+    Counter* m_probes;
+    Counter* m_probesAvailable;
+    Counter* m_published;
+    Counter* m_publishFailures;
+    Counter* m_publishedBytes;
+    Counter* m_flushes;
+    Counter* m_received;
+    Counter* m_dbFetchFailures;
+    Counter* m_discoveredDevices;
+    Counter* m_hciEvents;
+    Counter* m_hciReads;
+    Gauge* m_devicesGauge;
+    Gauge* m_pendingMessagesGauge;
+    Gauge* m_droppedLogLinesGauge;
+    Gauge* m_firstResultGauge;
+
+    // other sensors probing the same devices
+    SensorGroup m_sensorGroup;
+    time_t m_lastHeartbeat;
+    Gauge* m_groupSizeGauge;
+    Gauge* m_ownedDevicesGauge;
+
+    // strategy used for probing each device, learned from the results
+    ProbeSelector m_probeSelector;
+    Counter* m_strategyProbes[PROBE_STRATEGY_COUNT];
+    Histogram* m_strategyDuration[PROBE_STRATEGY_COUNT];
+    Gauge* m_strategyDevices[PROBE_STRATEGY_COUNT];
+    Counter* m_probeMisses;
+
+    // devices are probed more often around the hours they usually come and go
+    ProbeScheduler m_probeScheduler;
+    Counter* m_probesDeferred;
+
+    // present devices followed through a link instead of probes
+    LinkMonitor m_linkMonitor;
+    std::map<std::string, time_t> m_nextLinkAttempt;
+    Counter* m_linkDepartures;
+    Counter* m_linksLost;
+    Gauge* m_linkedDevicesGauge;
+
+    // when devices have been seen, queried with the history command
+    PresenceHistory m_history;
+    Gauge* m_historyIntervalsGauge;
+    Counter* m_historyQueries;
+    Histogram* m_historyQueryDuration;
+
+    // results aren't reported while the adapter has failed
+    bool m_adapterUp;
+    Gauge* m_adapterUpGauge;
+    Counter* m_adapterRecoveries;
+
+    // limits how often unchanged device results are logged
+    LogRateLimiter m_deviceLogLimiter;
 };
 
 #endif // BLUETOOTHSENSOR_H
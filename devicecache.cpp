@@ -0,0 +1,171 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "devicecache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// snapshot file layout: header followed by deviceCount fixed size records.
+// all fields are in host byte order, the file is not meant to be moved between machines.
+// version 2 added the weekly profile to the end of the record, version 1 files are still read
+const char SNAPSHOT_MAGIC[4] = {'B', 'T', 'D', 'B'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_VERSION_1_RECORD_SIZE = 40;
+
+struct SnapshotHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t deviceCount;
+    int64_t savedAt;
+} __attribute__((packed));
+
+struct SnapshotRecord
+{
+    char address[18];   // null terminated bt address
+    uint8_t available;
+    uint8_t reserved[5];
+    int64_t lastSeen;
+    int64_t lastChecked;
+    uint8_t transitions[WEEK_HOURS];
+} __attribute__((packed));
+
+DeviceCache::DeviceCache()
+{
+
+}
+
+DeviceCache::~DeviceCache()
+{
+
+}
+
+bool DeviceCache::load(std::string fileName, std::vector<std::string>& devices, DeviceStateMap& states)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        m_lastErrorString = "Cannot open device cache " + fileName;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SnapshotHeader))
+    {
+        close(fd);
+        m_lastErrorString = "Device cache is truncated";
+        return false;
+    }
+
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        m_lastErrorString = "Cannot map device cache";
+        return false;
+    }
+
+    const SnapshotHeader* header = (const SnapshotHeader*)map;
+    const char* records = (const char*)map + sizeof(SnapshotHeader);
+
+    bool current = header->version == SNAPSHOT_VERSION && header->recordSize == sizeof(SnapshotRecord);
+    bool version1 = header->version == 1 && header->recordSize == SNAPSHOT_VERSION_1_RECORD_SIZE;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || (!current && !version1))
+    {
+        munmap(map, st.st_size);
+        m_lastErrorString = "Device cache has unknown format";
+        return false;
+    }
+    if ((off_t)(sizeof(SnapshotHeader) + (uint64_t)header->deviceCount * header->recordSize) > st.st_size)
+    {
+        munmap(map, st.st_size);
+        m_lastErrorString = "Device cache is truncated";
+        return false;
+    }
+
+    devices.clear();
+    devices.reserve(header->deviceCount);
+    for (uint32_t i = 0; i < header->deviceCount; i++)
+    {
+        // old records are a prefix of the current one
+        const SnapshotRecord& record = *(const SnapshotRecord*)(records + (uint64_t)i * header->recordSize);
+        std::string address(record.address, strnlen(record.address, sizeof(record.address)));
+        devices.push_back(address);
+
+        DeviceState& state = states[address];
+        state.lastSeen = record.lastSeen;
+        state.lastChecked = record.lastChecked;
+        state.available = record.available != 0;
+        if (current) memcpy(state.transitions, record.transitions, sizeof(state.transitions));
+    }
+
+    munmap(map, st.st_size);
+
+    m_lastErrorString = "";
+    return true;
+}
+
+bool DeviceCache::save(std::string fileName, const std::vector<std::string>& devices, const DeviceStateMap& states)
+{
+    // write to a temporary file first so that a power cut can't leave a half written cache
+    std::string tmpFileName = fileName + ".tmp";
+    FILE* file = fopen(tmpFileName.c_str(), "wb");
+    if (!file)
+    {
+        m_lastErrorString = "Cannot write device cache " + tmpFileName;
+        return false;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.recordSize = sizeof(SnapshotRecord);
+    header.deviceCount = devices.size();
+    header.savedAt = time(NULL);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    for (unsigned int i = 0; ok && i < devices.size(); i++)
+    {
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record));
+        strncpy(record.address, devices.at(i).c_str(), sizeof(record.address) - 1);
+
+        DeviceStateMap::const_iterator it = states.find(devices.at(i));
+        if (it != states.end())
+        {
+            record.available = it->second.available ? 1 : 0;
+            record.lastSeen = it->second.lastSeen;
+            record.lastChecked = it->second.lastChecked;
+            memcpy(record.transitions, it->second.transitions, sizeof(record.transitions));
+        }
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+
+    ok = fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmpFileName.c_str(), fileName.c_str()) != 0)
+    {
+        unlink(tmpFileName.c_str());
+        m_lastErrorString = "Cannot write device cache " + fileName;
+        return false;
+    }
+
+    m_lastErrorString = "";
+    return true;
+}
+
+std::string DeviceCache::getLastErrorString()
+{
+    return m_lastErrorString;
+}
@@ -0,0 +1,56 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef DEVICECACHE_H
+#define DEVICECACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// hours in a week, the weekly profile has one slot for each
+const unsigned int WEEK_HOURS = 168;
+
+// state the sensor has learned about a single device
+struct DeviceState
+{
+    DeviceState() : lastSeen(0), lastChecked(0), available(false) { memset(transitions, 0, sizeof(transitions)); }
+
+    time_t lastSeen;     // last time the device answered a probe
+    time_t lastChecked;  // last time the device was probed
+    bool available;      // result of the latest probe
+
+    // arrivals and departures seen in each hour of the week in local time,
+    // sunday midnight first. all are halved when one would overflow
+    uint8_t transitions[WEEK_HOURS];
+};
+
+typedef std::map<std::string, DeviceState> DeviceStateMap;
+
+// keeps the last good device database and learned device state in a
+// versioned binary snapshot file, so that scanning can start right after
+// boot without waiting for the device data server
+class DeviceCache
+{
+public:
+    DeviceCache();
+    ~DeviceCache();
+
+    // maps the snapshot file and reads devices and their states from it
+    bool load(std::string fileName, std::vector<std::string>& devices, DeviceStateMap& states);
+
+    // writes devices and their states to the snapshot file. file is replaced atomically
+    bool save(std::string fileName, const std::vector<std::string>& devices, const DeviceStateMap& states);
+
+    std::string getLastErrorString();
+
+private:
+    std::string m_lastErrorString;
+};
+
+#endif // DEVICECACHE_H
@@ -0,0 +1,188 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "hcieventreader.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <algorithm>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+// slots in the ring, and how many of them one read may fill
+const unsigned int RING_SIZE = 256;
+const unsigned int BATCH_SIZE = 64;
+
+// packet type byte followed by the largest event
+const unsigned int SLOT_SIZE = 1 + HCI_MAX_EVENT_SIZE;
+
+HciEventReader::HciEventReader() :
+    m_socket(-1), m_head(0), m_batched(true), m_events(0), m_reads(0)
+{
+    memset(m_handlers, 0, sizeof(m_handlers));
+
+    m_ring = new uint8_t[RING_SIZE * SLOT_SIZE];
+    m_messages = new mmsghdr[RING_SIZE];
+    m_vectors = new iovec[RING_SIZE];
+    memset(m_messages, 0, RING_SIZE * sizeof(mmsghdr));
+    for (unsigned int i = 0; i < RING_SIZE; i++)
+    {
+        m_vectors[i].iov_base = m_ring + i * SLOT_SIZE;
+        m_vectors[i].iov_len = SLOT_SIZE;
+        m_messages[i].msg_hdr.msg_iov = &m_vectors[i];
+        m_messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+HciEventReader::~HciEventReader()
+{
+    close();
+    delete[] m_vectors;
+    delete[] m_messages;
+    delete[] m_ring;
+}
+
+bool HciEventReader::open(int devId)
+{
+    close();
+
+    m_socket = hci_open_dev(devId);
+    if (devId < 0 || m_socket < 0)
+    {
+        close();
+        m_lastErrorString = "Cannot open bluetooth socket for events";
+        return false;
+    }
+    fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL, 0) | O_NONBLOCK);
+
+    if (!applyFilter())
+    {
+        close();
+        return false;
+    }
+
+    m_lastErrorString = "";
+    return true;
+}
+
+void HciEventReader::close()
+{
+    if (m_socket < 0) return;
+    ::close(m_socket);
+    m_socket = -1;
+}
+
+bool HciEventReader::isOpen() const
+{
+    return m_socket >= 0;
+}
+
+bool HciEventReader::setHandler(uint8_t event, HciEventHandler handler, void* obj)
+{
+    m_handlers[event].function = handler;
+    m_handlers[event].obj = obj;
+    return m_socket < 0 || applyFilter();
+}
+
+bool HciEventReader::dispatch(int timeout)
+{
+    if (m_socket < 0) return false;
+
+    if (timeout > 0)
+    {
+        pollfd fd;
+        fd.fd = m_socket;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        int res = poll(&fd, 1, timeout);
+        if (res < 0) return errno == EINTR;
+        if (res == 0) return true;
+    }
+
+    // read until the socket is drained, a batch can't go past the end of the ring
+    while (true)
+    {
+        unsigned int count = std::min(BATCH_SIZE, RING_SIZE - m_head);
+        int received;
+        if (m_batched)
+        {
+            received = recvmmsg(m_socket, &m_messages[m_head], count, MSG_DONTWAIT, NULL);
+            if (received < 0 && errno == ENOSYS)
+            {
+                m_batched = false;
+                continue;
+            }
+        }
+        else
+        {
+            ssize_t size = read(m_socket, m_vectors[m_head].iov_base, SLOT_SIZE);
+            received = size < 0 ? -1 : 1;
+            if (size >= 0) m_messages[m_head].msg_len = size;
+        }
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+            m_lastErrorString = "Cannot read bluetooth events";
+            return false;
+        }
+        m_reads++;
+
+        for (int i = 0; i < received; i++)
+        {
+            const uint8_t* packet = m_ring + (m_head + i) * SLOT_SIZE;
+            unsigned int size = m_messages[m_head + i].msg_len;
+            if (size < 1 + HCI_EVENT_HDR_SIZE || packet[0] != HCI_EVENT_PKT) continue;
+
+            const hci_event_hdr* header = (const hci_event_hdr*)(packet + 1);
+            if (header->plen > size - 1 - HCI_EVENT_HDR_SIZE) continue;
+
+            const Handler& handler = m_handlers[header->evt];
+            if (!handler.function) continue;
+
+            m_events++;
+            handler.function(handler.obj, header->evt, packet + 1 + HCI_EVENT_HDR_SIZE, header->plen);
+        }
+        m_head = (m_head + received) % RING_SIZE;
+
+        // a short batch means the socket is empty, single reads go on until EAGAIN
+        if (m_batched && (unsigned int)received < count) return true;
+    }
+}
+
+void HciEventReader::takeStats(uint64_t& events, uint64_t& reads)
+{
+    events = m_events;
+    reads = m_reads;
+    m_events = 0;
+    m_reads = 0;
+}
+
+std::string HciEventReader::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+bool HciEventReader::applyFilter()
+{
+    hci_filter filter;
+    hci_filter_clear(&filter);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+    for (int i = 0; i < 256; i++)
+    {
+        if (m_handlers[i].function) hci_filter_set_event(i, &filter);
+    }
+
+    if (setsockopt(m_socket, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0)
+    {
+        m_lastErrorString = "Cannot set hci event filter";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef HCIEVENTREADER_H
+#define HCIEVENTREADER_H
+
+#include <string>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// handles one event, data points to the event parameters
+typedef void (*HciEventHandler)(void* obj, uint8_t event, const uint8_t* data, uint8_t size);
+
+// reads events of the adapter from a raw hci socket without blocking. the
+// kernel filter of the socket lets through only the events that have a
+// handler, and the events are read in batches with recvmmsg into a ring of
+// preallocated buffers, so a burst of inquiry results takes a few system
+// calls instead of one per event
+class HciEventReader
+{
+public:
+    HciEventReader();
+    ~HciEventReader();
+
+    // opens socket of the adapter, handlers may be set before or after
+    bool open(int devId);
+    void close();
+    bool isOpen() const;
+
+    // calls handler with obj for each event of the type, 0 removes the
+    // handler. the socket filter is updated to match
+    bool setHandler(uint8_t event, HciEventHandler handler, void* obj);
+
+    // reads and dispatches the events that have arrived, waits at most
+    // timeout ms for the first one. returns false on socket error
+    bool dispatch(int timeout);
+
+    // returns events dispatched and read calls made since the previous call
+    void takeStats(uint64_t& events, uint64_t& reads);
+
+    std::string getLastErrorString();
+
+private:
+    struct Handler
+    {
+        HciEventHandler function;
+        void* obj;
+    };
+
+    // sets the kernel filter to the events having a handler
+    bool applyFilter();
+
+    int m_socket;
+    Handler m_handlers[256];
+
+    // events are received into the slots following m_head, the older ones
+    // stay readable until the ring comes around
+    uint8_t* m_ring;
+    mmsghdr* m_messages;
+    iovec* m_vectors;
+    unsigned int m_head;
+
+    // recvmmsg isn't available on old kernels, events are then read one by one
+    bool m_batched;
+
+    uint64_t m_events;
+    uint64_t m_reads;
+
+    std::string m_lastErrorString;
+};
+
+#endif // HCIEVENTREADER_H
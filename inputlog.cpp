@@ -0,0 +1,412 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "inputlog.h"
+#include "macaddress.h"
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+static const char INPUT_LOG_MAGIC[4] = {'B', 'T', 'R', 'L'};
+static const uint32_t INPUT_LOG_VERSION = 1;
+static const size_t HEADER_SIZE = 4 + 4 + 18 + 8;
+static const size_t RECORD_HEADER_SIZE = 1 + 8 + 4;
+
+template <typename T>
+static void append(std::string& out, T value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void appendAddress(std::string& out, const std::string& btAddress)
+{
+    uint64_t address = 0;
+    parseMacAddress(btAddress, address);
+    for (int i = 5; i >= 0; i--) out.push_back((char)((address >> (i * 8)) & 0xff));
+}
+
+// reads values from a loaded log, fails instead of reading past the end
+class LogReader
+{
+public:
+    LogReader(const char* data, size_t size) : m_data(data), m_size(size), m_pos(0) {}
+
+    template <typename T>
+    bool read(T& value)
+    {
+        if (m_size - m_pos < sizeof(value)) return false;
+        memcpy(&value, m_data + m_pos, sizeof(value));
+        m_pos += sizeof(value);
+        return true;
+    }
+
+    bool readString(size_t length, std::string& value)
+    {
+        if (m_size - m_pos < length) return false;
+        value.assign(m_data + m_pos, length);
+        m_pos += length;
+        return true;
+    }
+
+    bool readAddress(std::string& btAddress)
+    {
+        if (m_size - m_pos < 6) return false;
+        uint64_t address = 0;
+        for (int i = 0; i < 6; i++) address = (address << 8) | (uint8_t)m_data[m_pos + i];
+        m_pos += 6;
+        btAddress = formatMacAddress(address);
+        return true;
+    }
+
+    bool atEnd() { return m_pos >= m_size; }
+
+private:
+    const char* m_data;
+    size_t m_size;
+    size_t m_pos;
+};
+
+InputRecorder::InputRecorder() :
+    m_file(0), m_start(0)
+{
+}
+
+InputRecorder::~InputRecorder()
+{
+    close();
+}
+
+bool InputRecorder::open(std::string fileName, const std::string& adapterAddress)
+{
+    close();
+
+    m_file = fopen(fileName.c_str(), "wb");
+    if (!m_file)
+    {
+        m_lastErrorString = "Cannot create input log " + fileName;
+        return false;
+    }
+
+    std::string header(INPUT_LOG_MAGIC, 4);
+    append(header, INPUT_LOG_VERSION);
+    char address[18] = {0};
+    strncpy(address, adapterAddress.c_str(), sizeof(address) - 1);
+    header.append(address, sizeof(address));
+    append(header, (int64_t)time(NULL));
+    fwrite(header.data(), 1, header.size(), m_file);
+
+    m_start = monotonicMicroseconds();
+    m_lastErrorString = "";
+    return true;
+}
+
+void InputRecorder::close()
+{
+    if (!m_file) return;
+    fclose(m_file);
+    m_file = 0;
+}
+
+void InputRecorder::recordProbe(const std::string& btAddress, bool available, uint32_t latency)
+{
+    if (!m_file) return;
+    m_payload.clear();
+    appendAddress(m_payload, btAddress);
+    append(m_payload, (uint8_t)available);
+    append(m_payload, latency);
+    writeRecord(INPUT_PROBE);
+}
+
+void InputRecorder::recordInquiry(bool ok, const std::vector<DiscoveredDevice>& devices, uint32_t latency)
+{
+    if (!m_file) return;
+    m_payload.clear();
+    append(m_payload, (uint8_t)ok);
+    append(m_payload, latency);
+    append(m_payload, (uint16_t)devices.size());
+    for (unsigned int i = 0; i < devices.size(); i++)
+    {
+        appendAddress(m_payload, devices.at(i).btAddress);
+        std::string name = devices.at(i).name.substr(0, 255);
+        append(m_payload, (uint8_t)name.size());
+        m_payload.append(name);
+    }
+    writeRecord(INPUT_INQUIRY);
+}
+
+void InputRecorder::recordMessage(const mqttMessage& message)
+{
+    if (!m_file) return;
+    m_payload.clear();
+    std::string topic = message.topic.substr(0, 0xffff);
+    append(m_payload, (uint16_t)topic.size());
+    m_payload.append(topic);
+    append(m_payload, (uint32_t)message.content.size());
+    m_payload.append(message.content);
+    writeRecord(INPUT_MESSAGE);
+}
+
+void InputRecorder::recordFetch(bool ok, const std::string& data)
+{
+    if (!m_file) return;
+    m_payload.clear();
+    append(m_payload, (uint8_t)ok);
+    append(m_payload, (uint32_t)data.size());
+    m_payload.append(data);
+    writeRecord(INPUT_DB_FETCH);
+}
+
+std::string InputRecorder::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+void InputRecorder::writeRecord(uint8_t type)
+{
+    std::string header;
+    append(header, type);
+    append(header, monotonicMicroseconds() - m_start);
+    append(header, (uint32_t)m_payload.size());
+
+    // records are rare compared to their cost of getting, flush each so that
+    // a crash leaves a usable log behind
+    fwrite(header.data(), 1, header.size(), m_file);
+    fwrite(m_payload.data(), 1, m_payload.size(), m_file);
+    fflush(m_file);
+}
+
+InputReplay::InputReplay() :
+    m_speed(1.0), m_cancelled(false), m_start(0), m_virtualTime(0), m_probesLeft(0), m_nextMessage(0)
+{
+}
+
+bool InputReplay::load(std::string fileName, double speed)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if (!file)
+    {
+        m_lastErrorString = "Cannot open input log " + fileName;
+        return false;
+    }
+    std::string data;
+    char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) data.append(buffer, count);
+    fclose(file);
+
+    if (data.size() < HEADER_SIZE || memcmp(data.data(), INPUT_LOG_MAGIC, 4) != 0)
+    {
+        m_lastErrorString = "Not an input log: " + fileName;
+        return false;
+    }
+    uint32_t version;
+    memcpy(&version, data.data() + 4, sizeof(version));
+    if (version != INPUT_LOG_VERSION)
+    {
+        m_lastErrorString = "Unsupported input log version in " + fileName;
+        return false;
+    }
+    m_adapterAddress.assign(data.data() + 8, strnlen(data.data() + 8, 18));
+
+    LogReader reader(data.data() + HEADER_SIZE, data.size() - HEADER_SIZE);
+    while (!reader.atEnd())
+    {
+        uint8_t type;
+        uint64_t time;
+        uint32_t size;
+        std::string payload;
+
+        // a log cut short by a crash is used up to its last whole record
+        if (!reader.read(type) || !reader.read(time) || !reader.read(size) || !reader.readString(size, payload)) break;
+
+        LogReader record(payload.data(), payload.size());
+        bool ok = true;
+        if (type == INPUT_PROBE)
+        {
+            std::string address;
+            uint8_t available;
+            Probe probe;
+            probe.time = time;
+            ok = record.readAddress(address) && record.read(available) && record.read(probe.latency);
+            probe.available = available != 0;
+            if (ok)
+            {
+                m_probes[address].push_back(probe);
+                m_probesLeft++;
+            }
+        }
+        else if (type == INPUT_INQUIRY)
+        {
+            Inquiry inquiry;
+            inquiry.time = time;
+            uint8_t inquiryOk;
+            uint16_t devices;
+            ok = record.read(inquiryOk) && record.read(inquiry.latency) && record.read(devices);
+            inquiry.ok = inquiryOk != 0;
+            for (uint16_t i = 0; ok && i < devices; i++)
+            {
+                DiscoveredDevice device;
+                uint8_t nameSize;
+                ok = record.readAddress(device.btAddress) && record.read(nameSize) && record.readString(nameSize, device.name);
+                inquiry.devices.push_back(device);
+            }
+            if (ok) m_inquiries.push_back(inquiry);
+        }
+        else if (type == INPUT_MESSAGE)
+        {
+            Message message;
+            message.time = time;
+            uint16_t topicSize;
+            uint32_t contentSize;
+            ok = record.read(topicSize) && record.readString(topicSize, message.message.topic) &&
+                 record.read(contentSize) && record.readString(contentSize, message.message.content);
+            if (ok) m_messages.push_back(message);
+        }
+        else if (type == INPUT_DB_FETCH)
+        {
+            Fetch fetch;
+            uint8_t fetchOk;
+            uint32_t dataSize;
+            ok = record.read(fetchOk) && record.read(dataSize) && record.readString(dataSize, fetch.data);
+            fetch.ok = fetchOk != 0;
+            if (ok) m_fetches.push_back(fetch);
+        }
+
+        // unknown record types are skipped, malformed ones end the log
+        if (!ok) break;
+    }
+
+    m_speed = speed;
+    m_start = monotonicMicroseconds();
+    m_virtualTime = 0;
+    m_nextMessage = 0;
+    m_lastErrorString = "";
+    return true;
+}
+
+std::string InputReplay::adapterAddress()
+{
+    return m_adapterAddress;
+}
+
+bool InputReplay::hasProbe(const std::string& btAddress)
+{
+    std::map<std::string, std::deque<Probe> >::iterator it = m_probes.find(btAddress);
+    return it != m_probes.end() && !it->second.empty();
+}
+
+bool InputReplay::scanDevice(const std::string& btAddress)
+{
+    std::map<std::string, std::deque<Probe> >::iterator it = m_probes.find(btAddress);
+    if (it == m_probes.end() || it->second.empty())
+    {
+        // device wasn't probed at this point of the capture
+        idle();
+        return false;
+    }
+
+    Probe probe = it->second.front();
+    it->second.pop_front();
+    m_probesLeft--;
+
+    wait(probe.latency);
+    advance(probe.time);
+    return probe.available;
+}
+
+bool InputReplay::discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices)
+{
+    discoveredDevices.clear();
+    if (m_inquiries.empty())
+    {
+        m_lastErrorString = "No more recorded inquiries";
+        return false;
+    }
+
+    Inquiry inquiry = m_inquiries.front();
+    m_inquiries.pop_front();
+
+    wait(inquiry.latency);
+    advance(inquiry.time);
+    if (!inquiry.ok)
+    {
+        m_lastErrorString = "hci_inquiry error";
+        return false;
+    }
+    discoveredDevices = inquiry.devices;
+    m_lastErrorString = "";
+    return true;
+}
+
+void InputReplay::takeMessages(std::vector<mqttMessage>& messages)
+{
+    messages.clear();
+    uint64_t now = clock();
+    while (m_nextMessage < m_messages.size() && m_messages[m_nextMessage].time <= now)
+    {
+        messages.push_back(m_messages[m_nextMessage].message);
+        m_nextMessage++;
+    }
+}
+
+bool InputReplay::takeFetch(bool& ok, std::string& data)
+{
+    if (m_fetches.empty()) return false;
+    ok = m_fetches.front().ok;
+    data = m_fetches.front().data;
+    m_fetches.pop_front();
+    return true;
+}
+
+void InputReplay::idle()
+{
+    if (m_speed > 0 || m_nextMessage >= m_messages.size()) return;
+
+    // nothing to wait for when replaying as fast as possible, jump to the next message
+    advance(m_messages[m_nextMessage].time);
+}
+
+bool InputReplay::finished()
+{
+    return m_probesLeft == 0 && m_nextMessage >= m_messages.size();
+}
+
+void InputReplay::cancel()
+{
+    m_cancelled = true;
+}
+
+std::string InputReplay::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+uint64_t InputReplay::clock()
+{
+    if (m_speed <= 0) return m_virtualTime;
+    return (uint64_t)((monotonicMicroseconds() - m_start) * m_speed);
+}
+
+void InputReplay::advance(uint64_t time)
+{
+    if (time > m_virtualTime) m_virtualTime = time;
+}
+
+void InputReplay::wait(uint32_t latency)
+{
+    if (m_speed <= 0) return;
+
+    // wait in short steps so that cancel doesn't have to wait for a whole page timeout
+    useconds_t left = (useconds_t)(latency / m_speed);
+    while (left > 0 && !m_cancelled)
+    {
+        useconds_t step = std::min<useconds_t>(left, 10000);
+        usleep(step);
+        left -= step;
+    }
+}
@@ -0,0 +1,151 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mosquittohandler.h"
+#include "bluetoothpoller.h"
+
+// input log file layout, integers in host byte order:
+//   header: "BTRL", uint32 version, char adapter address[18], int64 start time (unix)
+//   record: uint8 type, uint64 time since start (usec), uint32 payload size, payload
+// payloads:
+//   probe:    uint8 address[6], uint8 available, uint32 latency (usec)
+//   inquiry:  uint8 ok, uint32 latency (usec), uint16 count, count * (uint8 address[6], uint8 name size, name)
+//   message:  uint16 topic size, topic, uint32 content size, content
+//   db fetch: uint8 ok, uint32 size, body or error text
+enum InputRecordType
+{
+    INPUT_PROBE = 1,
+    INPUT_INQUIRY,
+    INPUT_MESSAGE,
+    INPUT_DB_FETCH
+};
+
+// writes everything the sensor gets from the outside world to a compact
+// binary log, so that a field capture can be replayed elsewhere
+class InputRecorder
+{
+public:
+    InputRecorder();
+    ~InputRecorder();
+
+    bool open(std::string fileName, const std::string& adapterAddress);
+    void close();
+
+    void recordProbe(const std::string& btAddress, bool available, uint32_t latency);
+    void recordInquiry(bool ok, const std::vector<DiscoveredDevice>& devices, uint32_t latency);
+    void recordMessage(const mqttMessage& message);
+    void recordFetch(bool ok, const std::string& data);
+
+    std::string getLastErrorString();
+
+private:
+    void writeRecord(uint8_t type);
+
+    FILE* m_file;
+    uint64_t m_start;
+
+    // payload of the record being written
+    std::string m_payload;
+
+    std::string m_lastErrorString;
+};
+
+// feeds a recorded input log back to the sensor in real time, faster, or as
+// fast as possible. probe results are handed out per device in recorded
+// order, messages when the replay clock reaches their time
+class InputReplay
+{
+public:
+    InputReplay();
+
+    // speed 1 replays in real time, 0 without any waiting
+    bool load(std::string fileName, double speed);
+
+    std::string adapterAddress();
+
+    // true if a recorded probe of the device is left, scanDevice tells
+    // nothing about the device otherwise
+    bool hasProbe(const std::string& btAddress);
+
+    bool scanDevice(const std::string& btAddress);
+    bool discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices);
+
+    // moves messages whose time has come to messages
+    void takeMessages(std::vector<mqttMessage>& messages);
+
+    // returns next recorded database fetch, false if there are no more
+    bool takeFetch(bool& ok, std::string& data);
+
+    // called when the sensor has nothing to do, lets replay without waiting move on
+    void idle();
+
+    // true when all probes and messages have been replayed
+    bool finished();
+
+    // ends waiting for a replayed result, may be called from another thread
+    void cancel();
+
+    std::string getLastErrorString();
+
+private:
+    struct Probe
+    {
+        uint64_t time;
+        uint32_t latency;
+        bool available;
+    };
+
+    struct Inquiry
+    {
+        uint64_t time;
+        uint32_t latency;
+        bool ok;
+        std::vector<DiscoveredDevice> devices;
+    };
+
+    struct Message
+    {
+        uint64_t time;
+        mqttMessage message;
+    };
+
+    struct Fetch
+    {
+        bool ok;
+        std::string data;
+    };
+
+    // replay time in usec since start of the log
+    uint64_t clock();
+    void advance(uint64_t time);
+    void wait(uint32_t latency);
+
+    double m_speed;
+    volatile bool m_cancelled;
+    uint64_t m_start;
+    uint64_t m_virtualTime;
+    std::string m_adapterAddress;
+
+    std::map<std::string, std::deque<Probe> > m_probes;
+    unsigned int m_probesLeft;
+    std::deque<Inquiry> m_inquiries;
+    std::vector<Message> m_messages;
+    unsigned int m_nextMessage;
+    std::deque<Fetch> m_fetches;
+
+    std::string m_lastErrorString;
+};
+
+#endif // INPUTLOG_H
@@ -0,0 +1,371 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "linkmonitor.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+#include <bluetooth/l2cap.h>
+
+// psm of the sdp server, which every device listens to
+const uint16_t SDP_PSM = 1;
+
+// how long to wait for the l2cap connection, in ms. the device has just
+// answered a probe, so it's paged quickly
+const int LINK_CONNECT_TIMEOUT = 1500;
+
+// timeout of hci commands, in ms
+const int COMMAND_TIMEOUT = 1000;
+
+// link times out when the device hasn't been heard for this long, in 0.625 ms
+// slots (2 s). the default is 20 s
+const uint16_t SUPERVISION_TIMEOUT = 0x0c80;
+
+// sniff interval of idle links, in 0.625 ms slots (0.5 - 1 s)
+const uint16_t SNIFF_MIN_INTERVAL = 0x0320;
+const uint16_t SNIFF_MAX_INTERVAL = 0x0640;
+
+const int DEFAULT_RSSI_INTERVAL = 10;
+
+// connecting checks this often if the monitor has been cancelled, in ms
+const int CANCEL_CHECK_INTERVAL = 100;
+
+LinkMonitor::LinkMonitor() :
+    m_devId(-1), m_maxLinks(0), m_rssiInterval(DEFAULT_RSSI_INTERVAL), m_lastRssiRead(0),
+    m_cancelled(false), m_commandSocket(-1)
+{
+    m_events.setHandler(EVT_DISCONN_COMPLETE, LinkMonitor::disconnectionWrapper, this);
+}
+
+LinkMonitor::~LinkMonitor()
+{
+    shutdown();
+}
+
+bool LinkMonitor::init(int devId, unsigned int maxLinks)
+{
+    shutdown();
+
+    // only disconnections are of interest, and they are read without blocking
+    m_commandSocket = hci_open_dev(devId);
+    if (devId < 0 || m_commandSocket < 0 || !m_events.open(devId))
+    {
+        shutdown();
+        m_lastErrorString = "Cannot open bluetooth socket for link monitoring";
+        return false;
+    }
+
+    m_devId = devId;
+    m_maxLinks = maxLinks;
+    m_lastErrorString = "";
+    return true;
+}
+
+void LinkMonitor::shutdown()
+{
+    std::map<std::string, Link>::iterator it;
+    for (it = m_links.begin(); it != m_links.end(); ++it) closeLink(it->second);
+    m_links.clear();
+    m_departed.clear();
+    m_lost.clear();
+
+    m_events.close();
+    if (m_commandSocket >= 0)
+    {
+        close(m_commandSocket);
+        m_commandSocket = -1;
+    }
+    m_devId = -1;
+}
+
+void LinkMonitor::setMaxLinks(unsigned int maxLinks)
+{
+    m_maxLinks = maxLinks;
+
+    // drop the extra links, their devices are probed again
+    while (m_links.size() > m_maxLinks)
+    {
+        closeLink(m_links.begin()->second);
+        m_links.erase(m_links.begin());
+    }
+}
+
+void LinkMonitor::setRssiInterval(int interval)
+{
+    m_rssiInterval = interval;
+}
+
+void LinkMonitor::cancel()
+{
+    m_cancelled = true;
+}
+
+bool LinkMonitor::isEnabled() const
+{
+    return m_devId >= 0 && m_maxLinks > 0;
+}
+
+bool LinkMonitor::hasRoom() const
+{
+    return isEnabled() && m_links.size() < m_maxLinks;
+}
+
+bool LinkMonitor::link(const std::string& btAddress)
+{
+    if (!hasRoom() || isLinked(btAddress) || m_cancelled) return false;
+
+    // events of earlier connections must be out of the way before the new handle is known
+    readEvents();
+
+    int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+    if (sock < 0)
+    {
+        m_lastErrorString = "Cannot open l2cap socket";
+        return false;
+    }
+
+    sockaddr_l2 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.l2_family = AF_BLUETOOTH;
+    addr.l2_psm = htobs(SDP_PSM);
+    str2ba(btAddress.c_str(), &addr.l2_bdaddr);
+
+    // connected without blocking so that quitting doesn't have to wait for it
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    bool connected = connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0;
+    if (!connected && errno == EINPROGRESS)
+    {
+        pollfd fd;
+        fd.fd = sock;
+        fd.events = POLLOUT;
+        for (int waited = 0; waited < LINK_CONNECT_TIMEOUT && !m_cancelled; waited += CANCEL_CHECK_INTERVAL)
+        {
+            fd.revents = 0;
+            int res = poll(&fd, 1, CANCEL_CHECK_INTERVAL);
+            if (res < 0 && errno != EINTR) break;
+            if (res <= 0) continue;
+
+            int error = 0;
+            socklen_t errorSize = sizeof(error);
+            connected = getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorSize) == 0 && error == 0;
+            break;
+        }
+    }
+
+    l2cap_conninfo info;
+    socklen_t infoSize = sizeof(info);
+    if (!connected || getsockopt(sock, SOL_L2CAP, L2CAP_CONNINFO, &info, &infoSize) < 0)
+    {
+        close(sock);
+        m_lastErrorString = "Cannot link to " + btAddress;
+        return false;
+    }
+
+    Link link;
+    link.socket = sock;
+    link.handle = info.hci_handle;
+    link.rssi = 0;
+    link.rssiKnown = false;
+
+    // the link has to time out quickly for a departure to be noticed quickly,
+    // and an idle link is kept in sniff mode. neither is fatal if refused
+    hci_write_link_supervision_timeout(m_commandSocket, htobs(link.handle), htobs(SUPERVISION_TIMEOUT), COMMAND_TIMEOUT);
+
+    sniff_mode_cp cp;
+    cp.handle = htobs(link.handle);
+    cp.max_interval = htobs(SNIFF_MAX_INTERVAL);
+    cp.min_interval = htobs(SNIFF_MIN_INTERVAL);
+    cp.attempt = htobs(4);
+    cp.timeout = htobs(1);
+    hci_send_cmd(m_commandSocket, OGF_LINK_POLICY, OCF_SNIFF_MODE, SNIFF_MODE_CP_SIZE, &cp);
+
+    m_links[btAddress] = link;
+    m_lastErrorString = "";
+    return true;
+}
+
+bool LinkMonitor::isLinked(const std::string& btAddress) const
+{
+    return m_links.find(btAddress) != m_links.end();
+}
+
+bool LinkMonitor::rssi(const std::string& btAddress, int8_t& rssi) const
+{
+    std::map<std::string, Link>::const_iterator it = m_links.find(btAddress);
+    if (it == m_links.end() || !it->second.rssiKnown) return false;
+
+    rssi = it->second.rssi;
+    return true;
+}
+
+void LinkMonitor::unlink(const std::string& btAddress)
+{
+    std::map<std::string, Link>::iterator it = m_links.find(btAddress);
+    if (it == m_links.end()) return;
+
+    closeLink(it->second);
+    m_links.erase(it);
+}
+
+void LinkMonitor::retain(const std::vector<std::string>& btAddresses)
+{
+    std::map<std::string, Link>::iterator it = m_links.begin();
+    while (it != m_links.end())
+    {
+        if (std::find(btAddresses.begin(), btAddresses.end(), it->first) != btAddresses.end())
+        {
+            ++it;
+            continue;
+        }
+        closeLink(it->second);
+        m_links.erase(it++);
+    }
+}
+
+void LinkMonitor::checkLinks(std::vector<std::string>& departed, std::vector<std::string>& lost)
+{
+    // the disconnection event comes before the l2cap socket is closed, so
+    // reading events first gets the reason for all links that ended
+    readEvents();
+    checkSockets();
+
+    time_t now = time(NULL);
+    if (m_rssiInterval > 0 && now - m_lastRssiRead >= m_rssiInterval)
+    {
+        m_lastRssiRead = now;
+        readRssi();
+    }
+
+    departed.clear();
+    lost.clear();
+    departed.swap(m_departed);
+    lost.swap(m_lost);
+}
+
+unsigned int LinkMonitor::size() const
+{
+    return m_links.size();
+}
+
+std::string LinkMonitor::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+// events of connections that aren't links, e.g. those of connection probes,
+// are read as well so that they aren't mistaken for a link reusing the handle
+void LinkMonitor::readEvents()
+{
+    m_events.dispatch(0);
+}
+
+void LinkMonitor::handleDisconnection(const uint8_t* data, uint8_t size)
+{
+    if (size < EVT_DISCONN_COMPLETE_SIZE) return;
+
+    const evt_disconn_complete* event = (const evt_disconn_complete*)data;
+    if (event->status != 0) return;
+
+    uint16_t handle = btohs(event->handle);
+    std::map<std::string, Link>::iterator it;
+    for (it = m_links.begin(); it != m_links.end(); ++it)
+    {
+        if (it->second.handle != handle) continue;
+
+        // a supervision timeout means the device went out of range, other
+        // reasons such as the device closing the link say nothing of it
+        if (event->reason == HCI_CONNECTION_TIMEOUT)
+        {
+            m_departed.push_back(it->first);
+        }
+        else
+        {
+            m_lost.push_back(it->first);
+        }
+        closeLink(it->second);
+        m_links.erase(it);
+        break;
+    }
+}
+
+void LinkMonitor::disconnectionWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size)
+{
+    LinkMonitor* monitor = (LinkMonitor*) obj;
+    monitor->handleDisconnection(data, size);
+}
+
+void LinkMonitor::checkSockets()
+{
+    if (m_links.empty()) return;
+
+    std::vector<pollfd> fds;
+    std::vector<std::string> addresses;
+    std::map<std::string, Link>::iterator it;
+    for (it = m_links.begin(); it != m_links.end(); ++it)
+    {
+        pollfd fd;
+        fd.fd = it->second.socket;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        fds.push_back(fd);
+        addresses.push_back(it->first);
+    }
+
+    if (poll(&fds[0], fds.size(), 0) <= 0) return;
+
+    for (unsigned int i = 0; i < fds.size(); i++)
+    {
+        if (fds[i].revents == 0) continue;
+
+        // sdp server doesn't send anything unasked, data is just dropped
+        char buffer[64];
+        bool closed = (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+        if (!closed && (fds[i].revents & POLLIN)) closed = recv(fds[i].fd, buffer, sizeof(buffer), 0) == 0;
+        if (!closed) continue;
+
+        m_lost.push_back(addresses.at(i));
+        unlink(addresses.at(i));
+    }
+}
+
+// a link whose signal strength can't be read is gone
+void LinkMonitor::readRssi()
+{
+    std::vector<std::string> failed;
+    std::map<std::string, Link>::iterator it;
+    for (it = m_links.begin(); it != m_links.end(); ++it)
+    {
+        int8_t rssi;
+        if (hci_read_rssi(m_commandSocket, htobs(it->second.handle), &rssi, COMMAND_TIMEOUT) < 0)
+        {
+            failed.push_back(it->first);
+            continue;
+        }
+        it->second.rssi = rssi;
+        it->second.rssiKnown = true;
+    }
+
+    for (unsigned int i = 0; i < failed.size(); i++)
+    {
+        m_lost.push_back(failed.at(i));
+        unlink(failed.at(i));
+    }
+}
+
+void LinkMonitor::closeLink(Link& link)
+{
+    if (link.socket < 0) return;
+    close(link.socket);
+    link.socket = -1;
+}
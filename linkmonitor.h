@@ -0,0 +1,101 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef LINKMONITOR_H
+#define LINKMONITOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <time.h>
+
+#include "hcieventreader.h"
+
+// keeps idle links to devices known to be present, so that they don't have
+// to be paged again and again. a link is held up by an l2cap connection to
+// the sdp server of the device and put in sniff mode to save power. when the
+// device goes out of range the link times out within the supervision timeout,
+// which is seen as a departure right away
+class LinkMonitor
+{
+public:
+    LinkMonitor();
+    ~LinkMonitor();
+
+    // opens sockets for the adapter, at most maxLinks links are kept
+    bool init(int devId, unsigned int maxLinks);
+    void shutdown();
+
+    // 0 disables, extra links are dropped
+    void setMaxLinks(unsigned int maxLinks);
+
+    // how often signal strength of the links is read to check they are still up, in sec
+    void setRssiInterval(int interval);
+
+    // ends a link being made and makes further ones fail, may be called from another thread
+    void cancel();
+
+    bool isEnabled() const;
+    bool hasRoom() const;
+
+    // makes a link to a device that just answered a probe
+    bool link(const std::string& btAddress);
+
+    bool isLinked(const std::string& btAddress) const;
+
+    // returns false if the device isn't linked or its signal strength hasn't been read yet
+    bool rssi(const std::string& btAddress, int8_t& rssi) const;
+
+    // drops link to a device
+    void unlink(const std::string& btAddress);
+
+    // drops links to devices not in the list
+    void retain(const std::vector<std::string>& btAddresses);
+
+    // handles link events without blocking. departed gets devices whose link
+    // timed out, lost those whose link ended otherwise and have to be probed
+    void checkLinks(std::vector<std::string>& departed, std::vector<std::string>& lost);
+
+    unsigned int size() const;
+
+    std::string getLastErrorString();
+
+private:
+    struct Link
+    {
+        int socket;
+        uint16_t handle;
+        int8_t rssi;
+        bool rssiKnown;
+    };
+
+    // these collect ended links to m_departed and m_lost
+    void readEvents();
+    void handleDisconnection(const uint8_t* data, uint8_t size);
+    static void disconnectionWrapper(void* obj, uint8_t event, const uint8_t* data, uint8_t size);
+    void checkSockets();
+    void readRssi();
+    void closeLink(Link& link);
+
+    int m_devId;
+    unsigned int m_maxLinks;
+    int m_rssiInterval;
+    time_t m_lastRssiRead;
+    volatile bool m_cancelled;
+
+    // disconnection events are read from one socket and commands sent
+    // through another, so that waiting for a command result doesn't lose events
+    HciEventReader m_events;
+    int m_commandSocket;
+
+    std::map<std::string, Link> m_links;
+    std::vector<std::string> m_departed;
+    std::vector<std::string> m_lost;
+
+    std::string m_lastErrorString;
+};
+
+#endif // LINKMONITOR_H
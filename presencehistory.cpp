@@ -0,0 +1,407 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "presencehistory.h"
+#include "macaddress.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// history file layout: header, address table of MAX_DEVICES 6 byte
+// addresses, then blockCount blocks. all fields are in host byte order
+const char HISTORY_MAGIC[4] = {'B', 'T', 'P', 'H'};
+const uint32_t HISTORY_VERSION = 1;
+
+// intervals per block
+const uint32_t BLOCK_SIZE = 256;
+
+// device indexes are 16 bits
+const uint32_t MAX_DEVICES = 65535;
+
+// intervals are written when they end, but their ends can be earlier than
+// that of the first interval of the block. the block base time is set this
+// much before the first end, in sec
+const int64_t BASE_TIME_MARGIN = 3600;
+
+// durations up to this many seconds are stored in seconds, longer ones in minutes
+const uint32_t MAX_DURATION_SECONDS = 0x7fff;
+const uint16_t DURATION_IN_MINUTES = 0x8000;
+
+struct HistoryHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t deviceCount;
+
+    // block being written, and how many blocks hold intervals including it
+    uint32_t head;
+    uint32_t usedBlocks;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct HistoryBlock
+{
+    int64_t baseTime;
+    uint16_t count;
+    uint8_t reserved[6];
+    uint16_t device[BLOCK_SIZE];
+    uint16_t endOffset[BLOCK_SIZE];
+    uint16_t duration[BLOCK_SIZE];
+    int8_t rssi[BLOCK_SIZE];
+} __attribute__((packed));
+
+static uint16_t encodeDuration(int64_t seconds)
+{
+    if (seconds < 0) return 0;
+    if (seconds <= MAX_DURATION_SECONDS) return (uint16_t)seconds;
+
+    int64_t minutes = (seconds + 59) / 60;
+    if (minutes > MAX_DURATION_SECONDS) minutes = MAX_DURATION_SECONDS;
+    return DURATION_IN_MINUTES | (uint16_t)minutes;
+}
+
+static int64_t decodeDuration(uint16_t duration)
+{
+    if (duration & DURATION_IN_MINUTES) return (int64_t)(duration & ~DURATION_IN_MINUTES) * 60;
+    return duration;
+}
+
+static HistoryHeader* headerOf(void* map)
+{
+    return (HistoryHeader*)map;
+}
+
+static uint8_t* addressesOf(void* map)
+{
+    return (uint8_t*)map + sizeof(HistoryHeader);
+}
+
+static HistoryBlock* blocksOf(void* map)
+{
+    return (HistoryBlock*)(addressesOf(map) + MAX_DEVICES * 6);
+}
+
+PresenceHistory::PresenceHistory() :
+    m_fd(-1), m_map(0), m_mapSize(0), m_intervalCount(0)
+{
+}
+
+PresenceHistory::~PresenceHistory()
+{
+    close();
+}
+
+bool PresenceHistory::open(std::string fileName, uint32_t capacity)
+{
+    close();
+
+    uint32_t blockCount = (capacity + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blockCount < 2) blockCount = 2;
+    m_mapSize = sizeof(HistoryHeader) + MAX_DEVICES * 6 + (size_t)blockCount * sizeof(HistoryBlock);
+
+    m_fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (m_fd < 0 || fstat(m_fd, &st) < 0)
+    {
+        close();
+        m_lastErrorString = "Cannot open presence history " + fileName;
+        return false;
+    }
+
+    // a file of another size or format is started over
+    bool valid = false;
+    if (st.st_size == (off_t)m_mapSize)
+    {
+        HistoryHeader header;
+        valid = pread(m_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                memcmp(header.magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC)) == 0 &&
+                header.version == HISTORY_VERSION && header.blockSize == BLOCK_SIZE &&
+                header.blockCount == blockCount && header.deviceCount <= MAX_DEVICES &&
+                header.head < blockCount && header.usedBlocks <= blockCount;
+    }
+    if (!valid && (ftruncate(m_fd, 0) < 0 || ftruncate(m_fd, m_mapSize) < 0))
+    {
+        close();
+        m_lastErrorString = "Cannot create presence history " + fileName;
+        return false;
+    }
+
+    m_map = mmap(0, m_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = 0;
+        close();
+        m_lastErrorString = "Cannot map presence history " + fileName;
+        return false;
+    }
+
+    HistoryHeader* header = headerOf(m_map);
+    if (!valid)
+    {
+        // new file is all zeros, an empty first block included
+        memcpy(header->magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+        header->version = HISTORY_VERSION;
+        header->blockSize = BLOCK_SIZE;
+        header->blockCount = blockCount;
+        header->deviceCount = 0;
+        header->head = 0;
+        header->usedBlocks = 1;
+    }
+
+    loadIndex();
+
+    m_lastErrorString = "";
+    return true;
+}
+
+void PresenceHistory::close()
+{
+    if (m_map)
+    {
+        // presence going on ends at the last time it was seen, a restart
+        // starts a new interval if the device is still around
+        for (uint32_t i = 0; i < m_devices.size(); i++)
+        {
+            Device& device = m_devices[i];
+            if (device.openStart == 0) continue;
+            append(i, device.openStart, device.lastSeen, device.rssi);
+            device.openStart = 0;
+        }
+        sync();
+        munmap(m_map, m_mapSize);
+        m_map = 0;
+    }
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_devices.clear();
+    m_deviceIndex.clear();
+    m_intervalCount = 0;
+}
+
+bool PresenceHistory::isOpen() const
+{
+    return m_map != 0;
+}
+
+void PresenceHistory::update(const std::string& btAddress, bool available, time_t now, int rssi)
+{
+    if (!m_map) return;
+
+    uint32_t index;
+    if (available)
+    {
+        if (!deviceFor(btAddress, index)) return;
+
+        Device& device = m_devices[index];
+        if (device.openStart == 0)
+        {
+            device.openStart = now;
+            device.rssi = RSSI_UNKNOWN;
+        }
+        device.lastSeen = now;
+        if (rssi != RSSI_UNKNOWN && (device.rssi == RSSI_UNKNOWN || rssi > device.rssi)) device.rssi = rssi;
+        return;
+    }
+
+    std::map<uint64_t, uint32_t>::iterator it;
+    uint64_t address;
+    if (!parseMacAddress(btAddress, address) || (it = m_deviceIndex.find(address)) == m_deviceIndex.end()) return;
+
+    Device& device = m_devices[it->second];
+    if (device.openStart == 0) return;
+
+    // the device left some time after it was last seen, the interval ends at that
+    append(it->second, device.openStart, device.lastSeen, device.rssi);
+    device.openStart = 0;
+}
+
+bool PresenceHistory::lastSeen(const std::string& btAddress, time_t& lastSeen, bool& present) const
+{
+    uint64_t address;
+    if (!parseMacAddress(btAddress, address)) return false;
+
+    std::map<uint64_t, uint32_t>::const_iterator it = m_deviceIndex.find(address);
+    if (it == m_deviceIndex.end() || m_devices[it->second].lastSeen == 0) return false;
+
+    lastSeen = m_devices[it->second].lastSeen;
+    present = m_devices[it->second].openStart != 0;
+    return true;
+}
+
+void PresenceHistory::intervals(const std::string& btAddress, unsigned int limit, std::vector<PresenceInterval>& result) const
+{
+    result.clear();
+    if (!m_map || limit == 0) return;
+
+    uint64_t address;
+    std::map<uint64_t, uint32_t>::const_iterator it;
+    if (!parseMacAddress(btAddress, address) || (it = m_deviceIndex.find(address)) == m_deviceIndex.end()) return;
+
+    uint16_t index = it->second;
+    const Device& device = m_devices[index];
+    if (device.openStart != 0)
+    {
+        PresenceInterval interval;
+        interval.start = device.openStart;
+        interval.end = device.lastSeen;
+        interval.rssi = device.rssi;
+        result.push_back(interval);
+    }
+
+    // newest block first, each block from its end. only the device column
+    // is scanned for blocks without the device
+    const HistoryHeader* header = headerOf(m_map);
+    const HistoryBlock* blocks = blocksOf(m_map);
+    for (uint32_t i = 0; i < header->usedBlocks && result.size() < limit; i++)
+    {
+        const HistoryBlock& block = blocks[(header->head + header->blockCount - i) % header->blockCount];
+        for (int j = (int)block.count - 1; j >= 0 && result.size() < limit; j--)
+        {
+            if (block.device[j] != index) continue;
+
+            PresenceInterval interval;
+            interval.end = block.baseTime + block.endOffset[j];
+            interval.start = interval.end - decodeDuration(block.duration[j]);
+            interval.rssi = block.rssi[j];
+            result.push_back(interval);
+        }
+    }
+}
+
+void PresenceHistory::sync()
+{
+    if (m_map) msync(m_map, m_mapSize, MS_ASYNC);
+}
+
+unsigned int PresenceHistory::intervalCount() const
+{
+    return m_intervalCount;
+}
+
+unsigned int PresenceHistory::deviceCount() const
+{
+    return m_devices.size();
+}
+
+std::string PresenceHistory::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+bool PresenceHistory::deviceFor(const std::string& btAddress, uint32_t& index)
+{
+    uint64_t address;
+    if (!parseMacAddress(btAddress, address)) return false;
+
+    std::map<uint64_t, uint32_t>::iterator it = m_deviceIndex.find(address);
+    if (it != m_deviceIndex.end())
+    {
+        index = it->second;
+        return true;
+    }
+
+    HistoryHeader* header = headerOf(m_map);
+    if (header->deviceCount >= MAX_DEVICES) return false;
+
+    index = header->deviceCount;
+    uint8_t* entry = addressesOf(m_map) + index * 6;
+    for (int i = 0; i < 6; i++) entry[i] = (uint8_t)(address >> ((5 - i) * 8));
+    header->deviceCount++;
+
+    Device device;
+    device.address = address;
+    device.lastSeen = 0;
+    device.openStart = 0;
+    device.rssi = RSSI_UNKNOWN;
+    m_devices.push_back(device);
+    m_deviceIndex[address] = index;
+    return true;
+}
+
+void PresenceHistory::append(uint32_t device, time_t start, time_t end, int rssi)
+{
+    HistoryHeader* header = headerOf(m_map);
+    HistoryBlock* blocks = blocksOf(m_map);
+    HistoryBlock* block = &blocks[header->head];
+
+    // a full block, or an end the block can't express, moves to the next
+    // block. the oldest block is overwritten when all are in use
+    if (block->count > 0 && (block->count == BLOCK_SIZE || (int64_t)end < block->baseTime ||
+                             (int64_t)end - block->baseTime > 0xffff))
+    {
+        header->head = (header->head + 1) % header->blockCount;
+        block = &blocks[header->head];
+        if (header->usedBlocks < header->blockCount)
+        {
+            header->usedBlocks++;
+        }
+        else
+        {
+            m_intervalCount -= block->count;
+        }
+        block->count = 0;
+    }
+    if (block->count == 0) block->baseTime = (int64_t)end - BASE_TIME_MARGIN;
+
+    // the entry is complete before the count makes it visible, a crash in
+    // between just loses it
+    uint16_t slot = block->count;
+    block->device[slot] = device;
+    block->endOffset[slot] = (uint16_t)((int64_t)end - block->baseTime);
+    block->duration[slot] = encodeDuration((int64_t)end - start);
+    block->rssi[slot] = rssi;
+    __sync_synchronize();
+    block->count = slot + 1;
+    m_intervalCount++;
+}
+
+void PresenceHistory::loadIndex()
+{
+    HistoryHeader* header = headerOf(m_map);
+    const uint8_t* addresses = addressesOf(m_map);
+
+    m_devices.resize(header->deviceCount);
+    for (uint32_t i = 0; i < header->deviceCount; i++)
+    {
+        uint64_t address = 0;
+        for (int j = 0; j < 6; j++) address = (address << 8) | addresses[i * 6 + j];
+
+        Device& device = m_devices[i];
+        device.address = address;
+        device.lastSeen = 0;
+        device.openStart = 0;
+        device.rssi = RSSI_UNKNOWN;
+        m_deviceIndex[address] = i;
+    }
+
+    // last seen time of a device is the latest end of its intervals. a block
+    // claiming more intervals than it holds is corrupt and emptied, reading
+    // and appending trust the counts after this
+    HistoryBlock* blocks = blocksOf(m_map);
+    m_intervalCount = 0;
+    for (uint32_t i = 0; i < header->usedBlocks; i++)
+    {
+        HistoryBlock& block = blocks[(header->head + header->blockCount - i) % header->blockCount];
+        if (block.count > BLOCK_SIZE) block.count = 0;
+        uint32_t count = block.count;
+        for (uint32_t j = 0; j < count; j++)
+        {
+            if (block.device[j] >= m_devices.size()) continue;
+
+            Device& device = m_devices[block.device[j]];
+            time_t end = block.baseTime + block.endOffset[j];
+            if (end > device.lastSeen) device.lastSeen = end;
+        }
+        m_intervalCount += count;
+    }
+}
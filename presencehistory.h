@@ -0,0 +1,94 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef PRESENCEHISTORY_H
+#define PRESENCEHISTORY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <time.h>
+
+// rssi of an interval when it wasn't measured
+const int RSSI_UNKNOWN = 127;
+
+// time a device was continuously present
+struct PresenceInterval
+{
+    time_t start;
+    time_t end;
+    int rssi;
+};
+
+// keeps presence intervals of the devices in a memory mapped ring file, so
+// that the sensor can tell when it has seen a device without asking the
+// systems downstream. intervals are stored in blocks, each column of a
+// block packed separately: device index, end as offset from the block base
+// time, duration and strongest rssi. the oldest block is overwritten when
+// the file is full. last seen times are kept in memory for fast lookups
+class PresenceHistory
+{
+public:
+    PresenceHistory();
+    ~PresenceHistory();
+
+    // opens history file holding up to capacity intervals, creates it if
+    // it doesn't exist or has a different capacity
+    bool open(std::string fileName, uint32_t capacity);
+
+    // closes intervals of devices still present and unmaps the file
+    void close();
+    bool isOpen() const;
+
+    // records result of a device, rssi is RSSI_UNKNOWN when not measured
+    void update(const std::string& btAddress, bool available, time_t now, int rssi);
+
+    // returns false if device has never been seen
+    bool lastSeen(const std::string& btAddress, time_t& lastSeen, bool& present) const;
+
+    // returns newest intervals of the device first, at most limit. an
+    // interval still going on ends at the last time the device was seen
+    void intervals(const std::string& btAddress, unsigned int limit, std::vector<PresenceInterval>& result) const;
+
+    // writes changes of the mapped file to disk
+    void sync();
+
+    unsigned int intervalCount() const;
+    unsigned int deviceCount() const;
+
+    std::string getLastErrorString();
+
+private:
+    struct Device
+    {
+        uint64_t address;
+        time_t lastSeen;
+
+        // start of the interval going on, 0 when not present
+        time_t openStart;
+        int8_t rssi;
+    };
+
+    // returns index of the device, adds it if new. false if the file has no room for it
+    bool deviceFor(const std::string& btAddress, uint32_t& index);
+
+    void append(uint32_t device, time_t start, time_t end, int rssi);
+
+    // reads addresses and last seen times from the mapped file
+    void loadIndex();
+
+    int m_fd;
+    void* m_map;
+    size_t m_mapSize;
+
+    std::vector<Device> m_devices;
+    std::map<uint64_t, uint32_t> m_deviceIndex;
+    unsigned int m_intervalCount;
+
+    std::string m_lastErrorString;
+};
+
+#endif // PRESENCEHISTORY_H
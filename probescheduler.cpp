@@ -0,0 +1,135 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "probescheduler.h"
+
+#include <algorithm>
+
+const double DEFAULT_QUIET_SHARE = 0.25;
+
+// a profile is trusted once it has this many transitions, about two weeks of
+// a device coming and going every working day
+const unsigned int MIN_PROFILE_TRANSITIONS = 20;
+
+ProbeScheduler::ProbeScheduler() : m_quietShare(DEFAULT_QUIET_SHARE), m_passTime(0), m_hourTime(0), m_hour(0)
+{
+}
+
+void ProbeScheduler::setQuietShare(double share)
+{
+    m_quietShare = std::max(0.01, std::min(share, 1.0));
+}
+
+void ProbeScheduler::recordTransition(DeviceState& state, time_t when)
+{
+    unsigned int hour = hourOfWeek(when);
+
+    // older weeks fade out as newer ones come in
+    if (state.transitions[hour] == 255)
+    {
+        for (unsigned int i = 0; i < WEEK_HOURS; i++) state.transitions[i] /= 2;
+    }
+    state.transitions[hour]++;
+}
+
+bool ProbeScheduler::due(const std::string& btAddress, const DeviceState& state, time_t now, uint64_t monotonic)
+{
+    if (m_quietShare >= 1) return true;
+
+    if (now != m_hourTime)
+    {
+        m_hourTime = now;
+        m_hour = hourOfWeek(now);
+    }
+
+    // a device is probed right away the first time whatever its profile says
+    std::map<std::string, Entry>::iterator it = m_entries.find(btAddress);
+    if (it == m_entries.end())
+    {
+        Entry entry;
+        entry.nextProbe = 0;
+        it = m_entries.insert(std::make_pair(btAddress, entry)).first;
+    }
+    it->second.weight = weight(state, m_hour);
+
+    // devices likely to change are probed on every pass
+    if (it->second.weight >= 1) return true;
+    return it->second.nextProbe <= monotonic;
+}
+
+void ProbeScheduler::probed(const std::string& btAddress, uint64_t monotonic)
+{
+    std::map<std::string, Entry>::iterator it = m_entries.find(btAddress);
+    if (it == m_entries.end()) return;
+
+    // a device at weight 0.25 is probed about on every fourth pass
+    it->second.nextProbe = monotonic + (uint64_t)(m_passTime / it->second.weight);
+}
+
+void ProbeScheduler::recordPass(uint64_t duration, unsigned int probes, unsigned int devices)
+{
+    // the passes get shorter as quiet devices are put off, the deadlines
+    // follow a pass that probes them all
+    if (probes > 0) m_passTime = duration * devices / probes;
+}
+
+uint64_t ProbeScheduler::nextProbe() const
+{
+    uint64_t next = 0;
+    for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        if (next == 0 || it->second.nextProbe < next) next = it->second.nextProbe;
+    }
+    return next;
+}
+
+void ProbeScheduler::forget(const std::string& btAddress)
+{
+    m_entries.erase(btAddress);
+}
+
+void ProbeScheduler::retain(const std::vector<std::string>& btAddresses)
+{
+    std::map<std::string, Entry>::iterator it = m_entries.begin();
+    while (it != m_entries.end())
+    {
+        if (std::find(btAddresses.begin(), btAddresses.end(), it->first) != btAddresses.end())
+        {
+            ++it;
+            continue;
+        }
+        m_entries.erase(it++);
+    }
+}
+
+// transitions of neighbouring hours count as well, arrivals spread over the
+// hour boundary, and the next hour is looked at so that probing speeds up
+// before the usual arrival time rather than during it
+double ProbeScheduler::weight(const DeviceState& state, unsigned int hour) const
+{
+    unsigned int total = 0;
+    unsigned int peak = 0;
+    unsigned int current = 0;
+    for (unsigned int i = 0; i < WEEK_HOURS; i++)
+    {
+        total += state.transitions[i];
+        unsigned int smoothed = 2 * state.transitions[i] + state.transitions[(i + WEEK_HOURS - 1) % WEEK_HOURS] +
+                                state.transitions[(i + 1) % WEEK_HOURS];
+        peak = std::max(peak, smoothed);
+        if (i == hour || i == (hour + 1) % WEEK_HOURS) current = std::max(current, smoothed);
+    }
+
+    // devices without habits yet are probed on every pass
+    if (total < MIN_PROFILE_TRANSITIONS) return 1;
+
+    return m_quietShare + (1 - m_quietShare) * current / peak;
+}
+
+unsigned int ProbeScheduler::hourOfWeek(time_t when)
+{
+    tm local;
+    localtime_r(&when, &local);
+    return local.tm_wday * 24 + local.tm_hour;
+}
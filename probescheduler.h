@@ -0,0 +1,79 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef PROBESCHEDULER_H
+#define PROBESCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <time.h>
+#include <stdint.h>
+
+#include "devicecache.h"
+
+// spreads probes by the weekly habits of the devices. arrivals and
+// departures are counted per hour of the week, and a device is probed on
+// every pass over the devices around the hours it usually comes or goes.
+// at other times it gets a deadline for its next probe from its weight and
+// the time a pass probing every device would take. the passes get shorter, so the devices
+// likely to change are probed more often with the same radio time
+class ProbeScheduler
+{
+public:
+    ProbeScheduler();
+
+    // share of passes a device is probed on when it doesn't usually change
+    // at this time (0..1). 1 probes every device on every pass
+    void setQuietShare(double share);
+
+    // counts an arrival or departure of the device at the time
+    static void recordTransition(DeviceState& state, time_t when);
+
+    // returns true if the deadline of the device has passed. now is the
+    // wall clock time for the hour of week, monotonic the time in microseconds
+    bool due(const std::string& btAddress, const DeviceState& state, time_t now, uint64_t monotonic);
+
+    // sets the next deadline of the device after a probe that ended at monotonic
+    void probed(const std::string& btAddress, uint64_t monotonic);
+
+    // duration of a pass over the devices in microseconds, with the number
+    // of devices probed and asked about on it
+    void recordPass(uint64_t duration, unsigned int probes, unsigned int devices);
+
+    // earliest deadline of the devices, 0 if there are none
+    uint64_t nextProbe() const;
+
+    // forgets the device, it is due as soon as it is asked about again
+    void forget(const std::string& btAddress);
+
+    // forgets the devices not in btAddresses
+    void retain(const std::vector<std::string>& btAddresses);
+
+private:
+    struct Entry
+    {
+        double weight;
+        uint64_t nextProbe;
+    };
+
+    // share of the passes the device is probed on at the hour of the week
+    double weight(const DeviceState& state, unsigned int hour) const;
+
+    static unsigned int hourOfWeek(time_t when);
+
+    double m_quietShare;
+
+    std::map<std::string, Entry> m_entries;
+
+    // duration of the last pass scaled to probing every device, in microseconds
+    uint64_t m_passTime;
+
+    // hour of week is looked up once per second
+    time_t m_hourTime;
+    unsigned int m_hour;
+};
+
+#endif // PROBESCHEDULER_H
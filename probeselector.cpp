@@ -0,0 +1,162 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "probeselector.h"
+
+#include <string.h>
+
+// answers needed before a strategy can be chosen
+const uint32_t MIN_SUCCESSES = 3;
+
+// a strategy is reliable while at most one in this many results is a miss
+const uint32_t MISS_RATIO = 20;
+
+// counts are halved when they reach this, so that old results fade out
+const uint32_t MAX_RESULTS = 64;
+
+const unsigned int DEFAULT_EXPLORE_INTERVAL = 50;
+
+ProbeSelector::DeviceStats::DeviceStats() :
+    best(PROBE_NAME_REQUEST), probes(0)
+{
+    memset(strategies, 0, sizeof(strategies));
+}
+
+ProbeSelector::ProbeSelector() :
+    m_exploreInterval(DEFAULT_EXPLORE_INTERVAL)
+{
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++) m_enabled[i] = i == PROBE_NAME_REQUEST;
+}
+
+void ProbeSelector::setStrategies(const std::vector<ProbeStrategy>& strategies)
+{
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++) m_enabled[i] = false;
+    for (unsigned int i = 0; i < strategies.size(); i++) m_enabled[strategies.at(i)] = true;
+
+    std::map<std::string, DeviceStats>::iterator it;
+    for (it = m_devices.begin(); it != m_devices.end(); ++it) it->second.best = best(it->second);
+}
+
+void ProbeSelector::setExploreInterval(unsigned int interval)
+{
+    m_exploreInterval = interval;
+}
+
+ProbeStrategy ProbeSelector::choose(const std::string& btAddress, bool wasAvailable)
+{
+    DeviceStats& stats = statsFor(btAddress);
+    stats.probes++;
+    if (!wasAvailable) return stats.best;
+
+    // strategies without enough results are tried first, then one every explore interval
+    unsigned int tries = 0;
+    ProbeStrategy other = leastTried(stats, tries);
+    if (other != stats.best && tries < MIN_SUCCESSES) return other;
+    if (m_exploreInterval > 0 && stats.probes % m_exploreInterval == 0) return other;
+    return stats.best;
+}
+
+void ProbeSelector::record(const std::string& btAddress, ProbeStrategy strategy, bool available, uint32_t latency)
+{
+    // failures are left out, an absent device fails with every strategy
+    if (!available) return;
+
+    DeviceStats& stats = statsFor(btAddress);
+    StrategyStats& strategyStats = stats.strategies[strategy];
+    strategyStats.latency = strategyStats.successes == 0 ? latency : (strategyStats.latency * 7 + latency) / 8;
+    strategyStats.successes++;
+    if (strategyStats.successes + strategyStats.misses >= MAX_RESULTS)
+    {
+        strategyStats.successes /= 2;
+        strategyStats.misses /= 2;
+    }
+    stats.best = best(stats);
+}
+
+void ProbeSelector::recordMiss(const std::string& btAddress, ProbeStrategy strategy)
+{
+    DeviceStats& stats = statsFor(btAddress);
+    StrategyStats& strategyStats = stats.strategies[strategy];
+    strategyStats.misses++;
+    if (strategyStats.successes + strategyStats.misses >= MAX_RESULTS)
+    {
+        strategyStats.successes /= 2;
+        strategyStats.misses /= 2;
+    }
+    stats.best = best(stats);
+}
+
+void ProbeSelector::countChoices(unsigned int counts[PROBE_STRATEGY_COUNT]) const
+{
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++) counts[i] = 0;
+
+    std::map<std::string, DeviceStats>::const_iterator it;
+    for (it = m_devices.begin(); it != m_devices.end(); ++it) counts[it->second.best]++;
+}
+
+ProbeSelector::DeviceStats& ProbeSelector::statsFor(const std::string& btAddress)
+{
+    std::map<std::string, DeviceStats>::iterator it = m_devices.find(btAddress);
+    if (it != m_devices.end()) return it->second;
+
+    DeviceStats& stats = m_devices[btAddress];
+    stats.best = fallback();
+    return stats;
+}
+
+bool ProbeSelector::enabled(ProbeStrategy strategy) const
+{
+    return m_enabled[strategy];
+}
+
+// used when nothing is known of the device yet
+ProbeStrategy ProbeSelector::fallback() const
+{
+    if (enabled(PROBE_NAME_REQUEST)) return PROBE_NAME_REQUEST;
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++)
+    {
+        if (m_enabled[i]) return (ProbeStrategy)i;
+    }
+    return PROBE_NAME_REQUEST;
+}
+
+ProbeStrategy ProbeSelector::best(const DeviceStats& stats) const
+{
+    ProbeStrategy chosen = fallback();
+    uint32_t chosenLatency = 0;
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++)
+    {
+        const StrategyStats& strategyStats = stats.strategies[i];
+        if (!m_enabled[i] || strategyStats.successes < MIN_SUCCESSES) continue;
+        if (strategyStats.misses * MISS_RATIO > strategyStats.successes + strategyStats.misses) continue;
+
+        if (chosenLatency == 0 || strategyStats.latency < chosenLatency)
+        {
+            chosen = (ProbeStrategy)i;
+            chosenLatency = strategyStats.latency;
+        }
+    }
+    return chosen;
+}
+
+ProbeStrategy ProbeSelector::leastTried(const DeviceStats& stats, unsigned int& tries) const
+{
+    ProbeStrategy chosen = stats.best;
+    tries = 0;
+    bool found = false;
+    for (int i = 0; i < PROBE_STRATEGY_COUNT; i++)
+    {
+        if (!m_enabled[i] || i == stats.best) continue;
+
+        unsigned int strategyTries = stats.strategies[i].successes + stats.strategies[i].misses;
+        if (!found || strategyTries < tries)
+        {
+            chosen = (ProbeStrategy)i;
+            tries = strategyTries;
+            found = true;
+        }
+    }
+    return chosen;
+}
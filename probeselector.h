@@ -0,0 +1,77 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef PROBESELECTOR_H
+#define PROBESELECTOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "bluetoothpoller.h"
+
+// picks the probe strategy of each device from measured results: the fastest
+// strategy that hasn't been caught missing the device when it was there.
+// other strategies are tried again now and then in case the device changes
+class ProbeSelector
+{
+public:
+    ProbeSelector();
+
+    // strategies that may be used, name request is used until others are known
+    void setStrategies(const std::vector<ProbeStrategy>& strategies);
+
+    // every interval:th probe of a device tries some other strategy, 0 disables
+    void setExploreInterval(unsigned int interval);
+
+    // returns strategy for the next probe of the device. only devices that
+    // answered the last probe are explored, probing an absent one tells nothing
+    ProbeStrategy choose(const std::string& btAddress, bool wasAvailable);
+
+    // records result of a probe, latency in usec
+    void record(const std::string& btAddress, ProbeStrategy strategy, bool available, uint32_t latency);
+
+    // records that strategy missed the device and another one found it right after
+    void recordMiss(const std::string& btAddress, ProbeStrategy strategy);
+
+    // returns how many devices currently use each strategy
+    void countChoices(unsigned int counts[PROBE_STRATEGY_COUNT]) const;
+
+private:
+    struct StrategyStats
+    {
+        uint32_t successes;
+        uint32_t misses;
+
+        // moving average of answer times, in usec
+        uint32_t latency;
+    };
+
+    struct DeviceStats
+    {
+        DeviceStats();
+
+        StrategyStats strategies[PROBE_STRATEGY_COUNT];
+        ProbeStrategy best;
+        uint32_t probes;
+    };
+
+    DeviceStats& statsFor(const std::string& btAddress);
+    bool enabled(ProbeStrategy strategy) const;
+    ProbeStrategy fallback() const;
+
+    // fastest reliable strategy with enough results
+    ProbeStrategy best(const DeviceStats& stats) const;
+
+    // least tried strategy other than the best one
+    ProbeStrategy leastTried(const DeviceStats& stats, unsigned int& tries) const;
+
+    bool m_enabled[PROBE_STRATEGY_COUNT];
+    unsigned int m_exploreInterval;
+    std::map<std::string, DeviceStats> m_devices;
+};
+
+#endif // PROBESELECTOR_H
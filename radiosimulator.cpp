@@ -0,0 +1,126 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "radiosimulator.h"
+#include "consistenthash.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+// a real name request answers in tens to hundreds of ms, and an absent device
+// keeps the adapter busy for the whole page timeout (5.12 s), in usec
+const useconds_t MIN_ANSWER_TIME = 20000;
+const useconds_t MAX_ANSWER_TIME = 300000;
+const useconds_t PAGE_TIMEOUT = 5120000;
+
+// devices come and go in periods of this many seconds plus a per device random part
+const int MIN_PERIOD = 300;
+const int PERIOD_SPREAD = 1500;
+
+// a device may answer some strategies only at times, in percent of probes
+const unsigned int MAX_MISS_PERCENT = 40;
+
+// devices found by simulated discovery
+const int DISCOVERABLE_DEVICES = 8;
+
+RadioSimulator::RadioSimulator(double presence, double latencyScale) :
+    m_presence(presence), m_latencyScale(latencyScale), m_cancelled(false)
+{
+}
+
+bool RadioSimulator::scanDevice(const std::string& btAddress, ProbeStrategy strategy)
+{
+    time_t now = time(NULL);
+    if (!isPresent(btAddress, now))
+    {
+        sleepScaled(PAGE_TIMEOUT);
+        return false;
+    }
+
+    // name requests always work, other strategies are faster or slower and
+    // miss some of the probes depending on the device
+    useconds_t answerTime = MIN_ANSWER_TIME;
+    useconds_t answerSpread = MAX_ANSWER_TIME - MIN_ANSWER_TIME;
+    unsigned int missPercent = 0;
+    if (strategy != PROBE_NAME_REQUEST)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "#%d", (int)strategy);
+        uint64_t deviceHash = hashString(btAddress + key);
+        answerTime = answerTime * (1 + deviceHash % 8) / 4;
+        answerSpread = answerSpread * (1 + (deviceHash >> 8) % 8) / 4;
+        missPercent = (deviceHash >> 16) % 4 == 0 ? (deviceHash >> 24) % MAX_MISS_PERCENT : 0;
+    }
+
+    // answer time varies from probe to probe
+    char key[32];
+    snprintf(key, sizeof(key), "%ld", (long)now);
+    uint64_t hash = hashString(btAddress + key);
+    sleepScaled(answerTime + hash % answerSpread);
+    return !m_cancelled && (hash >> 32) % 100 >= missPercent;
+}
+
+void RadioSimulator::discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices)
+{
+    discoveredDevices.clear();
+
+    // inquiry lasts about 10 s regardless of what is found
+    sleepScaled(10240000);
+
+    time_t now = time(NULL);
+    char address[18];
+    char name[32];
+    for (int i = 0; i < DISCOVERABLE_DEVICES; i++)
+    {
+        snprintf(address, sizeof(address), "00:11:22:33:44:%02X", i);
+        if (!isPresent(address, now)) continue;
+
+        snprintf(name, sizeof(name), "Simulated device %d", i);
+        DiscoveredDevice device;
+        device.btAddress = address;
+        device.name = name;
+        discoveredDevices.push_back(device);
+    }
+}
+
+void RadioSimulator::cancel()
+{
+    m_cancelled = true;
+}
+
+std::string RadioSimulator::adapterAddress()
+{
+    unsigned int pid = getpid();
+    char address[18];
+    snprintf(address, sizeof(address), "00:00:00:%02X:%02X:%02X",
+             (pid >> 16) & 0xff, (pid >> 8) & 0xff, pid & 0xff);
+    return address;
+}
+
+bool RadioSimulator::isPresent(const std::string& btAddress, time_t now)
+{
+    // each device has its own period length and phase
+    uint64_t hash = hashString(btAddress);
+    int period = MIN_PERIOD + hash % PERIOD_SPREAD;
+    long slot = (now + (long)(hash >> 32) % period) / period;
+
+    char key[32];
+    snprintf(key, sizeof(key), "#%ld", slot);
+    double draw = (hashString(btAddress + key) % 10000) / 10000.0;
+    return draw < m_presence;
+}
+
+void RadioSimulator::sleepScaled(useconds_t usec)
+{
+    // sleep in short steps so that cancel doesn't have to wait for a whole page timeout
+    useconds_t left = (useconds_t)(usec * m_latencyScale);
+    while (left > 0 && !m_cancelled)
+    {
+        useconds_t step = std::min<useconds_t>(left, 10000);
+        usleep(step);
+        left -= step;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef RADIOSIMULATOR_H
+#define RADIOSIMULATOR_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "bluetoothpoller.h"
+
+// stands in for the bluetooth adapter when running without one, e.g. when
+// testing several sensors on one machine. presence of a device depends only on
+// its address and the time, so all simulated sensors agree on which devices
+// are around
+class RadioSimulator
+{
+public:
+    // presence is the share of time devices are around (0..1), latencyScale
+    // multiplies the simulated probe durations
+    RadioSimulator(double presence, double latencyScale);
+
+    // returns true if device answered, takes about as long as a real probe.
+    // each device has its own answer times and misses per strategy
+    bool scanDevice(const std::string& btAddress, ProbeStrategy strategy = PROBE_NAME_REQUEST);
+
+    // returns simulated devices that are around
+    void discoverDevices(std::vector<DiscoveredDevice>& discoveredDevices);
+
+    // returns a made up adapter address, unique per process
+    std::string adapterAddress();
+
+    // ends the probe in progress and makes further ones fail, may be called from another thread
+    void cancel();
+
+    // returns true if the device is around at the time, without probing it
+    bool isPresent(const std::string& btAddress, time_t now);
+
+private:
+    void sleepScaled(useconds_t usec);
+
+    double m_presence;
+    double m_latencyScale;
+    volatile bool m_cancelled;
+};
+
+#endif // RADIOSIMULATOR_H
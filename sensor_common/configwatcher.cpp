@@ -0,0 +1,90 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "configwatcher.h"
+
+#include <unistd.h>
+#include <sys/inotify.h>
+
+ConfigWatcher::ConfigWatcher() : m_fd(-1), m_watch(-1)
+{
+
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+    shutdown();
+}
+
+bool ConfigWatcher::init(std::string fileName)
+{
+    shutdown();
+
+    std::string dir = ".";
+    m_fileName = fileName;
+    size_t slash = fileName.rfind('/');
+    if (slash != std::string::npos)
+    {
+        dir = slash > 0 ? fileName.substr(0, slash) : "/";
+        m_fileName = fileName.substr(slash + 1);
+    }
+
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+    {
+        m_lastErrorString = "Cannot initialize inotify";
+        return false;
+    }
+
+    m_watch = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (m_watch < 0)
+    {
+        m_lastErrorString = "Cannot watch directory " + dir;
+        shutdown();
+        return false;
+    }
+
+    m_lastErrorString = "";
+    return true;
+}
+
+void ConfigWatcher::shutdown()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        m_watch = -1;
+    }
+}
+
+bool ConfigWatcher::hasChanged()
+{
+    if (m_fd < 0) return false;
+
+    bool changed = false;
+
+    // drain all pending events, several are normally generated by one save
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1)
+    {
+        ssize_t len = read(m_fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (char* ptr = buf; ptr < buf + len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            if (event->len > 0 && m_fileName == event->name) changed = true;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+}
+
+std::string ConfigWatcher::getLastErrorString()
+{
+    return m_lastErrorString;
+}
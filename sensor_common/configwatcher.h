@@ -0,0 +1,35 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef CONFIGWATCHER_H
+#define CONFIGWATCHER_H
+
+#include <string>
+
+// watches a config file for changes using inotify. the directory of the file
+// is watched instead of the file itself, so that editors replacing the file
+// with a new one are noticed too
+class ConfigWatcher
+{
+public:
+    ConfigWatcher();
+    ~ConfigWatcher();
+
+    bool init(std::string fileName);
+    void shutdown();
+
+    // returns true if the file has been written or replaced since last call. never blocks
+    bool hasChanged();
+
+    std::string getLastErrorString();
+
+private:
+    int m_fd;
+    int m_watch;
+    std::string m_fileName;
+    std::string m_lastErrorString;
+};
+
+#endif // CONFIGWATCHER_H
@@ -0,0 +1,86 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "consistenthash.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+uint64_t hashString(const std::string& str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+
+    // fnv alone spreads similar short strings like bt addresses poorly
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+ConsistentHashRing::ConsistentHashRing(unsigned int pointsPerNode) :
+    m_pointsPerNode(pointsPerNode)
+{
+}
+
+void ConsistentHashRing::setNodes(const std::vector<std::string>& nodes)
+{
+    m_nodes = nodes;
+    m_points.clear();
+    m_points.reserve(nodes.size() * m_pointsPerNode);
+
+    char suffix[16];
+    for (unsigned int n = 0; n < m_nodes.size(); n++)
+    {
+        for (unsigned int i = 0; i < m_pointsPerNode; i++)
+        {
+            snprintf(suffix, sizeof(suffix), "#%u", i);
+            Point point = {hashString(m_nodes.at(n) + suffix), n};
+            m_points.push_back(point);
+        }
+    }
+    std::sort(m_points.begin(), m_points.end());
+}
+
+void ConsistentHashRing::nodesFor(const std::string& key, unsigned int count, std::vector<std::string>& nodes) const
+{
+    nodes.clear();
+    if (m_points.empty()) return;
+    if (count > m_nodes.size()) count = m_nodes.size();
+
+    // walk clockwise from the key's position collecting distinct nodes
+    Point keyPoint = {hashString(key), 0};
+    std::vector<Point>::const_iterator it = std::lower_bound(m_points.begin(), m_points.end(), keyPoint);
+
+    std::vector<bool> taken(m_nodes.size(), false);
+    for (size_t visited = 0; visited < m_points.size() && nodes.size() < count; visited++)
+    {
+        if (it == m_points.end()) it = m_points.begin();
+        if (!taken[it->node])
+        {
+            taken[it->node] = true;
+            nodes.push_back(m_nodes.at(it->node));
+        }
+        ++it;
+    }
+}
+
+bool ConsistentHashRing::isResponsible(const std::string& node, const std::string& key, unsigned int count) const
+{
+    std::vector<std::string> nodes;
+    nodesFor(key, count, nodes);
+    return std::find(nodes.begin(), nodes.end(), node) != nodes.end();
+}
+
+unsigned int ConsistentHashRing::nodeCount() const
+{
+    return m_nodes.size();
+}
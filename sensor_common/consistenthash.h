@@ -0,0 +1,48 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef CONSISTENTHASH_H
+#define CONSISTENTHASH_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// 64 bit hash of a string, fnv-1a with a final mix for better spread
+uint64_t hashString(const std::string& str);
+
+// consistent hash ring mapping keys to nodes. each node is placed on the ring
+// several times, so that keys spread evenly and only about 1/n of the keys
+// move when a node joins or leaves
+class ConsistentHashRing
+{
+public:
+    ConsistentHashRing(unsigned int pointsPerNode = 64);
+
+    // replaces the nodes on the ring
+    void setNodes(const std::vector<std::string>& nodes);
+
+    // returns up to count distinct nodes responsible for key, primary first
+    void nodesFor(const std::string& key, unsigned int count, std::vector<std::string>& nodes) const;
+
+    // true if node is among the count nodes responsible for key
+    bool isResponsible(const std::string& node, const std::string& key, unsigned int count) const;
+
+    unsigned int nodeCount() const;
+
+private:
+    struct Point
+    {
+        uint64_t hash;
+        unsigned int node;
+        bool operator<(const Point& other) const { return hash < other.hash; }
+    };
+
+    unsigned int m_pointsPerNode;
+    std::vector<std::string> m_nodes;
+    std::vector<Point> m_points;
+};
+
+#endif // CONSISTENTHASH_H
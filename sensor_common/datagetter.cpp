@@ -5,13 +5,17 @@
 
 #include "datagetter.h"
 
+// how long connecting and the whole request may take, in sec
+const long CONNECT_TIMEOUT = 10;
+const long REQUEST_TIMEOUT = 60;
+
 static size_t writeCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
     ((std::string*)userp)->append((char*)contents, size * nmemb);
     return size * nmemb;
 }
 
-DataGetter::DataGetter() : m_handle(0)
+DataGetter::DataGetter() : m_handle(0), m_cancelled(false)
 {
 
 }
@@ -28,6 +32,17 @@ bool DataGetter::init()
     m_handle = curl_easy_init();
     if (!m_handle) return false;
 
+    // requests may be made from other threads than the main one, so curl
+    // must not use signals for its timeouts
+    curl_easy_setopt(m_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(m_handle, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+    curl_easy_setopt(m_handle, CURLOPT_TIMEOUT, REQUEST_TIMEOUT);
+
+    // progress callback lets cancel() stop a request without waiting for the timeouts
+    curl_easy_setopt(m_handle, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(m_handle, CURLOPT_XFERINFOFUNCTION, DataGetter::progressCallback);
+    curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
+
     return true;
 }
 
@@ -42,6 +57,11 @@ void DataGetter::shutdown()
 bool DataGetter::get(std::string url, std::string& data)
 {
     if (!m_handle) return false;
+    if (m_cancelled)
+    {
+        m_lastErrorString = "Request cancelled";
+        return false;
+    }
 
     CURLcode response;
     curl_easy_setopt(m_handle, CURLOPT_URL, url.c_str());
@@ -59,6 +79,19 @@ bool DataGetter::get(std::string url, std::string& data)
     return true;
 }
 
+void DataGetter::cancel()
+{
+    m_cancelled = true;
+}
+
+// called by curl often during a request, nonzero return aborts it
+int DataGetter::progressCallback(void* obj, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow; //prevent warning
+
+    return ((DataGetter*)obj)->m_cancelled ? 1 : 0;
+}
+
 std::string DataGetter::getLastErrorString()
 {
     return m_lastErrorString;
@@ -20,10 +20,17 @@ public:
     void shutdown();
 
     bool get(std::string url, std::string &data);
+
+    // aborts request in progress and makes further ones fail, may be called from another thread
+    void cancel();
+
     std::string getLastErrorString();
 
 private:
+    static int progressCallback(void* obj, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+
     CURL* m_handle;
+    volatile bool m_cancelled;
 
     std::string m_lastErrorString;
     std::string m_responseStr;
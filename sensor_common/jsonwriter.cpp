@@ -0,0 +1,234 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "jsonwriter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// initial buffer size, enough for most messages the sensors send
+const size_t INITIAL_CAPACITY = 256;
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+JsonWriter::JsonWriter() :
+    m_depth(0), m_afterKey(false)
+{
+    m_buffer.reserve(INITIAL_CAPACITY);
+    m_needComma[0] = false;
+}
+
+JsonWriter::~JsonWriter()
+{
+
+}
+
+void JsonWriter::clear()
+{
+    m_buffer.clear();
+    m_depth = 0;
+    m_needComma[0] = false;
+    m_afterKey = false;
+}
+
+void JsonWriter::beginObject()
+{
+    push('{');
+}
+
+void JsonWriter::endObject()
+{
+    pop('}');
+}
+
+void JsonWriter::beginArray()
+{
+    push('[');
+}
+
+void JsonWriter::endArray()
+{
+    pop(']');
+}
+
+void JsonWriter::key(const char* name)
+{
+    separate();
+    writeEscaped(name, strlen(name));
+    m_buffer += ':';
+    m_afterKey = true;
+}
+
+void JsonWriter::key(const std::string& name)
+{
+    separate();
+    writeEscaped(name.data(), name.size());
+    m_buffer += ':';
+    m_afterKey = true;
+}
+
+void JsonWriter::value(const char* str)
+{
+    value(str, strlen(str));
+}
+
+void JsonWriter::value(const std::string& str)
+{
+    value(str.data(), str.size());
+}
+
+void JsonWriter::value(const char* str, size_t length)
+{
+    separate();
+    writeEscaped(str, length);
+}
+
+void JsonWriter::value(long long number)
+{
+    separate();
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%lld", number);
+    m_buffer.append(buf, len);
+}
+
+void JsonWriter::value(unsigned long long number)
+{
+    separate();
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%llu", number);
+    m_buffer.append(buf, len);
+}
+
+void JsonWriter::value(long number)
+{
+    value((long long)number);
+}
+
+void JsonWriter::value(unsigned long number)
+{
+    value((unsigned long long)number);
+}
+
+void JsonWriter::value(int number)
+{
+    value((long long)number);
+}
+
+void JsonWriter::value(unsigned int number)
+{
+    value((unsigned long long)number);
+}
+
+void JsonWriter::value(double number)
+{
+    // json has no representation for nan or infinity
+    if (isnan(number) || isinf(number))
+    {
+        nullValue();
+        return;
+    }
+    separate();
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%.16g", number);
+    m_buffer.append(buf, len);
+}
+
+void JsonWriter::value(bool boolean)
+{
+    separate();
+    boolean ? m_buffer.append("true", 4) : m_buffer.append("false", 5);
+}
+
+void JsonWriter::nullValue()
+{
+    separate();
+    m_buffer.append("null", 4);
+}
+
+void JsonWriter::rawValue(const std::string& json)
+{
+    separate();
+    m_buffer += json;
+}
+
+const std::string& JsonWriter::str() const
+{
+    return m_buffer;
+}
+
+const char* JsonWriter::c_str() const
+{
+    return m_buffer.c_str();
+}
+
+size_t JsonWriter::size() const
+{
+    return m_buffer.size();
+}
+
+void JsonWriter::separate()
+{
+    // value right after member name belongs to it
+    if (m_afterKey)
+    {
+        m_afterKey = false;
+        return;
+    }
+    if (m_needComma[m_depth]) m_buffer += ',';
+    m_needComma[m_depth] = true;
+}
+
+void JsonWriter::push(char open)
+{
+    separate();
+    m_buffer += open;
+
+    // deeper levels than MAX_DEPTH share the last comma flag, which keeps the
+    // writer safe but such messages aren't produced by the sensors anyway
+    if (m_depth < MAX_DEPTH - 1) m_depth++;
+    m_needComma[m_depth] = false;
+}
+
+void JsonWriter::pop(char close)
+{
+    m_buffer += close;
+    if (m_depth > 0) m_depth--;
+}
+
+void JsonWriter::writeEscaped(const char* str, size_t length)
+{
+    m_buffer += '"';
+
+    // copy runs of characters not needing escaping in one go
+    size_t runStart = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        m_buffer.append(str + runStart, i - runStart);
+        runStart = i + 1;
+
+        switch (c)
+        {
+        case '"': m_buffer.append("\\\"", 2); break;
+        case '\\': m_buffer.append("\\\\", 2); break;
+        case '\b': m_buffer.append("\\b", 2); break;
+        case '\f': m_buffer.append("\\f", 2); break;
+        case '\n': m_buffer.append("\\n", 2); break;
+        case '\r': m_buffer.append("\\r", 2); break;
+        case '\t': m_buffer.append("\\t", 2); break;
+        default:
+            {
+                char escaped[6] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xf]};
+                m_buffer.append(escaped, 6);
+            }
+        }
+    }
+    m_buffer.append(str + runStart, length - runStart);
+
+    m_buffer += '"';
+}
@@ -0,0 +1,69 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#include <string>
+
+// streaming json encoder writing compact json directly into a reusable buffer.
+// the buffer keeps its capacity between messages, so encoding a message
+// normally doesn't allocate at all
+class JsonWriter
+{
+public:
+    JsonWriter();
+    ~JsonWriter();
+
+    // empties the buffer for a new message
+    void clear();
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    // writes object member name, must be followed by a value
+    void key(const char* name);
+    void key(const std::string& name);
+
+    void value(const char* str);
+    void value(const std::string& str);
+    void value(const char* str, size_t length);
+    void value(long long number);
+    void value(unsigned long long number);
+    void value(long number);
+    void value(unsigned long number);
+    void value(int number);
+    void value(unsigned int number);
+    void value(double number);
+    void value(bool boolean);
+    void nullValue();
+
+    // inserts already encoded json as a value
+    void rawValue(const std::string& json);
+
+    const std::string& str() const;
+    const char* c_str() const;
+    size_t size() const;
+
+private:
+    // writes separating comma when needed before a new value or member name
+    void separate();
+    void push(char open);
+    void pop(char close);
+    void writeEscaped(const char* str, size_t length);
+
+    static const int MAX_DEPTH = 32;
+
+    std::string m_buffer;
+
+    // for each nesting level, whether the next value needs a comma before it
+    bool m_needComma[MAX_DEPTH];
+    int m_depth;
+    bool m_afterKey;
+};
+
+#endif // JSONWRITER_H
@@ -0,0 +1,263 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+// how long the writer thread sleeps when there is nothing to write, in usec
+const useconds_t WRITER_IDLE_SLEEP = 5000;
+
+const char TRUNCATED_MARK[] = "...";
+
+volatile int Logger::s_level = LOG_INFO;
+Logger::Record Logger::s_ring[Logger::RING_SIZE];
+volatile uint64_t Logger::s_enqueuePos = 0;
+uint64_t Logger::s_dequeuePos = 0;
+volatile uint64_t Logger::s_dropped = 0;
+volatile bool Logger::s_running = false;
+volatile bool Logger::s_stop = false;
+pthread_t Logger::s_thread;
+
+bool Logger::init(LogLevel level)
+{
+    setLevel(level);
+    if (s_running) return true;
+
+    // each record starts free for the position it will be used at first
+    for (int i = 0; i < RING_SIZE; i++) s_ring[i].sequence = i;
+    s_enqueuePos = 0;
+    s_dequeuePos = 0;
+
+    s_stop = false;
+    s_running = pthread_create(&s_thread, NULL, Logger::writerThread, 0) == 0;
+    return s_running;
+}
+
+void Logger::shutdown()
+{
+    if (!s_running) return;
+
+    s_stop = true;
+    pthread_join(s_thread, NULL);
+    s_running = false;
+}
+
+void Logger::setLevel(LogLevel level)
+{
+    s_level = level;
+}
+
+void Logger::write(LogLevel level, const std::string& text)
+{
+    if (!enabled(level)) return;
+
+    if (!s_running)
+    {
+        output(level, text.data(), text.size());
+        return;
+    }
+
+    Record* record = reserve();
+    if (!record)
+    {
+        // errors are rare and important enough to wait for the console
+        if (level >= LOG_WARNING) output(level, text.data(), text.size());
+        return;
+    }
+
+    size_t length = text.size();
+    if (length > (size_t)RECORD_TEXT_SIZE)
+    {
+        length = RECORD_TEXT_SIZE;
+        memcpy(record->text, text.data(), length - sizeof(TRUNCATED_MARK) + 1);
+        memcpy(record->text + length - sizeof(TRUNCATED_MARK) + 1, TRUNCATED_MARK, sizeof(TRUNCATED_MARK) - 1);
+    }
+    else
+    {
+        memcpy(record->text, text.data(), length);
+    }
+    record->level = level;
+    record->length = length;
+    commit(record);
+}
+
+void Logger::writef(LogLevel level, const char* format, ...)
+{
+    if (!enabled(level)) return;
+
+    char buf[RECORD_TEXT_SIZE + 1];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (length < 0) return;
+
+    if (length > RECORD_TEXT_SIZE)
+    {
+        length = RECORD_TEXT_SIZE;
+        memcpy(buf + length - sizeof(TRUNCATED_MARK) + 1, TRUNCATED_MARK, sizeof(TRUNCATED_MARK) - 1);
+    }
+
+    if (!s_running)
+    {
+        output(level, buf, length);
+        return;
+    }
+
+    Record* record = reserve();
+    if (!record)
+    {
+        if (level >= LOG_WARNING) output(level, buf, length);
+        return;
+    }
+    memcpy(record->text, buf, length);
+    record->level = level;
+    record->length = length;
+    commit(record);
+}
+
+uint64_t Logger::dropped()
+{
+    return __sync_fetch_and_add(&s_dropped, 0);
+}
+
+LogLevel Logger::levelFromString(std::string name, LogLevel defaultLevel)
+{
+    if (name == "debug") return LOG_DEBUG;
+    if (name == "info") return LOG_INFO;
+    if (name == "warning") return LOG_WARNING;
+    if (name == "error") return LOG_ERROR;
+    if (name == "none") return LOG_NONE;
+    return defaultLevel;
+}
+
+Logger::Record* Logger::reserve()
+{
+    // bounded multi-producer queue: a record is free for position pos when
+    // its sequence equals pos, and a producer claims it by advancing s_enqueuePos
+    uint64_t pos = s_enqueuePos;
+    while (1)
+    {
+        Record* record = &s_ring[pos % RING_SIZE];
+        __sync_synchronize();
+        int64_t diff = (int64_t)record->sequence - (int64_t)pos;
+
+        if (diff == 0)
+        {
+            uint64_t previous = __sync_val_compare_and_swap(&s_enqueuePos, pos, pos + 1);
+            if (previous == pos) return record;
+            pos = previous;
+        }
+        else if (diff < 0)
+        {
+            // writer thread hasn't caught up, drop rather than block the caller
+            __sync_fetch_and_add(&s_dropped, 1);
+            return 0;
+        }
+        else
+        {
+            pos = s_enqueuePos;
+        }
+    }
+}
+
+void Logger::commit(Record* record)
+{
+    // position of the record is one less than what it becomes readable at
+    uint64_t pos = record->sequence;
+    __sync_synchronize();
+    record->sequence = pos + 1;
+}
+
+bool Logger::drain()
+{
+    bool wrote = false;
+    while (1)
+    {
+        Record* record = &s_ring[s_dequeuePos % RING_SIZE];
+        __sync_synchronize();
+        if (record->sequence != s_dequeuePos + 1) break;
+
+        output(record->level, record->text, record->length);
+        wrote = true;
+
+        __sync_synchronize();
+        record->sequence = s_dequeuePos + RING_SIZE;
+        s_dequeuePos++;
+    }
+    return wrote;
+}
+
+void Logger::output(int level, const char* text, int length)
+{
+    FILE* stream = level >= LOG_WARNING ? stderr : stdout;
+    if (level == LOG_ERROR) fputs("ERROR: ", stream);
+    else if (level == LOG_WARNING) fputs("WARNING: ", stream);
+    fwrite(text, 1, length, stream);
+    fputc('\n', stream);
+}
+
+void* Logger::writerThread(void* obj)
+{
+    (void)obj; //prevent warning
+
+    // stdout is flushed once per batch instead of once per line
+    while (1)
+    {
+        bool stopping = s_stop;
+        if (drain())
+        {
+            fflush(stdout);
+            fflush(stderr);
+        }
+        else if (stopping)
+        {
+            break;
+        }
+        else
+        {
+            usleep(WRITER_IDLE_SLEEP);
+        }
+    }
+
+    uint64_t droppedLines = dropped();
+    if (droppedLines > 0)
+    {
+        fprintf(stderr, "WARNING: %llu log lines dropped\n", (unsigned long long)droppedLines);
+    }
+    return 0;
+}
+
+LogRateLimiter::LogRateLimiter(int interval) : m_interval(interval)
+{
+}
+
+void LogRateLimiter::setInterval(int interval)
+{
+    m_interval = interval;
+}
+
+bool LogRateLimiter::allow(const std::string& key, bool force)
+{
+    if (m_interval <= 0) return true;
+
+    time_t now = time(NULL);
+    std::map<std::string, time_t>::iterator it = m_lastLogged.find(key);
+    if (it == m_lastLogged.end())
+    {
+        m_lastLogged[key] = now;
+        return true;
+    }
+    if (force || now - it->second >= m_interval)
+    {
+        it->second = now;
+        return true;
+    }
+    return false;
+}
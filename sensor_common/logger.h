@@ -0,0 +1,99 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+enum LogLevel
+{
+    LOG_DEBUG = 0,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    LOG_NONE
+};
+
+// leveled logger. writing a line copies it into a fixed size record in a
+// lock-free ring buffer, and a background thread writes the records to
+// stdout/stderr. the calling thread doesn't wait for the console. if the ring
+// is full the line is dropped and counted instead, except for warnings and
+// errors which are then written directly
+class Logger
+{
+public:
+    // starts the background writer thread. before this and after shutdown
+    // lines are written directly
+    static bool init(LogLevel level);
+
+    // writes remaining lines and stops the background thread
+    static void shutdown();
+
+    static void setLevel(LogLevel level);
+
+    // cheap check to do before building a log line
+    static bool enabled(LogLevel level) { return level >= s_level; }
+
+    static void write(LogLevel level, const std::string& text);
+    static void writef(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    // returns number of lines dropped because the ring was full
+    static uint64_t dropped();
+
+    // parses level name (debug, info, warning, error, none), returns defaultLevel if unknown
+    static LogLevel levelFromString(std::string name, LogLevel defaultLevel);
+
+private:
+    static const int RING_SIZE = 4096;
+    static const int RECORD_TEXT_SIZE = 240;
+
+    struct Record
+    {
+        volatile uint64_t sequence;
+        uint8_t level;
+        uint16_t length;
+        char text[RECORD_TEXT_SIZE];
+    };
+
+    // reserves a free record, returns 0 if the ring is full
+    static Record* reserve();
+    static void commit(Record* record);
+    static bool drain();
+    static void output(int level, const char* text, int length);
+    static void* writerThread(void* obj);
+
+    static volatile int s_level;
+    static Record s_ring[RING_SIZE];
+    static volatile uint64_t s_enqueuePos;
+    static uint64_t s_dequeuePos;
+    static volatile uint64_t s_dropped;
+    static volatile bool s_running;
+    static volatile bool s_stop;
+    static pthread_t s_thread;
+};
+
+// limits how often lines about the same thing, e.g. a device, are logged
+class LogRateLimiter
+{
+public:
+    // interval in seconds, 0 allows everything
+    LogRateLimiter(int interval = 0);
+
+    void setInterval(int interval);
+
+    // returns true if a line about key may be logged now. force always allows and restarts the interval
+    bool allow(const std::string& key, bool force = false);
+
+private:
+    int m_interval;
+    std::map<std::string, time_t> m_lastLogged;
+};
+
+#endif // LOGGER_H
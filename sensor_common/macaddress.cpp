@@ -0,0 +1,42 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "macaddress.h"
+
+#include <stdio.h>
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool parseMacAddress(const std::string& text, uint64_t& address)
+{
+    if (text.size() != 17) return false;
+
+    uint64_t value = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        int high = hexValue(text[i * 3]);
+        int low = hexValue(text[i * 3 + 1]);
+        if (high < 0 || low < 0 || (i < 5 && text[i * 3 + 2] != ':')) return false;
+        value = (value << 8) | (high << 4) | low;
+    }
+    address = value;
+    return true;
+}
+
+std::string formatMacAddress(uint64_t address)
+{
+    char text[18];
+    snprintf(text, sizeof(text), "%02X:%02X:%02X:%02X:%02X:%02X",
+             (unsigned int)(address >> 40) & 0xff, (unsigned int)(address >> 32) & 0xff,
+             (unsigned int)(address >> 24) & 0xff, (unsigned int)(address >> 16) & 0xff,
+             (unsigned int)(address >> 8) & 0xff, (unsigned int)address & 0xff);
+    return text;
+}
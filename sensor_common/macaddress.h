@@ -0,0 +1,18 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef MACADDRESS_H
+#define MACADDRESS_H
+
+#include <string>
+#include <stdint.h>
+
+// parses address like 00:11:22:AA:BB:CC into its 48 bit value, returns false if malformed
+bool parseMacAddress(const std::string& text, uint64_t& address);
+
+// formats 48 bit address as 00:11:22:AA:BB:CC
+std::string formatMacAddress(uint64_t address);
+
+#endif // MACADDRESS_H
@@ -0,0 +1,381 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "metrics.h"
+#include "jsonwriter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// percentiles reported for histograms
+const double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+const char* const PERCENTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+const int NUM_PERCENTILES = 4;
+
+// how often the server thread checks if it should stop, in ms
+const int SERVER_POLL_TIMEOUT = 500;
+
+uint64_t monotonicMicroseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t atomicRead(const volatile uint64_t& value)
+{
+    return __sync_fetch_and_add(const_cast<volatile uint64_t*>(&value), 0);
+}
+
+Counter::Counter() : m_value(0)
+{
+}
+
+void Counter::add(uint64_t amount)
+{
+    __sync_fetch_and_add(&m_value, amount);
+}
+
+uint64_t Counter::value() const
+{
+    return atomicRead(m_value);
+}
+
+Gauge::Gauge() : m_value(0)
+{
+}
+
+void Gauge::set(int64_t value)
+{
+    __sync_lock_test_and_set(&m_value, value);
+}
+
+int64_t Gauge::value() const
+{
+    return __sync_fetch_and_add(const_cast<volatile int64_t*>(&m_value), 0);
+}
+
+Histogram::Histogram() : m_count(0), m_sum(0), m_max(0)
+{
+    memset((void*)m_buckets, 0, sizeof(m_buckets));
+}
+
+void Histogram::record(uint64_t value)
+{
+    __sync_fetch_and_add(&m_buckets[bucketIndex(value)], 1);
+    __sync_fetch_and_add(&m_count, 1);
+    __sync_fetch_and_add(&m_sum, value);
+
+    uint64_t max = m_max;
+    while (value > max)
+    {
+        uint64_t previous = __sync_val_compare_and_swap(&m_max, max, value);
+        if (previous == max) break;
+        max = previous;
+    }
+}
+
+uint64_t Histogram::count() const
+{
+    return atomicRead(m_count);
+}
+
+uint64_t Histogram::sum() const
+{
+    return atomicRead(m_sum);
+}
+
+uint64_t Histogram::max() const
+{
+    return atomicRead(m_max);
+}
+
+uint64_t Histogram::percentile(double fraction) const
+{
+    uint64_t total = count();
+    if (total == 0) return 0;
+
+    uint64_t target = (uint64_t)(fraction * total);
+    if (target >= total) target = total - 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += atomicRead(m_buckets[i]);
+        if (seen > target)
+        {
+            // bucket bound may exceed the largest value actually recorded
+            uint64_t bound = bucketUpperBound(i);
+            uint64_t maxValue = max();
+            return bound < maxValue ? bound : maxValue;
+        }
+    }
+    return max();
+}
+
+int Histogram::bucketIndex(uint64_t value)
+{
+    // values below SUB_BUCKETS get exact buckets, above that each power of
+    // two is split into SUB_BUCKETS buckets using the bits after the highest one
+    if (value < (uint64_t)SUB_BUCKETS) return value;
+
+    int highestBit = 63 - __builtin_clzll(value);
+    int exponent = highestBit - SUB_BUCKET_BITS + 1;
+    int subBucket = (value >> (exponent - 1)) & (SUB_BUCKETS - 1);
+    return exponent * SUB_BUCKETS + subBucket;
+}
+
+uint64_t Histogram::bucketUpperBound(int index)
+{
+    int exponent = index / SUB_BUCKETS;
+    uint64_t subBucket = index % SUB_BUCKETS;
+    if (exponent == 0) return subBucket;
+
+    uint64_t base = (uint64_t)SUB_BUCKETS << (exponent - 1);
+    uint64_t width = (uint64_t)1 << (exponent - 1);
+    return base + (subBucket + 1) * width - 1;
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    for (unsigned int i = 0; i < m_metrics.size(); i++)
+    {
+        switch (m_metrics.at(i).type)
+        {
+        case METRIC_COUNTER: delete (Counter*)m_metrics.at(i).metric; break;
+        case METRIC_GAUGE: delete (Gauge*)m_metrics.at(i).metric; break;
+        case METRIC_HISTOGRAM: delete (Histogram*)m_metrics.at(i).metric; break;
+        }
+    }
+}
+
+Counter* MetricsRegistry::counter(std::string name, std::string help)
+{
+    Metric metric = {name, help, METRIC_COUNTER, new Counter()};
+    m_metrics.push_back(metric);
+    return (Counter*)metric.metric;
+}
+
+Gauge* MetricsRegistry::gauge(std::string name, std::string help)
+{
+    Metric metric = {name, help, METRIC_GAUGE, new Gauge()};
+    m_metrics.push_back(metric);
+    return (Gauge*)metric.metric;
+}
+
+Histogram* MetricsRegistry::histogram(std::string name, std::string help)
+{
+    Metric metric = {name, help, METRIC_HISTOGRAM, new Histogram()};
+    m_metrics.push_back(metric);
+    return (Histogram*)metric.metric;
+}
+
+void MetricsRegistry::writePrometheus(std::string& out) const
+{
+    char buf[256];
+    for (unsigned int i = 0; i < m_metrics.size(); i++)
+    {
+        const Metric& metric = m_metrics.at(i);
+        out += "# HELP " + metric.name + " " + metric.help + "\n";
+
+        switch (metric.type)
+        {
+        case METRIC_COUNTER:
+            snprintf(buf, sizeof(buf), "# TYPE %s counter\n%s %llu\n", metric.name.c_str(),
+                     metric.name.c_str(), (unsigned long long)((Counter*)metric.metric)->value());
+            out += buf;
+            break;
+        case METRIC_GAUGE:
+            snprintf(buf, sizeof(buf), "# TYPE %s gauge\n%s %lld\n", metric.name.c_str(),
+                     metric.name.c_str(), (long long)((Gauge*)metric.metric)->value());
+            out += buf;
+            break;
+        case METRIC_HISTOGRAM:
+            {
+                // hdr histograms are exported as summaries, quantiles in seconds
+                const Histogram* histogram = (Histogram*)metric.metric;
+                snprintf(buf, sizeof(buf), "# TYPE %s summary\n", metric.name.c_str());
+                out += buf;
+                for (int p = 0; p < NUM_PERCENTILES; p++)
+                {
+                    snprintf(buf, sizeof(buf), "%s{quantile=\"%g\"} %.6f\n", metric.name.c_str(),
+                             PERCENTILES[p], histogram->percentile(PERCENTILES[p]) / 1e6);
+                    out += buf;
+                }
+                snprintf(buf, sizeof(buf), "%s_sum %.6f\n%s_count %llu\n",
+                         metric.name.c_str(), histogram->sum() / 1e6,
+                         metric.name.c_str(), (unsigned long long)histogram->count());
+                out += buf;
+            }
+            break;
+        }
+    }
+}
+
+void MetricsRegistry::writeJson(JsonWriter& writer) const
+{
+    writer.beginObject();
+    for (unsigned int i = 0; i < m_metrics.size(); i++)
+    {
+        const Metric& metric = m_metrics.at(i);
+        writer.key(metric.name);
+
+        switch (metric.type)
+        {
+        case METRIC_COUNTER:
+            writer.value((unsigned long long)((Counter*)metric.metric)->value());
+            break;
+        case METRIC_GAUGE:
+            writer.value((long long)((Gauge*)metric.metric)->value());
+            break;
+        case METRIC_HISTOGRAM:
+            {
+                const Histogram* histogram = (Histogram*)metric.metric;
+                writer.beginObject();
+                writer.key("count");
+                writer.value((unsigned long long)histogram->count());
+                writer.key("sum");
+                writer.value(histogram->sum() / 1e6);
+                for (int p = 0; p < NUM_PERCENTILES; p++)
+                {
+                    writer.key(PERCENTILE_NAMES[p]);
+                    writer.value(histogram->percentile(PERCENTILES[p]) / 1e6);
+                }
+                writer.key("max");
+                writer.value(histogram->max() / 1e6);
+                writer.endObject();
+            }
+            break;
+        }
+    }
+    writer.endObject();
+}
+
+MetricsServer::MetricsServer() :
+    m_registry(0), m_socket(-1), m_running(false), m_stop(false)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    shutdown();
+}
+
+bool MetricsServer::init(const MetricsRegistry* registry, std::string address, uint16_t port)
+{
+    m_registry = registry;
+
+    m_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (m_socket < 0)
+    {
+        m_lastErrorString = "Cannot create metrics server socket";
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(m_socket, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(m_socket, 4) < 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+        m_lastErrorString = "Cannot listen metrics server address " + address;
+        return false;
+    }
+
+    m_stop = false;
+    m_running = pthread_create(&m_thread, NULL, MetricsServer::serveWrapper, this) == 0;
+    if (!m_running)
+    {
+        close(m_socket);
+        m_socket = -1;
+        m_lastErrorString = "Cannot start metrics server thread";
+        return false;
+    }
+
+    m_lastErrorString = "";
+    return true;
+}
+
+void MetricsServer::shutdown()
+{
+    if (m_running)
+    {
+        m_stop = true;
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+}
+
+std::string MetricsServer::getLastErrorString()
+{
+    return m_lastErrorString;
+}
+
+void MetricsServer::serve()
+{
+    std::string response;
+    while (!m_stop)
+    {
+        pollfd pfd = {m_socket, POLLIN, 0};
+        if (poll(&pfd, 1, SERVER_POLL_TIMEOUT) <= 0) continue;
+
+        int client = accept(m_socket, NULL, NULL);
+        if (client < 0) continue;
+
+        // any request gets the metrics, the request itself isn't interesting.
+        // read what has arrived so that closing doesn't reset the connection
+        char request[1024];
+        pollfd cfd = {client, POLLIN, 0};
+        if (poll(&cfd, 1, SERVER_POLL_TIMEOUT) > 0) recv(client, request, sizeof(request), 0);
+
+        std::string body;
+        m_registry->writePrometheus(body);
+
+        char header[128];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+                 (unsigned long)body.size());
+        response = header;
+        response += body;
+
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t len = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (len <= 0) break;
+            sent += len;
+        }
+        close(client);
+    }
+}
+
+void* MetricsServer::serveWrapper(void* obj)
+{
+    MetricsServer* server = (MetricsServer*) obj;
+    server->serve();
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+class JsonWriter;
+
+// returns monotonic time in microseconds, for measuring durations
+uint64_t monotonicMicroseconds();
+
+// monotonically increasing value. updates are lock-free
+class Counter
+{
+public:
+    Counter();
+
+    void add(uint64_t amount = 1);
+    uint64_t value() const;
+
+private:
+    volatile uint64_t m_value;
+};
+
+// value that can go up and down, e.g. queue depth
+class Gauge
+{
+public:
+    Gauge();
+
+    void set(int64_t value);
+    int64_t value() const;
+
+private:
+    volatile int64_t m_value;
+};
+
+// log-linear histogram in the style of HdrHistogram. each power of two range
+// is split to SUB_BUCKETS linear buckets, which keeps the relative error of
+// percentiles under 1/SUB_BUCKETS for any value. recording is lock-free
+class Histogram
+{
+public:
+    Histogram();
+
+    // records a value in microseconds
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t max() const;
+
+    // returns the value below which given fraction (0..1) of recorded values fall
+    uint64_t percentile(double fraction) const;
+
+private:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int EXPONENTS = 64 - SUB_BUCKET_BITS + 1;
+    static const int BUCKETS = EXPONENTS * SUB_BUCKETS;
+
+    static int bucketIndex(uint64_t value);
+    static uint64_t bucketUpperBound(int index);
+
+    volatile uint64_t m_buckets[BUCKETS];
+    volatile uint64_t m_count;
+    volatile uint64_t m_sum;
+    volatile uint64_t m_max;
+};
+
+// named collection of metrics. metrics are registered once at startup, after
+// that they can be updated from any thread and exported at the same time
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    // returned metrics are owned by the registry. histograms hold microseconds
+    // and are exported in seconds
+    Counter* counter(std::string name, std::string help);
+    Gauge* gauge(std::string name, std::string help);
+    Histogram* histogram(std::string name, std::string help);
+
+    // writes all metrics in prometheus text exposition format
+    void writePrometheus(std::string& out) const;
+
+    // writes all metrics as a json object, histograms as percentile summaries
+    void writeJson(JsonWriter& writer) const;
+
+private:
+    enum MetricType
+    {
+        METRIC_COUNTER,
+        METRIC_GAUGE,
+        METRIC_HISTOGRAM
+    };
+
+    struct Metric
+    {
+        std::string name;
+        std::string help;
+        MetricType type;
+        void* metric;
+    };
+
+    std::vector<Metric> m_metrics;
+};
+
+// serves metrics of a registry over http in prometheus text format
+class MetricsServer
+{
+public:
+    MetricsServer();
+    ~MetricsServer();
+
+    bool init(const MetricsRegistry* registry, std::string address, uint16_t port);
+    void shutdown();
+
+    std::string getLastErrorString();
+
+private:
+    void serve();
+    static void* serveWrapper(void* obj);
+
+    const MetricsRegistry* m_registry;
+    int m_socket;
+    pthread_t m_thread;
+    bool m_running;
+    volatile bool m_stop;
+
+    std::string m_lastErrorString;
+};
+
+#endif // METRICS_H
@@ -6,19 +6,92 @@
 #include "mosquittohandler.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-
-// how long connection ack is waited, in sec
-const double CONNECT_TIMEOUT = 5.0;
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <sstream>
+#include <algorithm>
+
+// how long connection ack is waited, in ms of wall clock time
+const int CONNECT_TIMEOUT = 5000;
+
+// how long a connection attempt of the race gets before the next one is started, in ms
+const int CONNECT_RACE_DELAY = 250;
+
+// waits check this often if they have been cancelled, in ms
+const int CANCEL_CHECK_INTERVAL = 10;
 
 const std::string ERROR_STRINGS[] = {"Success", "Out of memory", "Protocol error", "Invalid parameters", "Not connected", "Connection refused",
                                     "Not found", "Connection lost", "SSL error", "Invalid payload size", "Not supported", "Authentication error",
                                     "ACL denied", "Unknown error", "System call error"};
 
+// packets written by a flush besides the queued publishes, e.g. pings and subscribes
+const unsigned int FLUSH_EXTRA_WRITES = 8;
+
+static uint64_t monotonicMicroseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// tcp connection attempt of a broker address
+struct RaceCandidate
+{
+    unsigned int broker;
+    sockaddr_storage address;
+    socklen_t addressSize;
+    int family;
+    int socket;
+};
+
+// parses comma separated brokers, each host or host:port. port defaults to defaultPort
+void parseBrokerList(const std::string& text, int defaultPort, std::vector<BrokerAddress>& brokers)
+{
+    brokers.clear();
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (item.empty()) continue;
+
+        BrokerAddress broker;
+        broker.host = item;
+        broker.port = defaultPort;
+
+        // ipv6 addresses with a port are written in brackets, [::1]:1883
+        size_t colon = item.rfind(':');
+        if (item[0] == '[' && item.find(']') != std::string::npos)
+        {
+            size_t end = item.find(']');
+            broker.host = item.substr(1, end - 1);
+            if (colon == end + 1) broker.port = atoi(item.c_str() + colon + 1);
+        }
+        else if (colon != std::string::npos && item.find(':') == colon)
+        {
+            broker.host = item.substr(0, colon);
+            broker.port = atoi(item.c_str() + colon + 1);
+        }
+        brokers.push_back(broker);
+    }
+}
+
 int MosquittoHandler::numOfInstances = 0;
+volatile bool MosquittoHandler::s_waitsCancelled = false;
 
 MosquittoHandler::MosquittoHandler() :
-    m_mosquittoStruct(NULL), m_libInit(false), m_connected(false)
+    m_mosquittoStruct(NULL), m_libInit(false), m_connected(false), m_refused(false),
+    m_queuedPackets(0), m_publishedBytes(0), m_flushes(0)
 {
 }
 
@@ -63,6 +136,20 @@ bool MosquittoHandler::init(std::string id)
     return true;
 }
 
+bool MosquittoHandler::setWill(const char* willTopic, const char* text)
+{
+    if(!m_mosquittoStruct) {
+        m_lastErrorString = "Mosquitto not initialized";
+        return false;
+    }
+    int errorNum = mosquitto_will_set(m_mosquittoStruct, true, willTopic, strlen(text), (const uint8_t*)text, 0, false);
+    if(errorNum != MOSQ_ERR_SUCCESS) {
+        m_lastErrorString = errorByNum(errorNum);
+        return false;
+    }
+    return true;
+}
+
 bool MosquittoHandler::getSocket(int &socket)
 {
     if(!m_mosquittoStruct) {
@@ -95,24 +182,7 @@ bool MosquittoHandler::connectToBroker(const char *host, int port)
 
 bool MosquittoHandler::waitForConnect()
 {
-    const clock_t start = clock();
-
-    while (!m_connected)
-    {
-        loop();
-
-        clock_t now = clock();
-        clock_t delta = now - start;
-        double seconds_elapsed = static_cast<double>(delta) / CLOCKS_PER_SEC;
-
-        if (seconds_elapsed > CONNECT_TIMEOUT)
-        {
-            m_lastErrorString = "Cannot connect to broker";
-            return false;
-        }
-    }
-    m_lastErrorString = "";
-    return true;
+    return waitConnected(monotonicMicroseconds() + CONNECT_TIMEOUT * 1000ULL);
 }
 
 bool MosquittoHandler::reconnect()
@@ -127,29 +197,71 @@ bool MosquittoHandler::reconnect()
         return false;
     }
 
-    const clock_t start = clock();
-
-    while (!m_connected)
-    {
-        loop();
+    return waitConnected(monotonicMicroseconds() + CONNECT_TIMEOUT * 1000ULL);
+}
 
-        clock_t now = clock();
-        clock_t delta = now - start;
-        double seconds_elapsed = static_cast<double>(delta) / CLOCKS_PER_SEC;
+bool MosquittoHandler::connectToAny(const std::vector<BrokerAddress>& brokers, int timeout)
+{
+    if(!m_mosquittoStruct) {
+        m_lastErrorString = "Mosquitto not initialized";
+        return false;
+    }
 
-        if (seconds_elapsed > CONNECT_TIMEOUT)
+    uint64_t deadline = monotonicMicroseconds() + (uint64_t)timeout * 1000;
+    std::vector<bool> excluded(brokers.size(), false);
+    int broker;
+    while ((broker = raceConnections(brokers, excluded, deadline)) >= 0)
+    {
+        // the broker has just answered, so connecting it again doesn't block for long
+        const BrokerAddress& address = brokers.at(broker);
+        if (connectToBroker(address.host.c_str(), address.port) && waitConnected(deadline))
         {
-            m_lastErrorString = "Cannot connect to broker";
-            return false;
+            std::stringstream ss;
+            ss << address.host << ":" << address.port;
+            m_broker = ss.str();
+            return true;
         }
+        excluded[broker] = true;
     }
 
-    m_lastErrorString = "";
+    m_lastErrorString = "Cannot connect to any broker";
+    return false;
+}
+
+std::string MosquittoHandler::connectedBroker()
+{
+    return m_broker;
+}
+
+bool MosquittoHandler::disconnect()
+{
+    if(!m_mosquittoStruct) {
+        m_lastErrorString = "Mosquitto not initialized";
+        return false;
+    }
+    int errorNum = mosquitto_disconnect(m_mosquittoStruct);
+    if(errorNum != MOSQ_ERR_SUCCESS) {
+        m_lastErrorString = errorByNum(errorNum);
+        return false;
+    }
     return true;
 }
 
+void MosquittoHandler::cancelWaits()
+{
+    s_waitsCancelled = true;
+}
+
 bool MosquittoHandler::subscribe(const char* subTopic)
 {
+    if (std::find(m_subscriptions.begin(), m_subscriptions.end(), subTopic) == m_subscriptions.end())
+    {
+        m_subscriptions.push_back(subTopic);
+    }
+
+    // made when the connection is
+    if (!m_connected) return true;
+
     uint16_t mid = 1;
 
     int errorNum = mosquitto_subscribe(m_mosquittoStruct, &mid, subTopic, 0);
@@ -161,6 +273,23 @@ bool MosquittoHandler::subscribe(const char* subTopic)
     return true;
 }
 
+bool MosquittoHandler::unsubscribe(const char* subTopic)
+{
+    std::vector<std::string>::iterator it = std::find(m_subscriptions.begin(), m_subscriptions.end(), subTopic);
+    if (it != m_subscriptions.end()) m_subscriptions.erase(it);
+    if (!m_connected) return true;
+
+    uint16_t mid = 1;
+
+    int errorNum = mosquitto_unsubscribe(m_mosquittoStruct, &mid, subTopic);
+
+    if(errorNum != MOSQ_ERR_SUCCESS) {
+        m_lastErrorString = errorByNum(errorNum);
+        return false;
+    }
+    return true;
+}
+
 bool MosquittoHandler::publish(const char *pubTopic, const char *text)
 {
     std::string content(text);
@@ -178,11 +307,18 @@ bool MosquittoHandler::publish(const char *pubTopic, const char *text)
         m_lastErrorString = errorByNum(errorNum);
         return false;
     }
+
+    // qos 0 publish: fixed header, remaining length, topic length, topic and payload
+    size_t remaining = 2 + strlen(pubTopic) + strlen(text);
+    size_t lengthBytes = 1;
+    for (size_t left = remaining >> 7; left > 0; left >>= 7) lengthBytes++;
+    m_publishedBytes += 1 + lengthBytes + remaining;
+    m_queuedPackets++;
     return true;
 
 }
 
-bool MosquittoHandler::loop()
+bool MosquittoHandler::loop(int timeout)
 {
     if(!m_mosquittoStruct)
     {
@@ -190,7 +326,7 @@ bool MosquittoHandler::loop()
         return false;
     }
 
-    int errorNum = mosquitto_loop(m_mosquittoStruct, 0);
+    int errorNum = mosquitto_loop(m_mosquittoStruct, timeout);
     if(errorNum != MOSQ_ERR_SUCCESS) {
         m_lastErrorString = errorByNum(errorNum);
         return false;
@@ -233,18 +369,84 @@ bool MosquittoHandler::loopRead()
     return true;
 }
 
+bool MosquittoHandler::flush()
+{
+    if(!m_mosquittoStruct)
+    {
+        m_lastErrorString = "Mosquitto not initialized";
+        return false;
+    }
+    if (!mosquitto_want_write(m_mosquittoStruct))
+    {
+        m_queuedPackets = 0;
+        return true;
+    }
+
+    int sock = mosquitto_socket(m_mosquittoStruct);
+    int cork = 1;
+    if (sock >= 0) setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    // each write sends at most one packet. a full socket buffer leaves the
+    // rest queued, so the writes are limited to what has been queued
+    int errorNum = MOSQ_ERR_SUCCESS;
+    for (unsigned int i = 0; i < m_queuedPackets + FLUSH_EXTRA_WRITES && mosquitto_want_write(m_mosquittoStruct); i++)
+    {
+        errorNum = mosquitto_loop_write(m_mosquittoStruct);
+        if (errorNum != MOSQ_ERR_SUCCESS) break;
+    }
+
+    // uncorking sends out what was collected
+    cork = 0;
+    if (sock >= 0) setsockopt(sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    m_queuedPackets = 0;
+    m_flushes++;
+
+    if(errorNum != MOSQ_ERR_SUCCESS) {
+        m_lastErrorString = errorByNum(errorNum);
+        return false;
+    }
+    m_lastErrorString = "";
+    return true;
+}
+
+void MosquittoHandler::takeWriteStats(uint64_t& publishedBytes, unsigned int& flushes)
+{
+    publishedBytes = m_publishedBytes;
+    flushes = m_flushes;
+    m_publishedBytes = 0;
+    m_flushes = 0;
+}
+
+bool MosquittoHandler::wantWrite()
+{
+    return m_mosquittoStruct && mosquitto_want_write(m_mosquittoStruct);
+}
+
 bool MosquittoHandler::isConnected()
 {
     return m_connected;
 }
 
+// the buffer goes with the messages, so that a burst of commands doesn't
+// leave it holding memory for good
 std::vector<mqttMessage> MosquittoHandler::getArrivedMessages()
 {
-    std::vector<mqttMessage> messages = m_arrivedMessages;
-    m_arrivedMessages.clear();
+    std::vector<mqttMessage> messages;
+    messages.swap(m_arrivedMessages);
     return messages;
 }
 
+void MosquittoHandler::takeArrivedMessages(std::vector<mqttMessage>& messages)
+{
+    messages.clear();
+    messages.swap(m_arrivedMessages);
+}
+
+unsigned int MosquittoHandler::arrivedCount()
+{
+    return m_arrivedMessages.size();
+}
+
 std::string MosquittoHandler::getLastErrorString()
 {
     return m_lastErrorString;
@@ -256,13 +458,158 @@ std::string MosquittoHandler::errorByNum(int errorNum)
     return m_lastErrorString = "Unknown error";
 }
 
+// timed with the monotonic clock, clock() counted only the cpu time spent
+// and let a wait for an unresponsive broker go on for much longer
+bool MosquittoHandler::waitConnected(uint64_t deadline)
+{
+    m_refused = false;
+    while (!m_connected)
+    {
+        // a failed loop means the broker closed the connection
+        if (!loop(CANCEL_CHECK_INTERVAL) || m_refused || monotonicMicroseconds() > deadline || s_waitsCancelled)
+        {
+            m_lastErrorString = "Cannot connect to broker";
+            return false;
+        }
+    }
+    m_lastErrorString = "";
+    return true;
+}
 
-void MosquittoHandler::onConnect(int rc)
+int MosquittoHandler::raceConnections(const std::vector<BrokerAddress>& brokers, const std::vector<bool>& excluded, uint64_t deadline)
 {
-    rc = 7; // prevent warning
+    // first addresses of all brokers are tried before the second ones
+    std::vector<addrinfo*> results(brokers.size(), (addrinfo*)0);
+    for (unsigned int i = 0; i < brokers.size(); i++)
+    {
+        if (excluded.at(i)) continue;
+
+        std::stringstream port;
+        port << brokers.at(i).port;
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(brokers.at(i).host.c_str(), port.str().c_str(), &hints, &results[i]) != 0) results[i] = 0;
+    }
 
-    m_connected = true;
+    std::vector<RaceCandidate> candidates;
+    std::vector<addrinfo*> next = results;
+    bool added = true;
+    while (added)
+    {
+        added = false;
+        for (unsigned int i = 0; i < next.size(); i++)
+        {
+            if (!next[i]) continue;
+
+            RaceCandidate candidate;
+            candidate.broker = i;
+            memcpy(&candidate.address, next[i]->ai_addr, next[i]->ai_addrlen);
+            candidate.addressSize = next[i]->ai_addrlen;
+            candidate.family = next[i]->ai_family;
+            candidate.socket = -1;
+            candidates.push_back(candidate);
+            next[i] = next[i]->ai_next;
+            added = true;
+        }
+    }
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        if (results[i]) freeaddrinfo(results[i]);
+    }
+
+    int winner = -1;
+    unsigned int started = 0;
+    uint64_t nextStart = 0;
+    std::vector<pollfd> fds;
+    std::vector<unsigned int> fdCandidates;
+    while (winner < 0 && !s_waitsCancelled)
+    {
+        uint64_t now = monotonicMicroseconds();
+        if (now >= deadline) break;
+
+        fds.clear();
+        fdCandidates.clear();
+        for (unsigned int i = 0; i < started; i++)
+        {
+            if (candidates[i].socket < 0) continue;
+
+            pollfd fd;
+            fd.fd = candidates[i].socket;
+            fd.events = POLLOUT;
+            fd.revents = 0;
+            fds.push_back(fd);
+            fdCandidates.push_back(i);
+        }
+
+        // the next attempt starts when the previous one has had its time or
+        // has already failed
+        if (started < candidates.size() && (now >= nextStart || fds.empty()))
+        {
+            RaceCandidate& candidate = candidates[started++];
+            nextStart = now + CONNECT_RACE_DELAY * 1000ULL;
+            candidate.socket = socket(candidate.family, SOCK_STREAM, 0);
+            if (candidate.socket < 0) continue;
+
+            fcntl(candidate.socket, F_SETFL, fcntl(candidate.socket, F_GETFL, 0) | O_NONBLOCK);
+            if (connect(candidate.socket, (sockaddr*)&candidate.address, candidate.addressSize) == 0)
+            {
+                winner = candidate.broker;
+            }
+            else if (errno != EINPROGRESS)
+            {
+                close(candidate.socket);
+                candidate.socket = -1;
+            }
+            continue;
+        }
+        if (fds.empty()) break;
+
+        uint64_t until = started < candidates.size() ? std::min(nextStart, deadline) : deadline;
+        int timeout = std::min<uint64_t>((until - now + 999) / 1000, CANCEL_CHECK_INTERVAL * 10);
+        if (poll(&fds[0], fds.size(), timeout) <= 0) continue;
+
+        for (unsigned int i = 0; i < fds.size() && winner < 0; i++)
+        {
+            if (fds[i].revents == 0) continue;
+
+            RaceCandidate& candidate = candidates[fdCandidates[i]];
+            int error = 0;
+            socklen_t errorSize = sizeof(error);
+            if (getsockopt(candidate.socket, SOL_SOCKET, SO_ERROR, &error, &errorSize) == 0 && error == 0)
+            {
+                winner = candidate.broker;
+                continue;
+            }
+            close(candidate.socket);
+            candidate.socket = -1;
+        }
+    }
+
+    // the winning connection is only a probe, mosquitto makes its own
+    for (unsigned int i = 0; i < started; i++)
+    {
+        if (candidates[i].socket >= 0) close(candidates[i].socket);
+    }
+    return winner;
+}
+
+
+void MosquittoHandler::onConnect(int rc)
+{
+    // refused connection is as good as no connection
+    m_connected = rc == 0;
+    m_refused = rc != 0;
+    if (!m_connected) return;
     //std::cout << "Mosquitto connected." << std::endl;
+
+    // clean session starts without subscriptions
+    for (unsigned int i = 0; i < m_subscriptions.size(); i++)
+    {
+        uint16_t mid = 1;
+        mosquitto_subscribe(m_mosquittoStruct, &mid, m_subscriptions.at(i).c_str(), 0);
+    }
 }
 
 void MosquittoHandler::onDisconnect()
@@ -287,7 +634,7 @@ void MosquittoHandler::onMessage(const struct mosquitto_message *message)
     }
     else
     {
-        newMessage.content = (char*)message->payload;
+        newMessage.content.assign((char*)message->payload, message->payloadlen);
     }
     std::string content;
     if (newMessage.content.size() == 0)
@@ -8,6 +8,7 @@
 
 #include <iostream>
 #include <vector>
+#include <stdint.h>
 #include <mosquitto.h>
 
 struct mqttMessage
@@ -16,6 +17,15 @@ struct mqttMessage
     std::string content;
 };
 
+struct BrokerAddress
+{
+    std::string host;
+    int port;
+};
+
+// parses comma separated brokers, each host or host:port. port defaults to defaultPort
+void parseBrokerList(const std::string& text, int defaultPort, std::vector<BrokerAddress>& brokers);
+
 class MosquittoHandler
 {
 public:
@@ -24,17 +34,52 @@ public:
     ~MosquittoHandler();
 
     bool init(std::string id);
+
+    // message the broker sends for us if the connection drops, set before connecting
+    bool setWill(const char* willTopic, const char* text);
+
     bool getSocket(int &socket);
     bool connectToBroker(const char* host, int port);
     bool waitForConnect();
     bool reconnect();
+
+    // connects to the broker that answers first. tcp connections to the
+    // brokers are raced, a new one started every 250 ms until one succeeds,
+    // and the race is run again without the winner if it doesn't accept the
+    // mqtt connection. waits at most timeout ms in total
+    bool connectToAny(const std::vector<BrokerAddress>& brokers, int timeout);
+
+    // returns host:port of the broker connected last
+    std::string connectedBroker();
+    bool disconnect();
+
+    // makes connection waits of all instances give up, may be called from another thread
+    static void cancelWaits();
+
+    // subscriptions are remembered and made again whenever the connection is made
     bool subscribe(const char* subTopic);
+    bool unsubscribe(const char* subTopic);
     bool publish(const char* pubTopic, const char* text);
-    bool loop();
+    // handles network traffic, waits at most timeout ms for it
+    bool loop(int timeout = 0);
     bool loopWrite();
     bool loopRead();
+
+    // writes all queued packets at once. the socket is corked meanwhile, so
+    // that many small publishes go out in as few tcp segments as possible
+    bool flush();
+
+    // returns bytes of publish packets queued and flushes made since the previous call
+    void takeWriteStats(uint64_t& publishedBytes, unsigned int& flushes);
+
+    // true if there is outgoing data not yet written to the socket
+    bool wantWrite();
     bool isConnected();
     std::vector<mqttMessage> getArrivedMessages();
+
+    // moves arrived messages to messages without copying them, for busy subscribers
+    void takeArrivedMessages(std::vector<mqttMessage>& messages);
+    unsigned int arrivedCount();
     std::string getLastErrorString();
 
 
@@ -46,6 +91,7 @@ public:
 private:
 
     static int numOfInstances;
+    static volatile bool s_waitsCancelled;
 
     // static wrappers are needed to make member function callbacks work
     static void onConnectWrapper(void *obj, int rc);
@@ -58,11 +104,28 @@ private:
     */
     std::string errorByNum(int errorNum);
 
+    // loops until connected, deadline is in monotonic microseconds
+    bool waitConnected(uint64_t deadline);
+
+    // starts tcp connections to the brokers not excluded, returns index of
+    // the one that connected first or -1 if none did before the deadline
+    int raceConnections(const std::vector<BrokerAddress>& brokers, const std::vector<bool>& excluded, uint64_t deadline);
+
     struct mosquitto* m_mosquittoStruct;
     bool m_libInit;
     bool m_connected;
 
+    // broker answered the connect with an error
+    bool m_refused;
+
+    // packets queued since the previous flush, and traffic since the previous stats
+    unsigned int m_queuedPackets;
+    uint64_t m_publishedBytes;
+    unsigned int m_flushes;
+
     std::vector<mqttMessage> m_arrivedMessages;
+    std::vector<std::string> m_subscriptions;
+    std::string m_broker;
 
     std::string m_lastErrorString;
 };
@@ -0,0 +1,230 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "tracer.h"
+#include "jsonwriter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+// spans kept per thread, older ones are overwritten
+const int EVENTS_PER_THREAD = 8192;
+
+struct TraceEvent
+{
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    int tid;
+};
+
+// buffer of one thread. buffers of exited threads are reused by new ones,
+// so short lived worker threads don't each leave a buffer behind
+struct ThreadBuffer
+{
+    bool inUse;
+    int tid;
+    char name[32];
+    volatile uint64_t count;
+    TraceEvent events[EVENTS_PER_THREAD];
+    ThreadBuffer* next;
+};
+
+volatile bool Tracer::s_enabled = false;
+
+static pthread_mutex_t s_buffersMutex = PTHREAD_MUTEX_INITIALIZER;
+static ThreadBuffer* s_buffers = 0;
+static pthread_key_t s_bufferKey;
+static pthread_once_t s_keyOnce = PTHREAD_ONCE_INIT;
+static __thread ThreadBuffer* t_buffer = 0;
+
+// timestamp and clock time when tracing was enabled, for converting timestamps to microseconds
+static uint64_t s_baseTimestamp = 0;
+static uint64_t s_baseMicroseconds = 0;
+
+static uint64_t clockMicroseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void releaseBuffer(void* buffer)
+{
+    pthread_mutex_lock(&s_buffersMutex);
+    ((ThreadBuffer*)buffer)->inUse = false;
+    pthread_mutex_unlock(&s_buffersMutex);
+}
+
+static void createBufferKey()
+{
+    pthread_key_create(&s_bufferKey, releaseBuffer);
+}
+
+static ThreadBuffer* threadBuffer()
+{
+    if (t_buffer) return t_buffer;
+
+    pthread_once(&s_keyOnce, createBufferKey);
+
+    pthread_mutex_lock(&s_buffersMutex);
+    ThreadBuffer* buffer = s_buffers;
+    while (buffer && buffer->inUse) buffer = buffer->next;
+    if (!buffer)
+    {
+        buffer = new ThreadBuffer;
+        buffer->count = 0;
+        buffer->next = s_buffers;
+        s_buffers = buffer;
+    }
+    buffer->inUse = true;
+    buffer->tid = syscall(SYS_gettid);
+    snprintf(buffer->name, sizeof(buffer->name), "thread %d", buffer->tid);
+    pthread_mutex_unlock(&s_buffersMutex);
+
+    pthread_setspecific(s_bufferKey, buffer);
+    t_buffer = buffer;
+    return buffer;
+}
+
+void Tracer::setEnabled(bool enabled)
+{
+    if (enabled && s_baseTimestamp == 0)
+    {
+        s_baseTimestamp = timestamp();
+        s_baseMicroseconds = clockMicroseconds();
+    }
+    s_enabled = enabled;
+}
+
+void Tracer::setThreadName(const char* name)
+{
+    ThreadBuffer* buffer = threadBuffer();
+    pthread_mutex_lock(&s_buffersMutex);
+    strncpy(buffer->name, name, sizeof(buffer->name) - 1);
+    buffer->name[sizeof(buffer->name) - 1] = 0;
+    pthread_mutex_unlock(&s_buffersMutex);
+}
+
+uint64_t Tracer::timestamp()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void Tracer::record(const char* name, uint64_t start, uint64_t end)
+{
+    ThreadBuffer* buffer = threadBuffer();
+    TraceEvent& event = buffer->events[buffer->count % EVENTS_PER_THREAD];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.tid = buffer->tid;
+
+    // event must be complete before it's counted, a dump may run at the same time
+    __sync_synchronize();
+    buffer->count = buffer->count + 1;
+}
+
+bool Tracer::writeChromeTrace(std::string fileName, std::string& error)
+{
+    if (s_baseTimestamp == 0)
+    {
+        error = "Tracing has not been enabled";
+        return false;
+    }
+
+    // timestamp rate is measured over the whole time tracing has been on
+    uint64_t nowTimestamp = timestamp();
+    uint64_t nowMicroseconds = clockMicroseconds();
+    double ticksPerMicrosecond = 1.0;
+    if (nowMicroseconds > s_baseMicroseconds)
+    {
+        ticksPerMicrosecond = (double)(nowTimestamp - s_baseTimestamp) / (nowMicroseconds - s_baseMicroseconds);
+    }
+
+    JsonWriter writer;
+    writer.beginObject();
+    writer.key("displayTimeUnit");
+    writer.value("ms");
+    writer.key("traceEvents");
+    writer.beginArray();
+
+    int pid = getpid();
+
+    pthread_mutex_lock(&s_buffersMutex);
+    for (ThreadBuffer* buffer = s_buffers; buffer; buffer = buffer->next)
+    {
+        writer.beginObject();
+        writer.key("name");
+        writer.value("thread_name");
+        writer.key("ph");
+        writer.value("M");
+        writer.key("pid");
+        writer.value(pid);
+        writer.key("tid");
+        writer.value(buffer->tid);
+        writer.key("args");
+        writer.beginObject();
+        writer.key("name");
+        writer.value(buffer->name);
+        writer.endObject();
+        writer.endObject();
+
+        uint64_t count = buffer->count;
+        __sync_synchronize();
+        uint64_t first = count > (uint64_t)EVENTS_PER_THREAD ? count - EVENTS_PER_THREAD : 0;
+        for (uint64_t i = first; i < count; i++)
+        {
+            const TraceEvent& event = buffer->events[i % EVENTS_PER_THREAD];
+            if (event.start < s_baseTimestamp || event.end < event.start) continue;
+
+            writer.beginObject();
+            writer.key("name");
+            writer.value(event.name);
+            writer.key("ph");
+            writer.value("X");
+            writer.key("pid");
+            writer.value(pid);
+            writer.key("tid");
+            writer.value(event.tid);
+            writer.key("ts");
+            writer.value((event.start - s_baseTimestamp) / ticksPerMicrosecond);
+            writer.key("dur");
+            writer.value((event.end - event.start) / ticksPerMicrosecond);
+            writer.endObject();
+        }
+    }
+    pthread_mutex_unlock(&s_buffersMutex);
+
+    writer.endArray();
+    writer.endObject();
+
+    FILE* file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        error = "Cannot write trace file " + fileName;
+        return false;
+    }
+    bool ok = fwrite(writer.c_str(), 1, writer.size(), file) == writer.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        error = "Cannot write trace file " + fileName;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+    Office presence sensors' common parts
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <string>
+#include <stdint.h>
+
+// records timed spans of code into per-thread buffers and writes them in
+// chrome trace event format (chrome://tracing, Perfetto). when tracing is
+// disabled a span costs a single flag check
+class Tracer
+{
+public:
+    static void setEnabled(bool enabled);
+    static bool enabled() { return s_enabled; }
+
+    // names the calling thread in the trace
+    static void setThreadName(const char* name);
+
+    // writes recorded spans of all threads to a file as chrome trace json
+    static bool writeChromeTrace(std::string fileName, std::string& error);
+
+    // returns current timestamp counter value
+    static uint64_t timestamp();
+
+    // records a finished span, name must be a string literal or otherwise outlive the tracer
+    static void record(const char* name, uint64_t start, uint64_t end);
+
+private:
+    static volatile bool s_enabled;
+};
+
+// traces the lifetime of the scope it's declared in
+class TraceScope
+{
+public:
+    TraceScope(const char* name) : m_name(0)
+    {
+        if (!Tracer::enabled()) return;
+        m_name = name;
+        m_start = Tracer::timestamp();
+    }
+
+    ~TraceScope()
+    {
+        if (m_name) Tracer::record(m_name, m_start, Tracer::timestamp());
+    }
+
+private:
+    const char* m_name;
+    uint64_t m_start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+#endif // TRACER_H
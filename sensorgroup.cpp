@@ -0,0 +1,96 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#include "sensorgroup.h"
+
+#include <vector>
+
+SensorGroup::SensorGroup() :
+    m_replicas(0), m_timeout(30)
+{
+}
+
+void SensorGroup::setOwnID(const std::string& sensorID)
+{
+    if (sensorID == m_ownID) return;
+    m_ownID = sensorID;
+    m_members.erase(sensorID);
+    rebuild();
+}
+
+void SensorGroup::setReplicas(unsigned int replicas)
+{
+    m_replicas = replicas;
+}
+
+void SensorGroup::setTimeout(int timeout)
+{
+    m_timeout = timeout;
+}
+
+void SensorGroup::clear()
+{
+    m_members.clear();
+    rebuild();
+}
+
+bool SensorGroup::heartbeat(const std::string& sensorID, time_t now)
+{
+    if (sensorID == m_ownID) return false;
+
+    bool added = m_members.find(sensorID) == m_members.end();
+    m_members[sensorID] = now;
+    if (added) rebuild();
+    return added;
+}
+
+bool SensorGroup::leave(const std::string& sensorID)
+{
+    if (m_members.erase(sensorID) == 0) return false;
+    rebuild();
+    return true;
+}
+
+bool SensorGroup::expire(time_t now)
+{
+    bool changed = false;
+    std::map<std::string, time_t>::iterator it = m_members.begin();
+    while (it != m_members.end())
+    {
+        if (now - it->second > m_timeout)
+        {
+            m_members.erase(it++);
+            changed = true;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    if (changed) rebuild();
+    return changed;
+}
+
+bool SensorGroup::owns(const std::string& btAddress) const
+{
+    if (m_replicas == 0 || m_members.empty()) return true;
+    return m_ring.isResponsible(m_ownID, btAddress, m_replicas);
+}
+
+unsigned int SensorGroup::size() const
+{
+    return m_members.size() + 1;
+}
+
+void SensorGroup::rebuild()
+{
+    std::vector<std::string> nodes;
+    nodes.push_back(m_ownID);
+    for (std::map<std::string, time_t>::const_iterator it = m_members.begin(); it != m_members.end(); ++it)
+    {
+        nodes.push_back(it->first);
+    }
+    m_ring.setNodes(nodes);
+}
@@ -0,0 +1,60 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+#ifndef SENSORGROUP_H
+#define SENSORGROUP_H
+
+#include <string>
+#include <map>
+#include <time.h>
+
+#include "consistenthash.h"
+
+// sensors covering the same devices, learned from their heartbeats. devices
+// are divided between the live sensors with consistent hashing so that each
+// device is probed by only replicas sensors, and only a fair share of the
+// devices moves when a sensor joins or leaves
+class SensorGroup
+{
+public:
+    SensorGroup();
+
+    // own sensor is always a member. replicas 0 disables partitioning
+    void setOwnID(const std::string& sensorID);
+    void setReplicas(unsigned int replicas);
+
+    // sensors not heard of in timeout seconds are dropped
+    void setTimeout(int timeout);
+
+    // forgets all other sensors
+    void clear();
+
+    // records a heartbeat, returns true if the sensor is new
+    bool heartbeat(const std::string& sensorID, time_t now);
+
+    // removes a sensor that has left, returns true if it was a member
+    bool leave(const std::string& sensorID);
+
+    // drops sensors whose heartbeats have stopped, returns true if any were dropped
+    bool expire(time_t now);
+
+    // true if own sensor should probe the device
+    bool owns(const std::string& btAddress) const;
+
+    unsigned int size() const;
+
+private:
+    void rebuild();
+
+    std::string m_ownID;
+    unsigned int m_replicas;
+    int m_timeout;
+
+    // other sensors and when they were last heard of
+    std::map<std::string, time_t> m_members;
+    ConsistentHashRing m_ring;
+};
+
+#endif // SENSORGROUP_H
@@ -0,0 +1,89 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+// compares JsonWriter with jsoncpp writers when encoding discovered device
+// messages, run with optional number of iterations as argument
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+
+#include "json/json.h"
+#include "jsonwriter.h"
+
+const int DEFAULT_ITERATIONS = 200000;
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double seconds, int iterations, size_t bytes)
+{
+    printf("%-22s %8.1f ns/message %10.0f messages/s  (%lu bytes)\n", name,
+           seconds * 1e9 / iterations, iterations / seconds, (unsigned long)bytes);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = DEFAULT_ITERATIONS;
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+    const std::string name = "Tuomas' \"phone\"";
+    const std::string mac = "00:11:22:33:44:55";
+
+    // checksum keeps the compiler from optimizing the work away
+    size_t checksum = 0;
+    size_t bytes = 0;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++)
+    {
+        Json::Value root;
+        root["name"] = name;
+        root["mac"] = mac;
+        Json::StyledWriter writer;
+        std::string json = writer.write(root);
+        checksum += json.size();
+        bytes = json.size();
+    }
+    report("Json::StyledWriter", now() - start, iterations, bytes);
+
+    start = now();
+    Json::FastWriter fastWriter;
+    for (int i = 0; i < iterations; i++)
+    {
+        Json::Value root;
+        root["name"] = name;
+        root["mac"] = mac;
+        std::string json = fastWriter.write(root);
+        checksum += json.size();
+        bytes = json.size();
+    }
+    report("Json::FastWriter", now() - start, iterations, bytes);
+
+    start = now();
+    JsonWriter jsonWriter;
+    for (int i = 0; i < iterations; i++)
+    {
+        jsonWriter.clear();
+        jsonWriter.beginObject();
+        jsonWriter.key("name");
+        jsonWriter.value(name);
+        jsonWriter.key("mac");
+        jsonWriter.value(mac);
+        jsonWriter.endObject();
+        checksum += jsonWriter.size();
+        bytes = jsonWriter.size();
+    }
+    report("JsonWriter", now() - start, iterations, bytes);
+
+    printf("checksum %lu\n", (unsigned long)checksum);
+    return 0;
+}
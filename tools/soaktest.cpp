@@ -0,0 +1,648 @@
+/*
+    Office presence sensor monitoring Bluetooth devices
+    Copyright (C) 2012-2013 Tuomas Haapala, Nemein <tuomas@nemein.com>
+*/
+
+// soak and load test of the sensor. starts a local mosquitto broker, serves
+// a made up device database over http and runs the BluetoothSensor binary
+// with the simulated radio against them. meanwhile the broker is restarted,
+// devices are swapped in the database and the sensor is flooded with
+// commands. throughput, detection latency, memory growth and cpu use per
+// probe are printed every report interval, see -h for the settings
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <algorithm>
+
+#include "mosquittohandler.h"
+#include "metrics.h"
+#include "radiosimulator.h"
+
+const char* SENSOR_ID = "soak";
+
+// share of time the simulated devices are around, as in the sensor config
+const double PRESENCE = 0.5;
+
+struct Settings
+{
+    std::string sensorBinary;
+    int duration;
+    unsigned int devices;
+    unsigned int churnPercent;
+    int churnInterval;
+    unsigned int floodSize;
+    int floodInterval;
+    int brokerRestartInterval;
+    int reportInterval;
+    double latencyScale;
+    int basePort;
+};
+
+// what the simulated radio says of a device, and since when
+struct DeviceTrack
+{
+    bool present;
+    time_t changed;
+    time_t checked;
+
+    // the change hasn't been reported yet
+    bool pending;
+};
+
+// values of the sensor metrics at the previous report
+struct Sample
+{
+    double probes;
+    double cpu;
+    double resident;
+};
+
+static volatile bool stopRequested = false;
+
+static void onSignal(int)
+{
+    stopRequested = true;
+}
+
+static uint64_t wallMicroseconds()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [options]\n"
+           "  -b path   sensor binary (./BluetoothSensor)\n"
+           "  -d sec    duration of the run (3600)\n"
+           "  -n count  devices in the database (200)\n"
+           "  -c pct    devices replaced at each database change (5)\n"
+           "  -C sec    interval of database changes, 0 never (60)\n"
+           "  -f count  commands in each flood (200)\n"
+           "  -F sec    interval of command floods, 0 never (10)\n"
+           "  -r sec    interval of broker restarts, 0 never (300)\n"
+           "  -i sec    report interval (60)\n"
+           "  -l scale  simulated probe latency scale (0.01)\n"
+           "  -p port   first of the three local ports used (18830)\n", name);
+}
+
+static bool parseSettings(int argc, char** argv, Settings& settings)
+{
+    settings.sensorBinary = "./BluetoothSensor";
+    settings.duration = 3600;
+    settings.devices = 200;
+    settings.churnPercent = 5;
+    settings.churnInterval = 60;
+    settings.floodSize = 200;
+    settings.floodInterval = 10;
+    settings.brokerRestartInterval = 300;
+    settings.reportInterval = 60;
+    settings.latencyScale = 0.01;
+    settings.basePort = 18830;
+
+    int option;
+    while ((option = getopt(argc, argv, "b:d:n:c:C:f:F:r:i:l:p:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'b': settings.sensorBinary = optarg; break;
+        case 'd': settings.duration = atoi(optarg); break;
+        case 'n': settings.devices = atoi(optarg); break;
+        case 'c': settings.churnPercent = atoi(optarg); break;
+        case 'C': settings.churnInterval = atoi(optarg); break;
+        case 'f': settings.floodSize = atoi(optarg); break;
+        case 'F': settings.floodInterval = atoi(optarg); break;
+        case 'r': settings.brokerRestartInterval = atoi(optarg); break;
+        case 'i': settings.reportInterval = atoi(optarg); break;
+        case 'l': settings.latencyScale = atof(optarg); break;
+        case 'p': settings.basePort = atoi(optarg); break;
+        default: return false;
+        }
+    }
+    return settings.duration > 0 && settings.devices > 0 && settings.reportInterval > 0 && settings.basePort > 0;
+}
+
+// runs the program with its output going to logFile in workDir
+static pid_t startProcess(const std::string& workDir, const std::string& logFile, const std::vector<std::string>& args)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    if (chdir(workDir.c_str()) < 0) _exit(127);
+    int fd = open(logFile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0)
+    {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+
+    std::vector<char*> argv;
+    for (unsigned int i = 0; i < args.size(); i++) argv.push_back((char*)args.at(i).c_str());
+    argv.push_back(0);
+    execvp(argv[0], &argv[0]);
+    _exit(127);
+}
+
+static void stopProcess(pid_t pid)
+{
+    if (pid <= 0) return;
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+}
+
+static pid_t startBroker(const std::string& workDir, int port)
+{
+    std::stringstream ss;
+    ss << port;
+    std::vector<std::string> args;
+    args.push_back("mosquitto");
+    args.push_back("-p");
+    args.push_back(ss.str());
+    return startProcess(workDir, "mosquitto.log", args);
+}
+
+static bool writeSensorConfig(const std::string& fileName, const Settings& settings)
+{
+    FILE* file = fopen(fileName.c_str(), "w");
+    if (!file) return false;
+    fprintf(file, "broker_address=127.0.0.1\n");
+    fprintf(file, "broker_port=%d\n", settings.basePort);
+    fprintf(file, "data_fetch_url=127.0.0.1:%d/api/connection\n", settings.basePort + 1);
+    fprintf(file, "connect_attempt_interval=1\n");
+    fprintf(file, "device_cache_file=\n");
+    fprintf(file, "db_retry_interval=5\n");
+    fprintf(file, "db_refresh_jitter=0\n");
+    fprintf(file, "metrics_interval=0\n");
+    fprintf(file, "metrics_address=127.0.0.1\n");
+    fprintf(file, "metrics_port=%d\n", settings.basePort + 2);
+    fprintf(file, "log_level=warning\n");
+    fprintf(file, "sensor_id=%s\n", SENSOR_ID);
+    fprintf(file, "simulated_radio=1\n");
+    fprintf(file, "simulated_presence=%g\n", PRESENCE);
+    fprintf(file, "simulated_latency_scale=%g\n", settings.latencyScale);
+    fclose(file);
+    return true;
+}
+
+// serves the device database to the sensor, one request per connection
+class DatabaseServer
+{
+public:
+    DatabaseServer() : m_socket(-1), m_running(false), m_stop(false)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    ~DatabaseServer()
+    {
+        shutdown();
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    bool init(int port)
+    {
+        m_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_socket < 0) return false;
+        int reuse = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(m_socket, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_socket, 8) < 0) return false;
+
+        m_running = pthread_create(&m_thread, NULL, DatabaseServer::serveWrapper, this) == 0;
+        return m_running;
+    }
+
+    void shutdown()
+    {
+        m_stop = true;
+        if (m_running) pthread_join(m_thread, NULL);
+        m_running = false;
+        if (m_socket >= 0) close(m_socket);
+        m_socket = -1;
+    }
+
+    void setDevices(const std::vector<std::string>& devices)
+    {
+        std::string body = "[";
+        for (unsigned int i = 0; i < devices.size(); i++)
+        {
+            if (i > 0) body += ",";
+            body += "{\"type\": \"bluetooth\", \"identifier\": \"" + devices.at(i) + "\"}";
+        }
+        body += "]";
+
+        pthread_mutex_lock(&m_mutex);
+        m_body = body;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    void serve()
+    {
+        while (!m_stop)
+        {
+            pollfd fd;
+            fd.fd = m_socket;
+            fd.events = POLLIN;
+            fd.revents = 0;
+            if (poll(&fd, 1, 100) <= 0) continue;
+
+            int client = accept(m_socket, NULL, NULL);
+            if (client < 0) continue;
+
+            // the request itself doesn't matter, only its end is waited for
+            std::string request;
+            char buffer[1024];
+            while (request.find("\r\n\r\n") == std::string::npos)
+            {
+                ssize_t size = recv(client, buffer, sizeof(buffer), 0);
+                if (size <= 0) break;
+                request.append(buffer, size);
+            }
+
+            pthread_mutex_lock(&m_mutex);
+            std::string body = m_body;
+            pthread_mutex_unlock(&m_mutex);
+
+            std::stringstream response;
+            response << "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << body.size()
+                     << "\r\nConnection: close\r\n\r\n" << body;
+            std::string data = response.str();
+            size_t sent = 0;
+            while (sent < data.size())
+            {
+                ssize_t size = send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (size <= 0) break;
+                sent += size;
+            }
+            close(client);
+        }
+    }
+
+    static void* serveWrapper(void* obj)
+    {
+        ((DatabaseServer*)obj)->serve();
+        return 0;
+    }
+
+    int m_socket;
+    pthread_t m_thread;
+    bool m_running;
+    volatile bool m_stop;
+    pthread_mutex_t m_mutex;
+    std::string m_body;
+};
+
+// reads the sensor metrics of interest from its http endpoint
+static bool scrapeMetrics(int port, std::map<std::string, double>& values)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        send(sock, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0)
+    {
+        close(sock);
+        return false;
+    }
+
+    std::string response;
+    char buffer[4096];
+    ssize_t size;
+    while ((size = recv(sock, buffer, sizeof(buffer), 0)) > 0) response.append(buffer, size);
+    close(sock);
+
+    std::stringstream lines(response);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+        std::string::size_type space = line.find(' ');
+        if (space == std::string::npos) continue;
+        values[line.substr(0, space)] = atof(line.c_str() + space + 1);
+    }
+    return !values.empty();
+}
+
+static std::string makeAddress(unsigned int serial)
+{
+    char address[18];
+    snprintf(address, sizeof(address), "5A:00:%02X:%02X:%02X:%02X",
+             (serial >> 24) & 0xff, (serial >> 16) & 0xff, (serial >> 8) & 0xff, serial & 0xff);
+    return address;
+}
+
+// follows the simulated presence of the device up to now. the radio decides
+// presence by whole seconds, so the second of each change is exact
+static void updateTrack(RadioSimulator& radio, const std::string& address, DeviceTrack& track, time_t now)
+{
+    for (time_t t = track.checked + 1; t <= now; t++)
+    {
+        bool present = radio.isPresent(address, t);
+        if (present == track.present) continue;
+        track.present = present;
+        track.changed = t;
+        track.pending = true;
+    }
+    track.checked = now;
+}
+
+int main(int argc, char** argv)
+{
+    Settings settings;
+    if (!parseSettings(argc, argv, settings))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char resolved[PATH_MAX];
+    if (!realpath(settings.sensorBinary.c_str(), resolved))
+    {
+        fprintf(stderr, "Sensor binary %s not found\n", settings.sensorBinary.c_str());
+        return 1;
+    }
+    settings.sensorBinary = resolved;
+
+    char workDirTemplate[] = "/tmp/bt_soak_XXXXXX";
+    if (!mkdtemp(workDirTemplate))
+    {
+        fprintf(stderr, "Cannot create work directory\n");
+        return 1;
+    }
+    std::string workDir = workDirTemplate;
+    if (!writeSensorConfig(workDir + "/sensor.ini", settings))
+    {
+        fprintf(stderr, "Cannot write sensor config\n");
+        return 1;
+    }
+    printf("Logs and files of the run are in %s\n", workDir.c_str());
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    RadioSimulator radio(PRESENCE, 0);
+    time_t now = time(NULL);
+    unsigned int nextSerial = 0;
+    std::vector<std::string> devices;
+    std::map<std::string, DeviceTrack> tracks;
+    for (unsigned int i = 0; i < settings.devices; i++) devices.push_back(makeAddress(nextSerial++));
+
+    DatabaseServer database;
+    database.setDevices(devices);
+    if (!database.init(settings.basePort + 1))
+    {
+        fprintf(stderr, "Cannot serve the device database at port %d\n", settings.basePort + 1);
+        return 1;
+    }
+
+    pid_t broker = startBroker(workDir, settings.basePort);
+    usleep(500000);
+
+    std::vector<std::string> sensorArgs;
+    sensorArgs.push_back(settings.sensorBinary);
+    sensorArgs.push_back("sensor.ini");
+    pid_t sensor = startProcess(workDir, "sensor.log", sensorArgs);
+
+    std::vector<BrokerAddress> brokers;
+    BrokerAddress local;
+    local.host = "127.0.0.1";
+    local.port = settings.basePort;
+    brokers.push_back(local);
+
+    MosquittoHandler mosquitto;
+    mosquitto.init("bt-soak-driver");
+    mosquitto.subscribe((std::string("sensor/") + SENSOR_ID + "/bluetooth/#").c_str());
+    mosquitto.connectToAny(brokers, 5000);
+
+    const std::string resultPrefix = std::string("sensor/") + SENSOR_ID + "/bluetooth/";
+    const std::string historyTopic = std::string("command/history/bluetooth/") + SENSOR_ID;
+
+    Histogram latency;
+    uint64_t results = 0;
+    uint64_t wrongResults = 0;
+    uint64_t commandsSent = 0;
+    uint64_t commandsAnswered = 0;
+    unsigned int brokerRestarts = 0;
+    unsigned int databaseChanges = 0;
+    int64_t maxArrived = 0;
+
+    time_t start = now;
+    time_t lastTick = now;
+    time_t nextChurn = now + settings.churnInterval;
+    time_t nextFlood = now + settings.floodInterval;
+    time_t nextRestart = now + settings.brokerRestartInterval;
+    time_t brokerDownUntil = 0;
+    time_t nextReport = now + settings.reportInterval;
+    time_t nextReconnect = 0;
+
+    // memory is compared to the first report, startup allocations are done by then
+    bool haveBaseline = false;
+    Sample baseline;
+    double baselineTime = 0;
+    Sample previous;
+    memset(&previous, 0, sizeof(previous));
+    uint64_t previousResults = 0;
+    uint64_t previousAnswered = 0;
+    int status = 0;
+
+    printf("%8s %9s %9s %8s %8s %8s %8s %9s %9s %10s %8s %6s\n", "time", "results/s", "answers/s",
+           "p50 s", "p90 s", "p99 s", "max s", "rss MB", "growth/h", "cpu us/pr", "arrived", "wrong");
+
+    while (!stopRequested && now - start < settings.duration)
+    {
+        mosquitto.loop(10);
+        std::vector<mqttMessage> messages = mosquitto.getArrivedMessages();
+        uint64_t received = wallMicroseconds();
+        now = received / 1000000;
+
+        for (unsigned int i = 0; i < messages.size(); i++)
+        {
+            const mqttMessage& message = messages.at(i);
+            if (message.topic.compare(0, resultPrefix.size(), resultPrefix) != 0) continue;
+            std::string name = message.topic.substr(resultPrefix.size());
+            if (name == "history")
+            {
+                commandsAnswered++;
+                continue;
+            }
+            if (name != "available" && name != "unavailable") continue;
+
+            std::map<std::string, DeviceTrack>::iterator it = tracks.find(message.content);
+            if (it == tracks.end()) continue;
+            results++;
+
+            // the probe may have started a moment before the change
+            DeviceTrack& track = it->second;
+            updateTrack(radio, it->first, track, now);
+            bool available = name == "available";
+            if (available != track.present)
+            {
+                if (!track.pending && now - track.changed > 1) wrongResults++;
+                continue;
+            }
+            if (!track.pending) continue;
+            track.pending = false;
+            latency.record(received - track.changed * 1000000ULL);
+        }
+
+        // start following new devices once a second, from their current state
+        if (now != lastTick)
+        {
+            lastTick = now;
+            for (unsigned int i = 0; i < devices.size(); i++)
+            {
+                std::map<std::string, DeviceTrack>::iterator it = tracks.find(devices.at(i));
+                if (it != tracks.end())
+                {
+                    updateTrack(radio, it->first, it->second, now);
+                    continue;
+                }
+                DeviceTrack track;
+                track.present = radio.isPresent(devices.at(i), now);
+                track.changed = now;
+                track.checked = now;
+                track.pending = false;
+                tracks[devices.at(i)] = track;
+            }
+
+            pid_t exited = waitpid(sensor, &status, WNOHANG);
+            if (exited == sensor)
+            {
+                fprintf(stderr, "Sensor exited with status %d, see %s/sensor.log\n", status, workDir.c_str());
+                sensor = 0;
+                break;
+            }
+        }
+
+        if (settings.brokerRestartInterval > 0 && now >= nextRestart)
+        {
+            stopProcess(broker);
+            broker = 0;
+            brokerRestarts++;
+            brokerDownUntil = now + 2;
+            nextRestart = now + settings.brokerRestartInterval;
+        }
+        if (broker == 0 && now >= brokerDownUntil) broker = startBroker(workDir, settings.basePort);
+
+        if (!mosquitto.isConnected())
+        {
+            if (broker != 0 && now >= nextReconnect)
+            {
+                mosquitto.connectToAny(brokers, 1000);
+                nextReconnect = now + 1;
+            }
+            usleep(10000);
+            continue;
+        }
+
+        // swap some devices for new ones and make the sensor fetch the database
+        if (settings.churnInterval > 0 && now >= nextChurn)
+        {
+            nextChurn = now + settings.churnInterval;
+            unsigned int count = devices.size() * settings.churnPercent / 100;
+            for (unsigned int i = 0; i < count; i++)
+            {
+                unsigned int index = rand() % devices.size();
+                tracks.erase(devices.at(index));
+                devices.at(index) = makeAddress(nextSerial++);
+            }
+            database.setDevices(devices);
+            mosquitto.publish("command/fetch_device_database", "");
+            databaseChanges++;
+        }
+
+        if (settings.floodInterval > 0 && now >= nextFlood)
+        {
+            nextFlood = now + settings.floodInterval;
+            for (unsigned int i = 0; i < settings.floodSize; i++)
+            {
+                std::stringstream command;
+                command << "{\"id\": " << commandsSent << ", \"device\": \"" << devices.at(i % devices.size())
+                        << "\", \"intervals\": 3}";
+                mosquitto.publish(historyTopic.c_str(), command.str().c_str());
+                commandsSent++;
+            }
+            mosquitto.flush();
+        }
+
+        if (now < nextReport) continue;
+        nextReport = now + settings.reportInterval;
+
+        std::map<std::string, double> metrics;
+        if (!scrapeMetrics(settings.basePort + 2, metrics)) continue;
+        Sample sample;
+        sample.probes = metrics["bt_sensor_probes_total"];
+        sample.cpu = metrics["bt_sensor_cpu_microseconds_total"];
+        sample.resident = metrics["bt_sensor_resident_memory_bytes"];
+        maxArrived = std::max(maxArrived, (int64_t)metrics["bt_sensor_arrived_messages"]);
+
+        double elapsed = now - start;
+        double growth = 0;
+        if (!haveBaseline)
+        {
+            baseline = sample;
+            baselineTime = elapsed;
+            haveBaseline = true;
+        }
+        else if (elapsed > baselineTime)
+        {
+            growth = (sample.resident - baseline.resident) / (elapsed - baselineTime) * 3600;
+        }
+        double probes = sample.probes - previous.probes;
+        printf("%8.0f %9.1f %9.1f %8.2f %8.2f %8.2f %8.2f %9.1f %9.1f %10.1f %8lld %6llu\n", elapsed,
+               (results - previousResults) / (double)settings.reportInterval,
+               (commandsAnswered - previousAnswered) / (double)settings.reportInterval,
+               latency.percentile(0.5) / 1e6, latency.percentile(0.9) / 1e6, latency.percentile(0.99) / 1e6,
+               latency.max() / 1e6, sample.resident / 1048576, growth / 1048576,
+               probes > 0 ? (sample.cpu - previous.cpu) / probes : 0, (long long)maxArrived,
+               (unsigned long long)wrongResults);
+        fflush(stdout);
+        previous = sample;
+        previousResults = results;
+        previousAnswered = commandsAnswered;
+    }
+
+    printf("\n%llu results, %llu detected changes, %llu wrong results\n", (unsigned long long)results,
+           (unsigned long long)latency.count(), (unsigned long long)wrongResults);
+    printf("%llu of %llu commands answered, %u database changes, %u broker restarts\n",
+           (unsigned long long)commandsAnswered, (unsigned long long)commandsSent, databaseChanges, brokerRestarts);
+
+    mosquitto.disconnect();
+    stopProcess(sensor);
+    stopProcess(broker);
+    database.shutdown();
+    return sensor == 0 ? 1 : 0;
+}